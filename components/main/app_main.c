@@ -6,38 +6,22 @@
 #include "esp_spi_flash.h"
 #include "peripheral.h"
 #include "vm.h"
+#include "service.h"
+#include "builtins.h"
+#include "output.h"
+
+// too large for the main task stack
+static VM vm;
 
 void app_main(void)
 {
-    InputData data = read_data_from_usb_serial();
-    ExecResult result = tarto_vm_run((char*) data.content);
-
-    switch(result.type) {
-        case SUCCESS: {
-            if (result.return_value.type == VAL_NUMBER) {
-                printf("return val: %d\n", result.return_value.as.number);
-            }
-            break;
-        }
-        // TODO: エラー対応．ホスト側も合わせて要検討
-        case ERROR_DIVISION_BY_ZERO: {
-            printf("error\n");
-            break;
-        }
-        case ERROR_UNKNOWN_OPCODE: {
-            printf("error\n");
-            break;
-        }
-        case ERROR_NO_METHOD: {
-            break;
-        }
-        case ERROR_OTHER: {
-            break;
-        }
-    }
+    usb_serial_init();
+    vm.builtins = &device_builtins;
+    // the UART driver and the VM stay up, programs are served back to back
+    service_loop(&vm);
 
     // restart
-    free(data.content);
+    output_flush();
     vTaskDelay(1000 / portTICK_PERIOD_MS);
     printf("Restarting now.\n");
     fflush(stdout);
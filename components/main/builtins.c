@@ -0,0 +1,79 @@
+#include "peripheral.h"
+#include "builtins.h"
+
+// a level or mode: true, false or a number, nonzero for high and output
+static bool as_level(Value value, bool *level)
+{
+    if (IS_BOOL(value)) {
+        *level = AS_BOOL(value);
+    } else if (IS_NUMBER(value)) {
+        *level = AS_NUMBER(value) != 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// pin_mode(pin, output)
+static resultType builtin_pin_mode(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+    bool output;
+    if (!IS_NUMBER(args[0]) || !as_level(args[1], &output)) {
+        return ERROR_TYPE;
+    }
+    return gpio_pin_mode(AS_NUMBER(args[0]), output) ? SUCCESS : ERROR_OTHER;
+}
+
+// pin_write(pin, level), batched to set several pins in one instruction
+static resultType builtin_pin_write(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+    bool level;
+    if (!IS_NUMBER(args[0]) || !as_level(args[1], &level)) {
+        return ERROR_TYPE;
+    }
+    return gpio_pin_write(AS_NUMBER(args[0]), level) ? SUCCESS : ERROR_OTHER;
+}
+
+// pin_read(pin): 0 or 1
+static resultType builtin_pin_read(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+    bool level;
+    if (!IS_NUMBER(args[0])) {
+        return ERROR_TYPE;
+    }
+    if (!gpio_pin_read(AS_NUMBER(args[0]), &level)) {
+        return ERROR_OTHER;
+    }
+    *result = NUMBER_VAL(level);
+    return SUCCESS;
+}
+
+// pin_toggle(pin): the new level
+static resultType builtin_pin_toggle(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+    bool level;
+    if (!IS_NUMBER(args[0])) {
+        return ERROR_TYPE;
+    }
+    uint8_t pin = AS_NUMBER(args[0]);
+    if (!gpio_pin_read(pin, &level) || !gpio_pin_write(pin, !level)) {
+        return ERROR_OTHER;
+    }
+    *result = NUMBER_VAL(!level);
+    return SUCCESS;
+}
+
+static const Builtin entries[] = {
+    [BUILTIN_MIN] = {"min", builtin_min, 2},
+    [BUILTIN_MAX] = {"max", builtin_max, 2},
+    [BUILTIN_CLAMP] = {"clamp", builtin_clamp, 3},
+    [BUILTIN_EMA] = {"ema", builtin_ema, 3},
+    [BUILTIN_CRC16] = {"crc16", builtin_crc16, BUILTIN_VARIADIC},
+    [BUILTIN_PIN_MODE] = {"pin_mode", builtin_pin_mode, 2},
+    [BUILTIN_PIN_WRITE] = {"pin_write", builtin_pin_write, 2},
+    [BUILTIN_PIN_READ] = {"pin_read", builtin_pin_read, 1},
+    [BUILTIN_PIN_TOGGLE] = {"pin_toggle", builtin_pin_toggle, 1},
+};
+
+// what OP_CALL_NATIVE calls on the device, and on the host with mock pins
+const BuiltinTable device_builtins = {entries, sizeof(entries) / sizeof(entries[0])};
@@ -0,0 +1,17 @@
+#include "vm.h"
+
+// Index of each builtin in device_builtins, the operand of OP_CALL_NATIVE.
+// Programs depend on these, so new builtins go at the end.
+typedef enum {
+    BUILTIN_MIN,
+    BUILTIN_MAX,
+    BUILTIN_CLAMP,
+    BUILTIN_EMA,
+    BUILTIN_CRC16,
+    BUILTIN_PIN_MODE,
+    BUILTIN_PIN_WRITE,
+    BUILTIN_PIN_READ,
+    BUILTIN_PIN_TOGGLE,
+} builtinIndex;
+
+extern const BuiltinTable device_builtins;
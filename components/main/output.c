@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "peripheral.h"
+#include "output.h"
+
+// Single producer, single consumer ring. head and tail count bytes from
+// the start and wrap around as integers; the producer only writes head,
+// the driver only writes tail, and each publishes its side with a release
+// store after touching the bytes, so neither needs a lock.
+#define RING_MASK (OUTPUT_RING_SIZE - 1)
+#define TEXT_MAX 160
+
+_Static_assert((OUTPUT_RING_SIZE & RING_MASK) == 0, "OUTPUT_RING_SIZE must be a power of two");
+
+static uint8_t ring[OUTPUT_RING_SIZE];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static uint32_t dropped = 0;
+static bool started = false;
+
+// Sends what is queued, from the driver task.
+static void drain()
+{
+    uint32_t t = tail;
+    uint32_t h;
+    while ((h = __atomic_load_n(&head, __ATOMIC_ACQUIRE)) != t) {
+        uint32_t offset = t & RING_MASK;
+        uint32_t n = h - t;
+        if (n > OUTPUT_RING_SIZE - offset) {
+            n = OUTPUT_RING_SIZE - offset;
+        }
+        write_usb_serial(ring + offset, n);
+        t += n;
+        __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    }
+}
+
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static TaskHandle_t driver = NULL;
+
+static void driver_task(void *arg)
+{
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        drain();
+    }
+}
+
+static void driver_start()
+{
+    xTaskCreate(driver_task, "output_driver", 2048, NULL, 10, &driver);
+}
+
+static void driver_wake()
+{
+    xTaskNotifyGive(driver);
+}
+
+static void driver_wait()
+{
+    vTaskDelay(1);
+}
+#else
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+static sem_t pending;
+
+static void *driver_thread(void *arg)
+{
+    for (;;) {
+        sem_wait(&pending);
+        drain();
+    }
+    return NULL;
+}
+
+static void driver_start()
+{
+    pthread_t thread;
+    sem_init(&pending, 0, 0);
+    pthread_create(&thread, NULL, driver_thread, NULL);
+    pthread_detach(thread);
+}
+
+static void driver_wake()
+{
+    sem_post(&pending);
+}
+
+static void driver_wait()
+{
+    struct timespec ts = {0, 1000000L};
+    nanosleep(&ts, NULL);
+}
+#endif
+
+void output_init()
+{
+    if (started) {
+        return;
+    }
+    driver_start();
+    started = true;
+}
+
+bool output_write(const uint8_t *data, uint32_t len)
+{
+    uint32_t h = head;
+    uint32_t space = OUTPUT_RING_SIZE - (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+    if (!started || len > space) {
+        dropped++;
+        return false;
+    }
+    uint32_t offset = h & RING_MASK;
+    uint32_t first = len < OUTPUT_RING_SIZE - offset ? len : OUTPUT_RING_SIZE - offset;
+    memcpy(ring + offset, data, first);
+    memcpy(ring, data + first, len - first);
+    __atomic_store_n(&head, h + len, __ATOMIC_RELEASE);
+    driver_wake();
+    return true;
+}
+
+bool output_text(const char *format, ...)
+{
+    char text[TEXT_MAX];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (n < 0) {
+        return false;
+    }
+    return output_write((const uint8_t*) text, n < TEXT_MAX ? n : TEXT_MAX - 1);
+}
+
+bool output_reply(uint8_t type, const uint8_t *payload, uint8_t size)
+{
+    uint8_t frame[REPLY_HEADER_SIZE + REPLY_PAYLOAD_MAX] = {FRAME_SYNC, type, size};
+    memcpy(frame + REPLY_HEADER_SIZE, payload, size);
+    return output_write(frame, REPLY_HEADER_SIZE + size);
+}
+
+void output_flush()
+{
+    while (started && __atomic_load_n(&tail, __ATOMIC_ACQUIRE) != head) {
+        driver_wait();
+    }
+}
+
+uint32_t output_dropped()
+{
+    return dropped;
+}
@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "vm.h"
+
+// Everything the service sends goes through a ring buffer that a driver
+// task drains to the serial line, so the interpreter never waits for the
+// UART. There is one producer, the service task.
+#ifndef OUTPUT_RING_SIZE
+#define OUTPUT_RING_SIZE 2048
+#endif
+
+void output_init();
+// Queues len bytes, all or nothing. Never blocks: when the ring is full the
+// bytes are dropped and counted, and false is returned.
+bool output_write(const uint8_t*, uint32_t);
+bool output_text(const char*, ...);
+// Queues a reply frame.
+bool output_reply(uint8_t type, const uint8_t* payload, uint8_t size);
+// Waits until the driver has sent everything queued so far.
+void output_flush();
+uint32_t output_dropped();
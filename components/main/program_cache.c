@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include "peripheral.h"
+#include "program_cache.h"
+#include "vm.h"
+
+// Programs received over the serial line are appended to the cache region
+// as entries keyed by program_hash, so a later FRAME_RUN_CACHED request can
+// run them straight from (mapped) flash without another transfer.
+//
+// entry: magic, hash, size (u4 each, native order), image padded to 4 bytes.
+// The image is written before the header and the magic last, so an entry
+// cut short by a reset never looks valid. Anything that does not scan as
+// entries followed by erased space gets the whole region erased.
+
+#define ENTRY_MAGIC 0x43564d54
+#define ERASED_WORD 0xFFFFFFFF
+#define ALIGN4(n) (((n) + 3) & ~(uint32_t)3)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t hash;
+    uint32_t size;
+} CacheEntry;
+
+static FlashRegion region;
+static bool opened = false;
+// where the next entry goes
+static uint32_t end = 0;
+
+static bool is_erased(uint32_t offset, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if (region.base[offset + i] != 0xFF) return false;
+    }
+    return true;
+}
+
+static bool open_cache()
+{
+    if (opened) return true;
+    if (!flash_region_open(REGION_CACHE, &region)) return false;
+    uint32_t offset = 0;
+    while (offset + sizeof(CacheEntry) <= region.size) {
+        CacheEntry entry;
+        memcpy(&entry, region.base + offset, sizeof(CacheEntry));
+        if (entry.magic != ENTRY_MAGIC || entry.size > region.size - offset - sizeof(CacheEntry)) {
+            break;
+        }
+        offset += sizeof(CacheEntry) + ALIGN4(entry.size);
+    }
+    if (offset > region.size) offset = region.size;
+    if (!is_erased(offset, region.size - offset)) {
+        if (!flash_region_erase(REGION_CACHE, region.size)) return false;
+        offset = 0;
+    }
+    end = offset;
+    opened = true;
+    return true;
+}
+
+bool program_cache_find(uint32_t hash, const uint8_t **data, uint32_t *size)
+{
+    if (!open_cache()) return false;
+    uint32_t offset = 0;
+    while (offset < end) {
+        CacheEntry entry;
+        memcpy(&entry, region.base + offset, sizeof(CacheEntry));
+        const uint8_t *image = region.base + offset + sizeof(CacheEntry);
+        if (entry.hash == hash && program_hash(image, entry.size) == hash) {
+            *data = image;
+            *size = entry.size;
+            return true;
+        }
+        offset += sizeof(CacheEntry) + ALIGN4(entry.size);
+    }
+    return false;
+}
+
+// Stores a program unless it is cached already. A full region is erased
+// and filled again from the start.
+bool program_cache_store(const uint8_t *data, uint32_t size)
+{
+    const uint8_t *cached;
+    uint32_t cached_size;
+    uint32_t hash = program_hash(data, size);
+    if (program_cache_find(hash, &cached, &cached_size)) return true;
+    if (!opened) return false;
+
+    uint32_t need = sizeof(CacheEntry) + ALIGN4(size);
+    if (need > region.size) return false;
+    if (need > region.size - end) {
+        if (!flash_region_erase(REGION_CACHE, region.size)) return false;
+        end = 0;
+    }
+    CacheEntry entry = {ENTRY_MAGIC, hash, size};
+    bool ok = flash_region_write(REGION_CACHE, end + sizeof(CacheEntry), data, size)
+        && flash_region_write(REGION_CACHE, end + sizeof(uint32_t), (const uint8_t*) &entry.hash, sizeof(CacheEntry) - sizeof(uint32_t))
+        && flash_region_write(REGION_CACHE, end, (const uint8_t*) &entry.magic, sizeof(uint32_t));
+    if (!ok) {
+        // the next scan finds the torn entry and erases the region
+        opened = false;
+        return false;
+    }
+    end += need;
+    return true;
+}
@@ -0,0 +1,5 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+bool program_cache_find(uint32_t hash, const uint8_t **data, uint32_t *size);
+bool program_cache_store(const uint8_t *data, uint32_t size);
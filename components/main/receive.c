@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <string.h>
+#include "peripheral.h"
+#include "receive.h"
+#include "program_cache.h"
+#include "output.h"
+
+#define UNFRAMED_BUF_SIZE 1024
+#define READ_TIMEOUT_MS 100
+// a frame is dropped when the line stays silent this long in the middle of it
+#define FRAME_TIMEOUT_MS 1000
+// compressed programs are read this much at a time
+#define LZ_CHUNK 64
+
+static uint32_t read_u4(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Reads exactly len bytes unless the line goes quiet or closes.
+static bool read_exact(uint8_t *buf, uint32_t len)
+{
+    uint32_t done = 0;
+    while (done < len) {
+        int n = read_usb_serial(buf + done, len - done, FRAME_TIMEOUT_MS);
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Drops the len bytes left of a frame that is refused, so they are not
+// taken for the next request; gives up when the line goes quiet.
+static void discard(uint32_t len)
+{
+    uint8_t buf[LZ_CHUNK];
+    while (len > 0) {
+        int n = read_usb_serial(buf, len < sizeof(buf) ? len : sizeof(buf), FRAME_TIMEOUT_MS);
+        if (n <= 0) return;
+        len -= n;
+    }
+}
+
+// An unframed program is whatever arrives with its first byte, as
+// read_data_from_usb_serial has always done it. It is echoed back unless
+// the echo is off.
+static void receive_unframed(ReceivedProgram *program, uint8_t first)
+{
+    uint8_t *data = malloc(UNFRAMED_BUF_SIZE + 1);
+    data[0] = first;
+    int n = read_usb_serial(data + 1, UNFRAMED_BUF_SIZE - 1, READ_TIMEOUT_MS);
+    uint32_t size = 1 + (n > 0 ? n : 0);
+    data[size] = '\0';
+    if (usb_serial_echo()) {
+        output_write(data, size);
+    }
+    program->data = data;
+    program->size = size;
+}
+
+static void receive_failed(ReceivedProgram *program)
+{
+    // incomplete frame
+    if (program->state != STREAM_ERROR) {
+        free_bytecode(&program->bytecode);
+    }
+    program->state = STREAM_ERROR;
+}
+
+// A compressed program is inflated chunk by chunk into the buffer of the
+// whole image and parsed as it grows, so the compressed image is never held
+// in memory; LZ_CHUNK bytes of it at a time are.
+static void receive_compressed(ReceivedProgram *program, const uint8_t *head, uint32_t remaining)
+{
+    uint32_t size = compressed_program_size(head);
+    uint8_t *data = size >= MAGIC_SIZE ? malloc(size) : NULL;
+    if (data == NULL) {
+        discard(remaining);
+        return;
+    }
+    memcpy(data, head, MAGIC_SIZE);
+    data[MAGIC_SIZE-1] &= ~BINARY_COMPRESSED;
+    program->data = data;
+    program->size = size;
+
+    ProgramStream stream;
+    program_stream_init(&stream, &program->bytecode, data, size);
+    program->state = STREAM_MAGIC;
+    LzStream z;
+    lz_init(&z);
+    uint32_t inflated = MAGIC_SIZE;
+    uint8_t chunk[LZ_CHUNK];
+    while (remaining > 0) {
+        int n = read_usb_serial(chunk, remaining < LZ_CHUNK ? remaining : LZ_CHUNK, FRAME_TIMEOUT_MS);
+        if (n <= 0) {
+            receive_failed(program);
+            return;
+        }
+        remaining -= n;
+        if (program->state == STREAM_ERROR) {
+            // drain the rest of the frame
+            continue;
+        }
+        if (!lz_inflate(&z, chunk, n, data, size, &inflated)) {
+            free_bytecode(&program->bytecode);
+            program->state = STREAM_ERROR;
+            continue;
+        }
+        program->state = program_stream_parse(&stream, inflated);
+    }
+    if (program->state != STREAM_ERROR && (inflated != size || z.state != LZ_CONTROL)) {
+        free_bytecode(&program->bytecode);
+        program->state = STREAM_ERROR;
+    }
+}
+
+// Receives a framed program straight into its final buffer and hands every
+// chunk to the stream parser, so constant pools are built while the rest of
+// the program is still on the wire.
+static void receive_framed(ReceivedProgram *program)
+{
+    uint8_t header[FRAME_HEADER_SIZE];
+    program->framed = true;
+    program->state = STREAM_ERROR;
+    if (!read_exact(header + 1, FRAME_HEADER_SIZE - 1)) {
+        return;
+    }
+    uint32_t size = read_u4(header + 2);
+    if (header[1] == FRAME_RUN_CACHED) {
+        uint8_t payload[RUN_CACHED_PAYLOAD_SIZE];
+        if (size != RUN_CACHED_PAYLOAD_SIZE) {
+            discard(size);
+        } else if (read_exact(payload, size)) {
+            program->run_cached = true;
+            program->hash = read_u4(payload);
+        }
+        return;
+    }
+    if (header[1] == FRAME_SET_SERIAL) {
+        uint8_t payload[SET_SERIAL_PAYLOAD_SIZE];
+        if (size != SET_SERIAL_PAYLOAD_SIZE) {
+            discard(size);
+        } else if (read_exact(payload, size)) {
+            program->set_serial = true;
+            program->baud = read_u4(payload);
+            program->flow_control = payload[4] & SERIAL_FLOW_CONTROL;
+        }
+        return;
+    }
+    if (header[1] != FRAME_PROGRAM && header[1] != FRAME_PROGRAM_KEEP_GLOBALS && header[1] != FRAME_PROGRAM_PERSISTENT) {
+        discard(size);
+        return;
+    }
+    program->keep_globals = header[1] == FRAME_PROGRAM_KEEP_GLOBALS;
+    program->persistent = header[1] == FRAME_PROGRAM_PERSISTENT;
+    // the magic says whether the rest is compressed
+    uint8_t head[COMPRESSED_HEADER_SIZE];
+    uint32_t head_size = size < COMPRESSED_HEADER_SIZE ? size : COMPRESSED_HEADER_SIZE;
+    if (!read_exact(head, head_size)) {
+        return;
+    }
+    if (is_compressed_program(head, head_size)) {
+        receive_compressed(program, head, size - head_size);
+        return;
+    }
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    if (data == NULL) {
+        discard(size - head_size);
+        return;
+    }
+    memcpy(data, head, head_size);
+    program->data = data;
+    program->size = size;
+
+    ProgramStream stream;
+    program_stream_init(&stream, &program->bytecode, data, size);
+    program->state = program_stream_parse(&stream, head_size);
+    uint32_t received = head_size;
+    while (received < size) {
+        int n = read_usb_serial(data + received, size - received, FRAME_TIMEOUT_MS);
+        if (n <= 0) {
+            receive_failed(program);
+            return;
+        }
+        received += n;
+        if (program->state != STREAM_ERROR) {
+            program->state = program_stream_parse(&stream, received);
+        }
+    }
+}
+
+ReceivedProgram receive_program()
+{
+    ReceivedProgram program;
+    memset(&program, 0, sizeof(ReceivedProgram));
+    uint8_t first;
+    int n;
+    while ((n = read_usb_serial(&first, 1, READ_TIMEOUT_MS)) == 0) {}
+    if (n < 0) {
+        program.closed = true;
+        return program;
+    }
+    if (first == FRAME_SYNC) {
+        receive_framed(&program);
+    } else {
+        receive_unframed(&program, first);
+    }
+    return program;
+}
+
+ExecResult run_received_program(VM *vm, ReceivedProgram *program)
+{
+    ExecResult result;
+    if (program->set_serial) {
+        // whatever is queued still goes out at the old rate
+        output_flush();
+        if (usb_serial_configure(program->baud, program->flow_control)) {
+            result = EXEC_RESULT(SUCCESS, NIL_VAL());
+        } else {
+            result = EXEC_RESULT(ERROR_OTHER, NIL_VAL());
+        }
+    } else if (program->run_cached) {
+        const uint8_t *data;
+        uint32_t size;
+        if (program_cache_find(program->hash, &data, &size)) {
+            // parse_binary only reads the image, so it can stay in flash
+            result = tarto_vm_run_binary(vm, (uint8_t*) data, size);
+        } else {
+            result = EXEC_RESULT(ERROR_NOT_CACHED, NIL_VAL());
+        }
+    } else if (program->framed) {
+        if (program->state == STREAM_DONE) {
+            program_cache_store(program->data, program->size);
+            result = tarto_vm_run_parsed(vm, &program->bytecode);
+        } else {
+            result = EXEC_RESULT(ERROR_INVALID_PROGRAM, NIL_VAL());
+        }
+    } else if (is_binary_program(program->data, program->size)) {
+        result = tarto_vm_run_binary(vm, program->data, program->size);
+    } else {
+        result = tarto_vm_run(vm, (char*) program->data);
+    }
+    free(program->data);
+    program->data = NULL;
+    return result;
+}
@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "vm.h"
+
+typedef struct {
+    bool framed;
+    bool keep_globals;
+    // snapshotted while it runs, see snapshot_store.h
+    bool persistent;
+    // run the cached program with this hash instead
+    bool run_cached;
+    uint32_t hash;
+    // switch the serial line to baud, with or without flow control
+    bool set_serial;
+    uint32_t baud;
+    bool flow_control;
+    // the serial port went away (host stand-in only)
+    bool closed;
+    uint8_t *data;
+    uint32_t size;
+    // framed programs are parsed while they arrive
+    Bytecode bytecode;
+    streamState state;
+} ReceivedProgram;
+
+ReceivedProgram receive_program();
+ExecResult run_received_program(VM*, ReceivedProgram*);
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include "peripheral.h"
+#include "receive.h"
+#include "output.h"
+#include "snapshot_store.h"
+#include "service.h"
+
+// Every program gets exactly one reply, so the host can send the next one
+// as soon as it has read it: a line of text for unframed programs, which
+// come from a serial monitor, a reply frame for framed requests.
+static void print_result(VM *vm, ExecResult result)
+{
+    switch(result.type) {
+        case SUCCESS: {
+            if (IS_NUMBER(result.return_value)) {
+                output_text("return val: %d\n", AS_NUMBER(result.return_value));
+            } else {
+                output_text("return val: -\n");
+            }
+            break;
+        }
+        case ERROR_INVALID_PROGRAM: {
+            if (vm->error.reason != NULL) {
+                output_text("error: %s (function %d, offset %d)\n", vm->error.reason, vm->error.function, vm->error.offset);
+            } else {
+                output_text("error\n");
+            }
+            break;
+        }
+        case ERROR_NOT_CACHED: {
+            output_text("not cached\n");
+            break;
+        }
+        // TODO: エラー対応．ホスト側も合わせて要検討
+        default: {
+            output_text("error\n");
+            break;
+        }
+    }
+}
+
+static uint8_t put_u2(uint8_t *p, uint32_t value)
+{
+    value = value > 0xFFFF ? 0xFFFF : value;
+    p[0] = value >> 8;
+    p[1] = value;
+    return 2;
+}
+
+static void reply_result(VM *vm, ExecResult result)
+{
+    uint8_t payload[REPLY_PAYLOAD_MAX];
+    uint8_t size = 0;
+    if (result.type == SUCCESS) {
+        if (IS_NUMBER(result.return_value)) {
+            size += put_u2(payload, AS_NUMBER(result.return_value));
+        }
+        output_reply(REPLY_RESULT, payload, size);
+        return;
+    }
+    payload[size++] = result.type;
+    if (result.type == ERROR_INVALID_PROGRAM && vm->error.reason != NULL) {
+        size += put_u2(payload + size, vm->error.function);
+        size += put_u2(payload + size, vm->error.offset);
+        size_t reason = strlen(vm->error.reason);
+        if (reason > REPLY_PAYLOAD_MAX - size) {
+            reason = REPLY_PAYLOAD_MAX - size;
+        }
+        memcpy(payload + size, vm->error.reason, reason);
+        size += reason;
+    }
+    output_reply(REPLY_ERROR, payload, size);
+}
+
+static void reply_telemetry(VM *vm)
+{
+    HeapStats stats = heap_stats(vm);
+    uint8_t payload[10] = {
+        stats.live_bytes >> 24, stats.live_bytes >> 16, stats.live_bytes >> 8, stats.live_bytes,
+    };
+    put_u2(payload + 4, stats.collections);
+    put_u2(payload + 6, stats.max_pause_us);
+    put_u2(payload + 8, output_dropped());
+    output_reply(REPLY_TELEMETRY, payload, sizeof(payload));
+}
+
+static bool telemetry = false;
+
+void service_set_telemetry(bool on)
+{
+    telemetry = on;
+}
+
+// Finishes the persistent program of the stored snapshot, if there is
+// one, after a restart. Nobody asked for the result; it goes out as a
+// reply frame all the same.
+static uint32_t resume_snapshot(VM *vm)
+{
+    Bytecode b;
+    uint8_t *data;
+    vm->error.reason = NULL;
+    if (!snapshot_store_restore(vm, &b, &data)) {
+        return 0;
+    }
+    vm->checkpoint = snapshot_store_checkpoint;
+    ExecResult result = exec_resume(vm, &b);
+    vm->checkpoint = NULL;
+    snapshot_store_clear();
+    free_bytecode(&b);
+    free(data);
+    reply_result(vm, result);
+    if (telemetry) {
+        reply_telemetry(vm);
+    }
+    return result.type != SUCCESS;
+}
+
+// Runs programs back to back as they arrive, without restarting. The VM
+// is reset by every run; globals survive only when the frame asks for it.
+// Returns the number of failed programs once the serial line closes, which
+// only happens on the host.
+uint32_t service_loop(VM *vm)
+{
+    output_init();
+    uint32_t failed = resume_snapshot(vm);
+    for (;;) {
+        ReceivedProgram program = receive_program();
+        if (program.closed) {
+            output_flush();
+            return failed;
+        }
+        vm->retain_globals = program.keep_globals;
+        vm->error.reason = NULL;
+        vm->checkpoint = program.persistent ? snapshot_store_checkpoint : NULL;
+        ExecResult result = run_received_program(vm, &program);
+        if (program.persistent) {
+            vm->checkpoint = NULL;
+            snapshot_store_clear();
+        }
+        if (result.type != SUCCESS) {
+            failed++;
+        }
+        if (program.framed) {
+            reply_result(vm, result);
+            if (telemetry) {
+                reply_telemetry(vm);
+            }
+        } else {
+            print_result(vm, result);
+        }
+#ifdef TARTO_VM_PROFILE
+        // the report is printed straight to stdout, after the result
+        output_flush();
+        profile_report(vm);
+        fflush(stdout);
+#endif
+    }
+}
@@ -0,0 +1,7 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "vm.h"
+
+uint32_t service_loop(VM*);
+// a REPLY_TELEMETRY frame after the reply to every framed request
+void service_set_telemetry(bool);
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "peripheral.h"
+#include "snapshot_store.h"
+
+// A new snapshot replaces the old one: the sectors it needs are erased,
+// then it is written with its magic last. A reset in between loses the
+// snapshot, but never leaves a damaged one that looks valid.
+
+#if defined(ESP_PLATFORM)
+#include "esp_timer.h"
+
+static uint32_t now_ms()
+{
+    return esp_timer_get_time() / 1000;
+}
+#else
+#include <time.h>
+
+static uint32_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000u + ts.tv_nsec / 1000000;
+}
+#endif
+
+static uint32_t interval = SNAPSHOT_INTERVAL_MS;
+static uint32_t saved = 0;
+static uint32_t last = 0;
+static void (*observer)(uint32_t) = NULL;
+
+void snapshot_store_set_interval(uint32_t ms)
+{
+    interval = ms;
+}
+
+void snapshot_store_set_observer(void (*f)(uint32_t))
+{
+    observer = f;
+}
+
+void snapshot_store_checkpoint(VM *vm, Bytecode *b)
+{
+    uint32_t now = now_ms();
+    if (saved > 0 && now - last < interval) {
+        return;
+    }
+    FlashRegion region;
+    uint32_t size = snapshot_size(vm, b);
+    if (size == 0 || !flash_region_open(REGION_SNAPSHOT, &region) || size > region.size) {
+        return;
+    }
+    uint8_t *snapshot = malloc(size);
+    if (snapshot == NULL) {
+        return;
+    }
+    bool ok = snapshot_save(vm, b, snapshot)
+        && flash_region_erase(REGION_SNAPSHOT, size)
+        && flash_region_write(REGION_SNAPSHOT, sizeof(uint32_t), snapshot + sizeof(uint32_t), size - sizeof(uint32_t))
+        && flash_region_write(REGION_SNAPSHOT, 0, snapshot, sizeof(uint32_t));
+    free(snapshot);
+    last = now;
+    if (ok) {
+        saved++;
+        if (observer != NULL) {
+            observer(saved);
+        }
+    }
+}
+
+// The snapshot is copied out of flash, since the program's own
+// checkpoints erase it while it runs.
+bool snapshot_store_restore(VM *vm, Bytecode *b, uint8_t **data)
+{
+    FlashRegion region;
+    if (!flash_region_open(REGION_SNAPSHOT, &region) || region.size < 2 * sizeof(uint32_t)) {
+        return false;
+    }
+    uint32_t head[2];
+    memcpy(head, region.base, sizeof(head));
+    if (head[0] != SNAPSHOT_MAGIC || head[1] > region.size) {
+        return false;
+    }
+    uint8_t *copy = malloc(head[1]);
+    if (copy == NULL) {
+        return false;
+    }
+    memcpy(copy, region.base, head[1]);
+    if (snapshot_restore(vm, b, copy, head[1]) != SUCCESS) {
+        free(copy);
+        snapshot_store_clear();
+        return false;
+    }
+    *data = copy;
+    return true;
+}
+
+void snapshot_store_clear()
+{
+    FlashRegion region;
+    if (flash_region_open(REGION_SNAPSHOT, &region) && region.base[0] != 0xFF) {
+        flash_region_erase(REGION_SNAPSHOT, sizeof(uint32_t));
+    }
+}
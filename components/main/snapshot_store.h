@@ -0,0 +1,20 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "vm.h"
+
+// Snapshots of the running persistent program, kept in the "tvmsnap"
+// flash region, so it resumes where it was after a restart. One is taken
+// at most every SNAPSHOT_INTERVAL_MS, at a checkpoint of the program.
+#ifndef SNAPSHOT_INTERVAL_MS
+#define SNAPSHOT_INTERVAL_MS 10000
+#endif
+
+void snapshot_store_set_interval(uint32_t ms);
+// called with the number of snapshots written so far after each one
+void snapshot_store_set_observer(void (*)(uint32_t));
+// the VM.checkpoint of persistent programs
+void snapshot_store_checkpoint(VM*, Bytecode*);
+// Puts the stored snapshot back into vm, with its program in b. *data is
+// the copy b points into, to be freed once the program is done.
+bool snapshot_store_restore(VM*, Bytecode*, uint8_t **data);
+void snapshot_store_clear();
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "esp_log.h"
+#include "peripheral.h"
+
+static const char *TAG = "tvmflash";
+
+// see partitions.csv
+static const struct {
+    esp_partition_subtype_t subtype;
+    const char *label;
+} partitions[REGION_COUNT] = {
+    [REGION_CACHE] = {0x40, "tvmcache"},
+    [REGION_SNAPSHOT] = {0x41, "tvmsnap"},
+};
+
+static const esp_partition_t *partition[REGION_COUNT];
+static const uint8_t *mapped[REGION_COUNT];
+
+// Maps the whole partition once; cached programs are then parsed and run
+// straight out of flash, and snapshots read from it.
+bool flash_region_open(regionId id, FlashRegion *region)
+{
+    if (mapped[id] == NULL) {
+        partition[id] = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, partitions[id].subtype, partitions[id].label);
+        if (partition[id] == NULL) {
+            ESP_LOGW(TAG, "no %s partition", partitions[id].label);
+            return false;
+        }
+        const void *p;
+        spi_flash_mmap_handle_t handle;
+        if (esp_partition_mmap(partition[id], 0, partition[id]->size, SPI_FLASH_MMAP_DATA, &p, &handle) != ESP_OK) {
+            ESP_LOGW(TAG, "mmap of %s failed", partitions[id].label);
+            return false;
+        }
+        mapped[id] = p;
+    }
+    region->base = mapped[id];
+    region->size = partition[id]->size;
+    return true;
+}
+
+bool flash_region_write(regionId id, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+    return esp_partition_write(partition[id], offset, data, len) == ESP_OK;
+}
+
+bool flash_region_erase(regionId id, uint32_t size)
+{
+    uint32_t sectors = (size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+    if (sectors > partition[id]->size) sectors = partition[id]->size;
+    return esp_partition_erase_range(partition[id], 0, sectors) == ESP_OK;
+}
@@ -0,0 +1,30 @@
+#include <stdbool.h>
+#include "driver/gpio.h"
+#include "peripheral.h"
+
+bool gpio_pin_mode(uint8_t pin, bool output)
+{
+    if (!(output ? GPIO_IS_VALID_OUTPUT_GPIO(pin) : GPIO_IS_VALID_GPIO(pin))) {
+        return false;
+    }
+    gpio_reset_pin(pin);
+    // an output reads back the level it drives
+    return gpio_set_direction(pin, output ? GPIO_MODE_INPUT_OUTPUT : GPIO_MODE_INPUT) == ESP_OK;
+}
+
+bool gpio_pin_write(uint8_t pin, bool level)
+{
+    if (!GPIO_IS_VALID_OUTPUT_GPIO(pin)) {
+        return false;
+    }
+    return gpio_set_level(pin, level) == ESP_OK;
+}
+
+bool gpio_pin_read(uint8_t pin, bool* level)
+{
+    if (!GPIO_IS_VALID_GPIO(pin)) {
+        return false;
+    }
+    *level = gpio_get_level(pin) != 0;
+    return true;
+}
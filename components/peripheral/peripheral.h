@@ -1,8 +1,91 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Framed transfer: sync byte, frame type, u4 payload length (big endian),
+// then the payload. Anything not starting with FRAME_SYNC is an unframed
+// program.
+#define FRAME_SYNC 0xA5
+#define FRAME_HEADER_SIZE 6
+
+typedef enum {
+  FRAME_PROGRAM = 1,
+  // same, but the globals of the previous program are kept
+  FRAME_PROGRAM_KEEP_GLOBALS = 2,
+  // payload: u4 hash (big endian) of a program received earlier
+  FRAME_RUN_CACHED = 3,
+  // payload: SET_SERIAL_PAYLOAD_SIZE bytes, see below
+  FRAME_SET_SERIAL = 4,
+  // a program that is snapshotted at its checkpoints and resumed from the
+  // last snapshot after a restart, see components/main/snapshot_store.c
+  FRAME_PROGRAM_PERSISTENT = 5,
+} frameType;
+
+#define RUN_CACHED_PAYLOAD_SIZE 4
+// FRAME_SET_SERIAL payload: u4 baud rate (big endian), u1 flags. The reply
+// goes out at the new rate, so the host switches right after sending it.
+#define SET_SERIAL_PAYLOAD_SIZE 5
+#define SERIAL_FLOW_CONTROL 0x01
+
+// Replies to framed requests: sync byte, frame type, u1 payload length,
+// then the payload. Numbers are big endian.
+#define REPLY_HEADER_SIZE 3
+#define REPLY_PAYLOAD_MAX 255
+
+typedef enum {
+  // payload: u2 return value, empty when it is not a number
+  REPLY_RESULT = 0x10,
+  // payload: u1 resultType; for a rejected program also u2 function,
+  // u2 offset and the reason
+  REPLY_ERROR = 0x11,
+  // payload: u4 live heap bytes, u2 collections, u2 longest pause (us),
+  // u2 replies dropped because the output buffer was full
+  REPLY_TELEMETRY = 0x12,
+} replyType;
 
 typedef struct {
   uint16_t size;
   uint8_t* content;
 } InputData;
 
+void usb_serial_init();
+int read_usb_serial(uint8_t*, uint32_t, uint32_t);
+void write_usb_serial(const uint8_t*, uint32_t);
 InputData read_data_from_usb_serial();
+// Switches UART0 to another baud rate, with or without RTS/CTS hardware
+// flow control, once everything written so far is out.
+bool usb_serial_configure(uint32_t, bool);
+// whether unframed input is echoed back, on by default
+void usb_serial_set_echo(bool);
+bool usb_serial_echo();
+
+// Storage behind the program cache and VM snapshots: the "tvmcache" and
+// "tvmsnap" flash partitions on the device, mmap'd files on the host. It
+// reads like flash: erased bytes are 0xFF and a write can only clear bits.
+typedef enum {
+  REGION_CACHE,
+  REGION_SNAPSHOT,
+  REGION_COUNT,
+} regionId;
+
+// erases go by whole sectors
+#define FLASH_SECTOR_SIZE 4096
+
+typedef struct {
+  const uint8_t* base;
+  uint32_t size;
+} FlashRegion;
+
+bool flash_region_open(regionId, FlashRegion*);
+bool flash_region_write(regionId, uint32_t, const uint8_t*, uint32_t);
+// erases the sectors holding the first size bytes
+bool flash_region_erase(regionId, uint32_t size);
+
+// Digital pins, for the GPIO builtins: the ESP32 GPIO matrix on the device,
+// a mock that records levels on the host. False for pins that do not exist
+// or cannot do what is asked.
+#define GPIO_PIN_COUNT 40
+
+bool gpio_pin_mode(uint8_t pin, bool output);
+bool gpio_pin_write(uint8_t pin, bool level);
+bool gpio_pin_read(uint8_t pin, bool* level);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
@@ -17,7 +18,7 @@ static const char *TAG = "uart_events";
  * - port: UART0
  * - rx buffer: on
  * - tx buffer: on
- * - flow control: off
+ * - flow control: off, RTS/CTS after usb_serial_configure
  * - event queue: on
  * - pin assignment: txd(default), rxd(default)
  */
@@ -25,6 +26,15 @@ static const char *TAG = "uart_events";
 #define EX_UART_NUM UART_NUM_0
 
 #define BUF_SIZE (1024)
+// RTS/CTS of UART0 for hardware flow control; the USB bridge has to have
+// them wired
+#ifndef SERIAL_RTS_PIN
+#define SERIAL_RTS_PIN 22
+#endif
+#ifndef SERIAL_CTS_PIN
+#define SERIAL_CTS_PIN 19
+#endif
+#define MAX_BAUD 5000000
 static QueueHandle_t uart0_queue;
 
 // usb serialからuart0でデータを受信する
@@ -38,7 +48,7 @@ static void uart_event_task(void *pvParameters)
         // Receive an item from a queue
         // 参照: https://www.freertos.org/a00118.html
         if(xQueueReceive(uart0_queue, (void * )&event, (portTickType)portMAX_DELAY)) {
-            ESP_LOGI(TAG, "uart[%d] event:", EX_UART_NUM);
+            ESP_LOGD(TAG, "uart[%d] event:", EX_UART_NUM);
             switch(event.type) {
                 //Event of UART receving data
                 /*We'd better handler data event fast, there would be much more data events than
@@ -47,41 +57,41 @@ static void uart_event_task(void *pvParameters)
                 in this example, we don't process data in event, but read data outside.*/
                 case UART_DATA:
                     uart_get_buffered_data_len(EX_UART_NUM, &buffered_size);
-                    ESP_LOGI(TAG, "data, len: %d; buffered len: %d", event.size, buffered_size);
+                    ESP_LOGD(TAG, "data, len: %d; buffered len: %d", event.size, buffered_size);
                     break;
                 //Event of HW FIFO overflow detected
                 case UART_FIFO_OVF:
-                    ESP_LOGI(TAG, "hw fifo overflow\n");
+                    ESP_LOGW(TAG, "hw fifo overflow\n");
                     //If fifo overflow happened, you should consider adding flow control for your application.
                     //We can read data out out the buffer, or directly flush the rx buffer.
                     uart_flush(EX_UART_NUM);
                     break;
                 //Event of UART ring buffer full
                 case UART_BUFFER_FULL:
-                    ESP_LOGI(TAG, "ring buffer full\n");
+                    ESP_LOGW(TAG, "ring buffer full\n");
                     //If buffer full happened, you should consider encreasing your buffer size
                     //We can read data out out the buffer, or directly flush the rx buffer.
                     uart_flush(EX_UART_NUM);
                     break;
                 //Event of UART RX break detected
                 case UART_BREAK:
-                    ESP_LOGI(TAG, "uart rx break\n");
+                    ESP_LOGW(TAG, "uart rx break\n");
                     break;
                 //Event of UART parity check error
                 case UART_PARITY_ERR:
-                    ESP_LOGI(TAG, "uart parity error\n");
+                    ESP_LOGW(TAG, "uart parity error\n");
                     break;
                 //Event of UART frame error
                 case UART_FRAME_ERR:
-                    ESP_LOGI(TAG, "uart frame error\n");
+                    ESP_LOGW(TAG, "uart frame error\n");
                     break;
                 //UART_PATTERN_DET
                 case UART_PATTERN_DET:
-                    ESP_LOGI(TAG, "uart pattern detected\n");
+                    ESP_LOGD(TAG, "uart pattern detected\n");
                     break;
                 //Others
                 default:
-                    ESP_LOGI(TAG, "uart event type: %d\n", event.type);
+                    ESP_LOGD(TAG, "uart event type: %d\n", event.type);
                     break;
             }
         }
@@ -91,8 +101,24 @@ static void uart_event_task(void *pvParameters)
     vTaskDelete(NULL);
 }
 
-InputData read_data_from_usb_serial()
+static bool initialized = false;
+static bool echo = true;
+
+void usb_serial_set_echo(bool on)
+{
+    echo = on;
+}
+
+bool usb_serial_echo()
+{
+    return echo;
+}
+
+void usb_serial_init()
 {
+    if (initialized) {
+        return;
+    }
     uart_config_t uart_config = {
       .baud_rate = 115200,
       .data_bits = UART_DATA_8_BITS,
@@ -103,8 +129,9 @@ InputData read_data_from_usb_serial()
     };
     //Set UART parameters
     uart_param_config(EX_UART_NUM, &uart_config);
-    //Set UART log level
-    esp_log_level_set(TAG, ESP_LOG_INFO);
+    //Set UART log level: the log goes to UART0 too, where it would land in
+    //the middle of reply frames, so only errors are printed
+    esp_log_level_set(TAG, ESP_LOG_WARN);
     //Install UART driver, and get the queue.
     uart_driver_install(EX_UART_NUM, BUF_SIZE * 2, BUF_SIZE * 2, 10, &uart0_queue, 0);
 
@@ -115,19 +142,53 @@ InputData read_data_from_usb_serial()
     uart_enable_pattern_det_intr(EX_UART_NUM, '+', 3, 10000, 10, 10);
     //Create a task to handler UART event from ISR
     xTaskCreate(uart_event_task, "uart_event_task", 2048, NULL, 12, NULL);
+    initialized = true;
+}
+
+bool usb_serial_configure(uint32_t baud, bool flow_control)
+{
+    usb_serial_init();
+    if (baud == 0 || baud > MAX_BAUD) {
+        return false;
+    }
+    uart_wait_tx_done(EX_UART_NUM, portMAX_DELAY);
+    if (flow_control) {
+        uart_set_pin(EX_UART_NUM, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, SERIAL_RTS_PIN, SERIAL_CTS_PIN);
+    }
+    if (uart_set_baudrate(EX_UART_NUM, baud) != ESP_OK) {
+        return false;
+    }
+    uart_hw_flowcontrol_t mode = flow_control ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE;
+    return uart_set_hw_flow_ctrl(EX_UART_NUM, mode, 122) == ESP_OK;
+}
+
+// Reads up to len bytes, waiting at most timeout_ms for them.
+// Returns the number of bytes read, 0 on timeout.
+int read_usb_serial(uint8_t* buf, uint32_t len, uint32_t timeout_ms)
+{
+    usb_serial_init();
+    int n = uart_read_bytes(EX_UART_NUM, buf, len, timeout_ms / portTICK_RATE_MS);
+    return n > 0 ? n : 0;
+}
+
+void write_usb_serial(const uint8_t* buf, uint32_t len)
+{
+    usb_serial_init();
+    uart_write_bytes(EX_UART_NUM, (const char*)buf, len);
+}
+
+InputData read_data_from_usb_serial()
+{
     //process data
     uint8_t* data = (uint8_t*) malloc(BUF_SIZE);
     do {
-        int len = uart_read_bytes(EX_UART_NUM, data, BUF_SIZE, 100 / portTICK_RATE_MS);
+        int len = read_usb_serial(data, BUF_SIZE, 100);
         if(len > 0) {
-            ESP_LOGI(TAG, "uart read : %d", len);
-            uart_write_bytes(EX_UART_NUM, (const char*)data, len);
+            ESP_LOGD(TAG, "uart read : %d", len);
+            if (echo) {
+                write_usb_serial(data, len);
+            }
             return (InputData) {len, data};
         }
     } while(1);
 }
-
-void write_data_to_usb_serial()
-{
-    // TODO: ホスト側のクライアントと同時に実装する
-}
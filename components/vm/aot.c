@@ -0,0 +1,83 @@
+#include "vm.h"
+
+// Runtime side of programs compiled by tarto_aot. Native functions keep
+// the interpreter's calling convention: arguments, locals and the operand
+// stack live on vm->stack, so natives and interpreted
+// functions can call each other and the collector sees the same roots.
+
+// Points the functions of a loaded program at their natives.
+bool aot_bind(Bytecode *b, const AotProgram *program)
+{
+  if (program->native_size != b->function_size) return false;
+  // calls from the register IR do not go through natives
+  ir_unload(b);
+  for (uint16_t i = 0; i < b->function_size; i++) {
+    b->functions[i].native = program->natives[i];
+  }
+  return true;
+}
+
+// OP_CALL (f_method false) and OP_CALL_METHOD from native code: the
+// callee sits below arg_num arguments at vm->stack_top. Returns once it has
+// returned, with its result in their place.
+resultType aot_call(VM *vm, Bytecode *b, uint8_t arg_num, bool f_method)
+{
+  Value *sp = vm->stack_top;
+  Value callee = *(sp-arg_num-1);
+  if (f_method ? !IS_METHOD_OF(callee, *(sp-arg_num-2)) : !IS_FUNCTION(callee)) {
+    return f_method ? ERROR_NO_METHOD : ERROR_OTHER;
+  }
+  Function *function = AS_FUNCTION(callee);
+  if (!f_method && function->owner != NULL) return ERROR_NO_METHOD;
+  if (vm->frame_index >= vm->frame_max || function->locals + function->max_stack > vm->stack_end - sp) {
+    return ERROR_STACK_OVERFLOW;
+  }
+  push_frame(vm, function, arg_num, f_method);
+  if (function->native != NULL) return function->native(vm, b);
+  return interpret(vm, b, vm->frame_index - 1);
+}
+
+// OP_RETURN_VAL (OP_RETURN returns nil) from native code.
+void aot_return(VM *vm, Value val)
+{
+  Frame *frame = current_frame(vm);
+  bool f_method = frame->f_method;
+  Value *sp = frame->bp;
+  vm->frame_index--;
+  Value function = *--sp;
+  if (!(AS_FUNCTION(function)->method_index == 0 && f_method)) {
+    if (f_method) sp--;
+    *sp++ = val;
+  }
+  vm->stack_top = sp;
+}
+
+// OP_LOAD_METHOD without the inline cache, NULL if there is no such method
+Function *aot_method(Value receiver, uint8_t index)
+{
+  if (!IS_INSTANCE(receiver)) return NULL;
+  Class *c = AS_INSTANCE(receiver)->class;
+  return index < c->method_size ? c->methods[index] : NULL;
+}
+
+// Runs a compiled program. Its image is parsed in place like any binary
+// program, so it can live in flash.
+ExecResult tarto_vm_run_aot(VM *vm, const AotProgram *program)
+{
+  Bytecode bytecode;
+  if (!parse_binary((uint8_t*) program->image, program->image_size, &bytecode)) {
+    return EXEC_RESULT(ERROR_INVALID_PROGRAM, NIL_VAL());
+  }
+  if (!load_bytecode(&bytecode)) {
+    vm->error = bytecode.error;
+    free_bytecode(&bytecode);
+    return EXEC_RESULT(ERROR_INVALID_PROGRAM, NIL_VAL());
+  }
+  if (!aot_bind(&bytecode, program)) {
+    free_bytecode(&bytecode);
+    return EXEC_RESULT(ERROR_INVALID_PROGRAM, NIL_VAL());
+  }
+  ExecResult er = exec_interpret(vm, &bytecode);
+  free_bytecode(&bytecode);
+  return er;
+}
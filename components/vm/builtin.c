@@ -0,0 +1,97 @@
+#include "vm.h"
+
+// Calls builtin index of vm->builtins on the arg_num values at args, which
+// stay on the value stack for the call. Batched, it is called once per
+// group of its arity, in order, and the result is that of the last call.
+// The result is written only once every call is done, so it may be args[0].
+resultType call_builtin(VM *vm, uint8_t index, Value *args, uint8_t arg_num, bool batch, Value *result)
+{
+  const BuiltinTable *table = vm->builtins;
+  if (table == NULL || index >= table->size) return ERROR_NO_BUILTIN;
+  const Builtin *builtin = &table->entries[index];
+  Value value = NIL_VAL();
+  if (!batch) {
+    if (builtin->arg_num != BUILTIN_VARIADIC && builtin->arg_num != arg_num) return ERROR_NO_BUILTIN;
+    resultType error = builtin->function(vm, args, arg_num, &value);
+    if (error != SUCCESS) return error;
+  } else {
+    uint8_t arity = builtin->arg_num;
+    if (arity == BUILTIN_VARIADIC || arity == 0 || arg_num % arity != 0) return ERROR_NO_BUILTIN;
+    for (int i=0; i<arg_num; i+=arity) {
+      value = NIL_VAL();
+      resultType error = builtin->function(vm, args + i, arity, &value);
+      if (error != SUCCESS) return error;
+    }
+  }
+  *result = value;
+  return SUCCESS;
+}
+
+// Math builtins. Numbers are u16 like everywhere else in the VM.
+
+static bool all_numbers(Value *args, uint8_t arg_num)
+{
+  for (int i=0; i<arg_num; i++) {
+    if (!IS_NUMBER(args[i])) return false;
+  }
+  return true;
+}
+
+resultType builtin_min(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+  if (!all_numbers(args, arg_num)) return ERROR_TYPE;
+  uint16_t a = AS_NUMBER(args[0]), b = AS_NUMBER(args[1]);
+  *result = NUMBER_VAL(a < b ? a : b);
+  return SUCCESS;
+}
+
+resultType builtin_max(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+  if (!all_numbers(args, arg_num)) return ERROR_TYPE;
+  uint16_t a = AS_NUMBER(args[0]), b = AS_NUMBER(args[1]);
+  *result = NUMBER_VAL(a > b ? a : b);
+  return SUCCESS;
+}
+
+// clamp(x, low, high)
+resultType builtin_clamp(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+  if (!all_numbers(args, arg_num)) return ERROR_TYPE;
+  uint16_t x = AS_NUMBER(args[0]), low = AS_NUMBER(args[1]), high = AS_NUMBER(args[2]);
+  *result = NUMBER_VAL(x < low ? low : x > high ? high : x);
+  return SUCCESS;
+}
+
+// ema(average, sample, shift): one step of an exponential moving average
+// with weight 1/2^shift for the new sample, the usual sensor filter
+resultType builtin_ema(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+  if (!all_numbers(args, arg_num)) return ERROR_TYPE;
+  int32_t average = AS_NUMBER(args[0]), sample = AS_NUMBER(args[1]);
+  uint16_t shift = AS_NUMBER(args[2]);
+  if (shift > 15) shift = 15;
+  // arithmetic shift, rounding towards the sample
+  int32_t step = sample - average;
+  step = step >= 0 ? (step + (1 << shift) - 1) >> shift : -((-step + (1 << shift) - 1) >> shift);
+  *result = NUMBER_VAL(average + step);
+  return SUCCESS;
+}
+
+// crc16(values...): CRC-16/CCITT-FALSE over the values, two bytes each, big
+// endian
+resultType builtin_crc16(VM *vm, Value *args, uint8_t arg_num, Value *result)
+{
+  if (!all_numbers(args, arg_num)) return ERROR_TYPE;
+  uint16_t crc = 0xFFFF;
+  for (int i=0; i<arg_num; i++) {
+    uint16_t value = AS_NUMBER(args[i]);
+    for (int byte=1; byte>=0; byte--) {
+      crc ^= (uint16_t) ((value >> (8 * byte)) & 0xFF) << 8;
+      for (int bit=0; bit<8; bit++) {
+        crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+      }
+    }
+  }
+  *result = NUMBER_VAL(crc);
+  return SUCCESS;
+}
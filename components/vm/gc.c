@@ -0,0 +1,207 @@
+#include <time.h>
+#include "vm.h"
+
+typedef struct {
+  VM *vm;
+  Instance *items[GC_MARK_STACK];
+  int size;
+  bool overflow;
+} MarkStack;
+
+static uint32_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint8_t *heap_start(VM *vm)
+{
+  return (uint8_t*) vm->heap.memory;
+}
+
+static uint8_t size_class(uint8_t val_size)
+{
+  uint8_t k = 0;
+  while ((1u << k) < val_size) {
+    k++;
+  }
+  return k;
+}
+
+static size_t class_bytes(uint8_t k)
+{
+  return ARENA_ALIGN(sizeof(Instance) + sizeof(Value) * (1u << k));
+}
+
+// bytes an object of size class k takes, for walks over the heap
+size_t heap_object_bytes(uint8_t k)
+{
+  return class_bytes(k);
+}
+
+void heap_init(VM *vm)
+{
+  vm->heap.top = heap_start(vm);
+  memset(vm->heap.free, 0, sizeof(vm->heap.free));
+  memset(&vm->heap.stats, 0, sizeof(HeapStats));
+}
+
+static Instance *heap_take(VM *vm, uint8_t k)
+{
+  Object *o = vm->heap.free[k];
+  if (o != NULL) {
+    vm->heap.free[k] = o->next;
+    return (Instance*) o;
+  }
+  size_t bytes = class_bytes(k);
+  if ((size_t)(heap_start(vm) + HEAP_SIZE - vm->heap.top) < bytes) {
+    return NULL;
+  }
+  o = (Object*) vm->heap.top;
+  o->size_class = k;
+  vm->heap.top += bytes;
+  return (Instance*) o;
+}
+
+// Returns NULL when the heap is still full after a collection. The caller
+// must have written the stack top back to vm->stack_top.
+Instance *heap_alloc_instance(VM *vm, Class *c, uint8_t index)
+{
+  uint8_t k = size_class(c->instance_val_size);
+  if (k >= HEAP_SIZE_CLASSES) return NULL;
+  Instance *instance = heap_take(vm, k);
+  if (instance == NULL) {
+    heap_collect(vm);
+    instance = heap_take(vm, k);
+    if (instance == NULL) return NULL;
+  }
+  instance->obj.next = NULL;
+  instance->obj.marked = false;
+  instance->obj.free = false;
+  instance->class = c;
+  instance->index = index;
+  instance->val_size = c->instance_val_size;
+  memset(instance->variables, 0, sizeof(Value) << k);
+  vm->heap.stats.live_bytes += class_bytes(k);
+  return instance;
+}
+
+// Roots may hold stale values from earlier calls. They still point at
+// object starts, because objects never move and vm_init clears every root
+// slot, so anything that is not a live object is skipped.
+static void mark_value(MarkStack *s, Value v)
+{
+  VM *vm = s->vm;
+  if (!IS_INSTANCE(v)) return;
+  Instance *instance = AS_INSTANCE(v);
+  uint8_t *p = (uint8_t*) instance;
+  if (p < heap_start(vm) || p >= vm->heap.top) return;
+  if (instance->obj.free || instance->obj.marked) return;
+  instance->obj.marked = true;
+  if (s->size < GC_MARK_STACK) {
+    s->items[s->size++] = instance;
+  } else {
+    s->overflow = true;
+  }
+}
+
+static void mark_drain(MarkStack *s)
+{
+  while (s->size > 0) {
+    Instance *instance = s->items[--s->size];
+    for (int i=0; i<instance->val_size; i++) {
+      mark_value(s, instance->variables[i]);
+    }
+  }
+}
+
+static void mark_roots(MarkStack *s)
+{
+  VM *vm = s->vm;
+  for (Value *v = vm->stack; v < vm->stack_top; v++) {
+    mark_value(s, *v);
+    mark_drain(s);
+  }
+  // coroutines that are not running keep their stack top to themselves
+  Scheduler *sched = vm->scheduler;
+  for (int i=0; sched != NULL && i<sched->size; i++) {
+    Coroutine *c = &sched->coroutines[i];
+    if (c->state == COROUTINE_DONE || c->stack == vm->stack) continue;
+    for (Value *v = c->stack; v < c->stack_top; v++) {
+      mark_value(s, *v);
+      mark_drain(s);
+    }
+    for (int j=0; j<c->resources.globals; j++) {
+      mark_value(s, c->global[j]);
+      mark_drain(s);
+    }
+  }
+  for (int i=0; i<vm->global_size; i++) {
+    mark_value(s, vm->global[i]);
+    mark_drain(s);
+  }
+}
+
+// When the mark stack overflowed, some marked objects were not scanned.
+// Rescan the heap for them until nothing overflows any more.
+static void mark_overflow(MarkStack *s)
+{
+  VM *vm = s->vm;
+  while (s->overflow) {
+    s->overflow = false;
+    for (uint8_t *p = heap_start(vm); p < vm->heap.top; p += class_bytes(((Object*) p)->size_class)) {
+      Instance *instance = (Instance*) p;
+      if (instance->obj.free || !instance->obj.marked) continue;
+      for (int i=0; i<instance->val_size; i++) {
+        mark_value(s, instance->variables[i]);
+        mark_drain(s);
+      }
+    }
+  }
+}
+
+static void sweep(VM *vm)
+{
+  memset(vm->heap.free, 0, sizeof(vm->heap.free));
+  uint32_t live = 0;
+  for (uint8_t *p = heap_start(vm); p < vm->heap.top; ) {
+    Object *o = (Object*) p;
+    size_t bytes = class_bytes(o->size_class);
+    if (o->marked) {
+      o->marked = false;
+      live += bytes;
+    } else {
+      o->free = true;
+      o->next = vm->heap.free[o->size_class];
+      vm->heap.free[o->size_class] = o;
+    }
+    p += bytes;
+  }
+  vm->heap.stats.live_bytes = live;
+}
+
+// The pause is bounded by the roots plus one linear pass over HEAP_SIZE.
+void heap_collect(VM *vm)
+{
+  uint32_t start = now_us();
+  MarkStack s;
+  s.vm = vm;
+  s.size = 0;
+  s.overflow = false;
+  mark_roots(&s);
+  mark_overflow(&s);
+  sweep(vm);
+
+  uint32_t pause = now_us() - start;
+  HeapStats *stats = &vm->heap.stats;
+  stats->collections++;
+  stats->last_pause_us = pause;
+  stats->total_pause_us += pause;
+  if (pause > stats->max_pause_us) stats->max_pause_us = pause;
+}
+
+HeapStats heap_stats(VM *vm)
+{
+  return vm->heap.stats;
+}
@@ -0,0 +1,857 @@
+#include "vm.h"
+
+// Register tier. After a program has been verified, every body is
+// translated once into register IR: locals, arguments and operand stack
+// slots become registers of a window on vm->stack, and instructions name
+// their operands instead of pushing and popping them. Values that are only
+// loaded (locals and constants) are not copied into a stack register until
+// something needs them there, so `a = b + 1` is one instruction instead of
+// four. A register keeps the value of its stack slot at jump targets, calls
+// and jumps, which is where both tiers have to agree.
+//
+// The translation gives up, and the program stays on the stack interpreter,
+// when a function needs IR_REGS_MAX - TARGET_DEPTH registers or more, more
+// than IR_MAX instructions or more than 256 constants, or when a jump leads
+// back into code no path had reached before it.
+
+// per-byte marks of jump targets; a translated jump records the depth it
+// arrives with as TARGET_DEPTH + depth
+#define NOT_TARGET 0
+#define TARGET 1
+#define TARGET_DEPTH 2
+#define NO_INDEX 0xFFFF
+// pending stack operands are a register, or a constant with this bit set
+#define K_OPERAND 0x100
+#define IS_K(operand) ((operand) & K_OPERAND)
+
+typedef struct {
+  Function *function;
+  uint8_t *code;
+  uint16_t size;
+  Constant *constants;
+  uint16_t constant_size;
+  // registers below the first stack slot
+  uint16_t locals;
+  // operand of each stack slot; slot d is register locals + d once flushed
+  uint16_t stack[IR_REGS_MAX];
+  uint8_t depth;
+  // whether any path reaches the current instruction
+  bool live;
+  bool ok;
+  // instruction that computed the top of the stack into its slot, -1 if the
+  // previous instruction did not
+  int16_t producer;
+  // wire position of the OP_LOAD_GLOBAL last loaded into each register
+  uint16_t *load_pos;
+  IRInst *out;
+  uint16_t count;
+  uint16_t out_max;
+  Value *k;
+  uint16_t k_size;
+  uint8_t *target;
+  uint16_t *index;
+} Translation;
+
+static uint16_t operand_u2(Translation *t, uint32_t pos)
+{
+  return decode_constant(t->code[pos+1], t->code[pos+2]);
+}
+
+static IRInst *emit(Translation *t, uint8_t op, uint8_t a, uint8_t b, uint8_t c)
+{
+  // out has one spare entry to write into once the function is too long
+  IRInst *ir = &t->out[t->count];
+  if (t->count < t->out_max) {
+    t->count++;
+  } else {
+    t->ok = false;
+  }
+  ir->op = op;
+  ir->a = a;
+  ir->b = b;
+  ir->c = c;
+  ir->as.target = NULL;
+  return ir;
+}
+
+static uint16_t constant_operand(Translation *t, Value value)
+{
+  for (uint16_t i = 0; i < t->k_size; i++) {
+    if (t->k[i] == value) return K_OPERAND | i;
+  }
+  if (t->k_size == 256) {
+    t->ok = false;
+    return K_OPERAND;
+  }
+  t->k[t->k_size] = value;
+  return K_OPERAND | t->k_size++;
+}
+
+static uint8_t slot(Translation *t, uint8_t depth)
+{
+  return t->locals + depth;
+}
+
+static void push(Translation *t, uint16_t operand)
+{
+  t->stack[t->depth++] = operand;
+}
+
+static uint16_t pop(Translation *t)
+{
+  return t->stack[--t->depth];
+}
+
+static void move(Translation *t, uint8_t to, uint16_t operand)
+{
+  if (IS_K(operand)) {
+    emit(t, IR_LOAD_K, to, (uint8_t) operand, 0);
+  } else if (operand != to) {
+    emit(t, IR_MOVE, to, operand, 0);
+  }
+}
+
+// the register an operand is in, loading a constant into to first
+static uint8_t in_register(Translation *t, uint16_t operand, uint8_t to)
+{
+  if (!IS_K(operand)) return operand;
+  move(t, to, operand);
+  return to;
+}
+
+// moves every pending operand into the register of its stack slot
+static void flush(Translation *t)
+{
+  for (uint8_t d = 0; d < t->depth; d++) {
+    move(t, slot(t, d), t->stack[d]);
+    t->stack[d] = slot(t, d);
+  }
+}
+
+// the same for pending reads of a local that is about to be overwritten
+static bool flush_local(Translation *t, uint8_t local)
+{
+  bool moved = false;
+  for (uint8_t d = 0; d < t->depth; d++) {
+    if (t->stack[d] == local) {
+      move(t, slot(t, d), local);
+      t->stack[d] = slot(t, d);
+      moved = true;
+    }
+  }
+  return moved;
+}
+
+static void jump(Translation *t, uint8_t op, uint8_t a, uint8_t b, uint16_t to)
+{
+  emit(t, op, a, b, 0)->as.offset = to;
+  t->target[to] = TARGET_DEPTH + t->depth;
+}
+
+// a value computed into the register of the next free stack slot
+static void produce(Translation *t, uint8_t op, uint8_t b, uint8_t c)
+{
+  t->producer = t->count;
+  emit(t, op, slot(t, t->depth), b, c);
+  push(t, slot(t, t->depth));
+}
+
+// `g = g + x` and `g = g - x`, with nothing in x that could store to g,
+// become one IR_ADD_GLOBAL or IR_SUB_GLOBAL instead of load, op and store.
+// The load of g is dropped, the loads of x move up into its place.
+static bool update_global(Translation *t, uint8_t global, uint16_t value, int16_t producer, uint32_t pos)
+{
+  if (producer < 0 || producer != t->count - 1) return false;
+  IRInst *op = &t->out[producer];
+  if (value != slot(t, t->depth) || op->a != value || op->b != value) return false;
+  if (op->op != IR_ADD && op->op != IR_SUB && op->op != IR_ADD_K && op->op != IR_SUB_K) return false;
+  // x may only have been loaded, into registers above g's
+  int16_t load = producer - 1;
+  while (load >= 0 && t->out[load].a != value) {
+    uint8_t between = t->out[load].op;
+    if (between != IR_LOAD_GLOBAL && between != IR_LOAD_K && between != IR_MOVE) return false;
+    load--;
+  }
+  if (load < 0 || t->out[load].op != IR_LOAD_GLOBAL || t->out[load].b != global) return false;
+  // nothing may jump into the middle
+  for (uint32_t p = t->load_pos[value] + 1; p <= pos; p++) {
+    if (t->target[p] != NOT_TARGET) return false;
+  }
+  uint8_t fused = op->op == IR_ADD ? IR_ADD_GLOBAL : op->op == IR_SUB ? IR_SUB_GLOBAL :
+    op->op == IR_ADD_K ? IR_ADD_GLOBAL_K : IR_SUB_GLOBAL_K;
+  uint8_t right = op->c;
+  memmove(&t->out[load], &t->out[load + 1], sizeof(IRInst) * (producer - load - 1));
+  t->count--;
+  IRInst *ir = &t->out[t->count - 1];
+  ir->op = fused;
+  ir->a = global;
+  ir->b = 0;
+  ir->c = right;
+  ir->as.target = NULL;
+  return true;
+}
+
+static bool is_jump(uint8_t op)
+{
+  return op == IR_JMP || op == IR_JNT || (op >= IR_LESS_JNT && op <= IR_NEQ_JNT_K);
+}
+
+static const uint8_t ir_binary[OP_END] = {
+  [OP_ADD] = IR_ADD, [OP_SUB] = IR_SUB, [OP_MUL] = IR_MUL, [OP_DIV] = IR_DIV,
+  [OP_EQ] = IR_EQ, [OP_NEQ] = IR_NEQ, [OP_LESS] = IR_LESS, [OP_GREATER] = IR_GREATER,
+};
+static const uint8_t ir_compare_jnt[OP_END] = {
+  [OP_EQ] = IR_EQ_JNT, [OP_NEQ] = IR_NEQ_JNT, [OP_LESS] = IR_LESS_JNT, [OP_GREATER] = IR_GREATER_JNT,
+};
+
+// translates the instruction at pos, returns where the next one starts
+static uint32_t translate_inst(Translation *t, uint32_t pos)
+{
+  uint8_t op = t->code[pos];
+  uint8_t arg = operand_size(op) > 0 ? t->code[pos+1] : 0;
+  uint32_t next = pos + 1 + operand_size(op);
+  int16_t producer = t->producer;
+  t->producer = -1;
+  switch (op) {
+    case OP_CONSTANT:
+      push(t, constant_operand(t, constant_value(t->constants, t->constant_size, operand_u2(t, pos))));
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_EQ:
+    case OP_NEQ:
+    case OP_LESS:
+    case OP_GREATER: {
+      // a constant on the right selects the _K form
+      uint16_t r = pop(t);
+      uint8_t l = in_register(t, pop(t), slot(t, t->depth));
+      // a compare that only feeds a branch becomes the branch
+      if (ir_compare_jnt[op] != 0 && next < t->size && t->code[next] == OP_JNT && t->target[next] == NOT_TARGET) {
+        flush(t);
+        uint8_t k_form = IS_K(r) ? IR_LESS_JNT_K - IR_LESS_JNT : 0;
+        jump(t, ir_compare_jnt[op] + k_form, l, (uint8_t) r, operand_u2(t, next));
+        return next + 1 + operand_size(OP_JNT);
+      }
+      uint8_t k_form = IS_K(r) ? IR_ADD_K - IR_ADD : 0;
+      produce(t, ir_binary[op] + k_form, l, (uint8_t) r);
+      break;
+    }
+    case OP_LOAD_GLOBAL:
+      t->load_pos[slot(t, t->depth)] = pos;
+      produce(t, IR_LOAD_GLOBAL, arg, 0);
+      break;
+    case OP_STORE_GLOBAL: {
+      uint16_t value = pop(t);
+      if (!update_global(t, arg, value, producer, pos)) {
+        emit(t, IR_STORE_GLOBAL, arg, in_register(t, value, slot(t, t->depth)), 0);
+      }
+      break;
+    }
+    case OP_JNT: {
+      uint8_t condition = in_register(t, pop(t), slot(t, t->depth));
+      flush(t);
+      jump(t, IR_JNT, condition, 0, operand_u2(t, pos));
+      break;
+    }
+    case OP_JMP:
+      flush(t);
+      jump(t, IR_JMP, 0, 0, operand_u2(t, pos));
+      t->live = false;
+      break;
+    case OP_CALL:
+      // the callee's window starts above the function, its result
+      // replaces the function
+      flush(t);
+      emit(t, IR_CALL, slot(t, t->depth - arg - 1), arg, 0);
+      t->depth -= arg;
+      break;
+    case OP_CALL_METHOD:
+      flush(t);
+      emit(t, IR_CALL_METHOD, slot(t, t->depth - arg - 2), arg, 0);
+      t->depth -= arg + 1;
+      break;
+    case OP_RETURN_VAL: {
+      uint8_t val = in_register(t, pop(t), slot(t, t->depth));
+      // the return stays behind a tail call, for jumps to it and for calls
+      // that cannot reuse the frame
+      IRInst *call = t->count > 0 ? &t->out[t->count - 1] : NULL;
+      if (call != NULL && call->op == IR_CALL && call->a == val) call->op = IR_TAIL_CALL;
+      emit(t, IR_RETURN, val, 0, 0);
+      t->live = false;
+      break;
+    }
+    case OP_LOAD_LOCAL:
+      push(t, arg);
+      break;
+    case OP_STORE_LOCAL: {
+      uint16_t value = pop(t);
+      bool moved = flush_local(t, arg);
+      // compute straight into the local when nothing read it in between
+      if (!moved && producer >= 0 && value == slot(t, t->depth) && t->out[producer].a == value) {
+        t->out[producer].a = arg;
+      } else {
+        move(t, arg, value);
+      }
+      break;
+    }
+    case OP_INSTANECE:
+      produce(t, IR_INSTANCE, arg, 0);
+      break;
+    case OP_LOAD_METHOD: {
+      // the receiver stays where it is, the method goes above it
+      uint16_t receiver = pop(t);
+      if (IS_K(receiver)) receiver = in_register(t, receiver, slot(t, t->depth));
+      emit(t, IR_LOAD_METHOD, slot(t, t->depth + 1), receiver, arg);
+      push(t, receiver);
+      push(t, slot(t, t->depth));
+      break;
+    }
+    case OP_LOAD_INSTANCE_VAL:
+      produce(t, IR_LOAD_INSTANCE_VAL, arg, 0);
+      break;
+    case OP_STORE_INSTANCE_VAL:
+      emit(t, IR_STORE_INSTANCE_VAL, arg, in_register(t, pop(t), slot(t, t->depth)), 0);
+      break;
+    case OP_RETURN:
+      emit(t, IR_RETURN_NIL, 0, 0, 0);
+      t->live = false;
+      break;
+    case OP_YIELD:
+      emit(t, IR_BLOCK, 0, op, 0);
+      break;
+    case OP_SLEEP:
+    case OP_WAIT:
+      emit(t, IR_BLOCK, in_register(t, pop(t), slot(t, t->depth)), op, 0);
+      break;
+    case OP_CALL_NATIVE:
+    case OP_CALL_NATIVE_BATCH:
+      // the builtin reads its arguments from their slots and its result
+      // replaces the first, so a is not retargeted like a produce
+      flush(t);
+      t->depth -= arg;
+      emit(t, op == OP_CALL_NATIVE ? IR_CALL_NATIVE : IR_CALL_NATIVE_BATCH, slot(t, t->depth), arg, t->code[pos+2]);
+      push(t, slot(t, t->depth));
+      break;
+  }
+  return next;
+}
+
+static bool translate_body(Translation *t)
+{
+  uint8_t *code = t->code;
+  t->locals = t->function->locals;
+  // depth is a u1, and TARGET_DEPTH + depth has to fit a target mark
+  if (t->locals + t->function->max_stack >= IR_REGS_MAX - TARGET_DEPTH) return false;
+  memset(t->target, NOT_TARGET, t->size + 1);
+  for (uint32_t pos = 0; pos < t->size; pos += 1 + operand_size(code[pos])) {
+    t->index[pos] = NO_INDEX;
+    if (code[pos] == OP_JMP || code[pos] == OP_JNT) t->target[operand_u2(t, pos)] = TARGET;
+  }
+  t->depth = 0;
+  t->live = true;
+  t->ok = true;
+  t->producer = -1;
+  t->count = 0;
+  t->k_size = 0;
+
+  uint32_t pos = 0;
+  while (pos < t->size) {
+    if (t->target[pos] != NOT_TARGET) {
+      t->producer = -1;
+      if (t->live) {
+        flush(t);
+      } else if (t->target[pos] >= TARGET_DEPTH) {
+        // only reached by jumps, which left the stack in its registers
+        t->live = true;
+        t->depth = t->target[pos] - TARGET_DEPTH;
+        for (uint8_t d = 0; d < t->depth; d++) {
+          t->stack[d] = slot(t, d);
+        }
+      }
+    }
+    if (!t->live) {
+      pos += 1 + operand_size(code[pos]);
+      continue;
+    }
+    t->index[pos] = t->count;
+    pos = translate_inst(t, pos);
+    if (!t->ok) return false;
+  }
+
+  // running off the end stops the program with the top of the stack
+  if (t->live) {
+    flush(t);
+  } else if (t->target[t->size] >= TARGET_DEPTH) {
+    t->depth = t->target[t->size] - TARGET_DEPTH;
+  }
+  if (t->target[t->size] >= TARGET_DEPTH && t->target[t->size] != TARGET_DEPTH + t->depth) return false;
+  t->index[t->size] = t->count;
+  emit(t, IR_END, t->depth > 0 ? slot(t, t->depth - 1) : 0, t->depth > 0, 0);
+  if (!t->ok) return false;
+
+  // one block per function: instructions, then constants
+  IRInst *ir = malloc(sizeof(IRInst) * t->count + sizeof(Value) * t->k_size);
+  if (ir == NULL) return false;
+  for (uint16_t i = 0; i < t->count; i++) {
+    ir[i] = t->out[i];
+    if (!is_jump(ir[i].op)) continue;
+    uint16_t index = t->index[t->out[i].as.offset];
+    if (index == NO_INDEX) {
+      free(ir);
+      return false;
+    }
+    ir[i].as.target = &ir[index];
+  }
+  Function *f = t->function;
+  f->ir = ir;
+  f->ir_constants = (Value*) (ir + t->count);
+  memcpy(f->ir_constants, t->k, sizeof(Value) * t->k_size);
+  f->ir_regs = f->locals + f->max_stack;
+  return true;
+}
+
+static bool translate_pool(Translation *t, Constant *constants, uint16_t constant_size)
+{
+  for (int i=0; i<constant_size; i++) {
+    Constant *c = &constants[i];
+    if (c->type != CONST_FUNC) continue;
+    t->function = c->function;
+    t->code = c->content;
+    t->size = c->size;
+    t->constants = constants;
+    t->constant_size = constant_size;
+    if (!translate_body(t)) return false;
+  }
+  return true;
+}
+
+// largest body, in bytes and in instructions, and largest constant pool
+typedef struct {
+  uint16_t bytes;
+  uint32_t insts;
+  uint16_t constants;
+} Largest;
+
+static void measure(Largest *l, uint8_t *code, uint16_t size)
+{
+  uint32_t insts = count_insts(code, size);
+  if (size > l->bytes) l->bytes = size;
+  if (insts > l->insts) l->insts = insts;
+}
+
+static void measure_pool(Largest *l, Constant *constants, uint16_t constant_size)
+{
+  if (constant_size > l->constants) l->constants = constant_size;
+  for (int i=0; i<constant_size; i++) {
+    if (constants[i].type == CONST_FUNC) measure(l, constants[i].content, constants[i].size);
+  }
+}
+
+// Translates every body of a verified, loaded program. When one of them
+// cannot be translated none keeps its IR and false is returned; the
+// program then runs on the stack interpreter.
+bool ir_translate(Bytecode *b)
+{
+  Largest l = {0, 0, 1};
+  measure(&l, b->instructions, b->instruction_size);
+  measure_pool(&l, b->constants, b->constant_size);
+  for (int i=0; i<b->class_size; i++) {
+    measure_pool(&l, b->classes[i].constants, b->classes[i].constant_size);
+  }
+  // a wire instruction emits at most itself, the constant it reads and the
+  // move of one pending value into its stack slot
+  Translation t;
+  t.out_max = 3 * l.insts < IR_MAX ? 3 * l.insts : IR_MAX;
+  t.out = malloc(sizeof(IRInst) * (t.out_max + 1));
+  t.k = malloc(sizeof(Value) * l.constants);
+  t.target = malloc(l.bytes + 1);
+  t.index = malloc(sizeof(uint16_t) * (l.bytes + 1));
+  t.load_pos = malloc(sizeof(uint16_t) * IR_REGS_MAX);
+  bool ok = t.out != NULL && t.k != NULL && t.target != NULL && t.index != NULL && t.load_pos != NULL;
+  if (ok) {
+    t.function = &b->functions[0];
+    t.code = b->instructions;
+    t.size = b->instruction_size;
+    t.constants = b->constants;
+    t.constant_size = b->constant_size;
+    ok = translate_body(&t) && translate_pool(&t, b->constants, b->constant_size);
+    for (int i=0; ok && i<b->class_size; i++) {
+      ok = translate_pool(&t, b->classes[i].constants, b->classes[i].constant_size);
+    }
+  }
+  free(t.out);
+  free(t.k);
+  free(t.target);
+  free(t.index);
+  free(t.load_pos);
+  if (!ok) ir_unload(b);
+  return ok;
+}
+
+void ir_unload(Bytecode *b)
+{
+  for (uint16_t i = 0; i < b->function_size; i++) {
+    free(b->functions[i].ir);
+    b->functions[i].ir = NULL;
+    b->functions[i].ir_constants = NULL;
+  }
+}
+
+#if defined(__GNUC__) && !defined(TARTO_VM_SWITCH_DISPATCH)
+#define IR_COMPUTED_GOTO
+#endif
+
+// GCC merges the identical dispatch tails of the handlers back into a few
+// shared indirect jumps, which the branch predictor cannot tell apart
+#if defined(IR_COMPUTED_GOTO) && !defined(__clang__)
+#define IR_SEPARATE_DISPATCH __attribute__((optimize("no-crossjumping")))
+#else
+#define IR_SEPARATE_DISPATCH
+#endif
+
+#ifdef TARTO_VM_STATS
+#define IR_STAT_COUNT() (vm->dispatch_count++)
+#else
+#define IR_STAT_COUNT() ((void)0)
+#endif
+
+#ifdef IR_COMPUTED_GOTO
+#define CASE(op) L_##op: case op
+#define DISPATCH() do { \
+    ir = ip++; \
+    IR_STAT_COUNT(); \
+    goto *dispatch_table[ir->op]; \
+  } while (0)
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+
+// (no do/while around these: DISPATCH may be a continue)
+#define NUMBER_OP(generic, right, expr) { \
+    Value l = regs[ir->b]; \
+    Value r = (right); \
+    if (IS_NUMBERS(l, r)) { \
+      uint16_t x = AS_NUMBER(l); \
+      uint16_t y = AS_NUMBER(r); \
+      regs[ir->a] = (expr); \
+      DISPATCH(); \
+    } \
+    resultType error = binary_op(generic, l, r, &regs[ir->a]); \
+    if (error != SUCCESS) return error; \
+    DISPATCH(); \
+  }
+#define GLOBAL_OP(generic, right, expr) { \
+    Value *g = &vm->global[ir->a]; \
+    Value r = (right); \
+    if (IS_NUMBERS(*g, r)) { \
+      uint16_t x = AS_NUMBER(*g); \
+      uint16_t y = AS_NUMBER(r); \
+      *g = NUMBER_VAL(expr); \
+      DISPATCH(); \
+    } \
+    resultType error = binary_op(generic, *g, r, g); \
+    if (error != SUCCESS) return error; \
+    DISPATCH(); \
+  }
+#define COMPARE_JNT(generic, right, expr) { \
+    Value l = regs[ir->a]; \
+    Value r = (right); \
+    Value result; \
+    if (IS_NUMBERS(l, r)) { \
+      uint16_t x = AS_NUMBER(l); \
+      uint16_t y = AS_NUMBER(r); \
+      result = BOOL_VAL(expr); \
+    } else { \
+      resultType error = binary_op(generic, l, r, &result); \
+      if (error != SUCCESS) return error; \
+    } \
+    if (!AS_BOOL(result)) { \
+      ip = ir->as.target; \
+      TICK(); \
+    } \
+    DISPATCH(); \
+  }
+// the window of the callee starts at window, its arguments are already
+// there; the rest of it starts out nil
+#define ENTER(callee, window, args, method) do { \
+    frame->ir_ip = ip; \
+    frame = &vm->frames[vm->frame_index++]; \
+    frame->bp = (window); \
+    frame->arg_num = (args); \
+    frame->f_method = (method); \
+    frame->function = (callee); \
+    regs = frame->bp; \
+    for (int i = (args); i < (callee)->ir_regs; i++) { \
+      regs[i] = NIL_VAL(); \
+    } \
+    k = (callee)->ir_constants; \
+    ip = (callee)->ir; \
+  } while (0)
+#define LEAVE() do { \
+    frame = &vm->frames[vm->frame_index-1]; \
+    regs = frame->bp; \
+    k = frame->function->ir_constants; \
+    ip = frame->ir_ip; \
+  } while (0)
+// taken jumps and calls use up the time slice, as on the stack tier
+#define TICK() \
+  if (--vm->budget == 0) { \
+    frame->ir_ip = ip; \
+    vm->stack_top = regs + frame->function->ir_regs; \
+    return PREEMPTED; \
+  }
+#define WINDOW_FITS(callee, window) \
+  (vm->frame_index < vm->frame_max && (callee)->ir_regs <= vm->stack_end - (window))
+
+// Runs a translated program from where its top frame is, the start of the
+// top level code after vm_start. The result is left on vm->stack like the
+// stack interpreter leaves it.
+IR_SEPARATE_DISPATCH resultType ir_interpret(VM *vm, Bytecode *b)
+{
+#ifdef IR_COMPUTED_GOTO
+  static void *dispatch_table[256] = {
+    [0 ... 255] = &&L_IR_UNKNOWN,
+    [IR_MOVE] = &&L_IR_MOVE,
+    [IR_LOAD_K] = &&L_IR_LOAD_K,
+    [IR_LOAD_GLOBAL] = &&L_IR_LOAD_GLOBAL,
+    [IR_STORE_GLOBAL] = &&L_IR_STORE_GLOBAL,
+    [IR_ADD_GLOBAL] = &&L_IR_ADD_GLOBAL,
+    [IR_SUB_GLOBAL] = &&L_IR_SUB_GLOBAL,
+    [IR_ADD_GLOBAL_K] = &&L_IR_ADD_GLOBAL_K,
+    [IR_SUB_GLOBAL_K] = &&L_IR_SUB_GLOBAL_K,
+    [IR_ADD] = &&L_IR_ADD,
+    [IR_SUB] = &&L_IR_SUB,
+    [IR_MUL] = &&L_IR_MUL,
+    [IR_DIV] = &&L_IR_DIV,
+    [IR_EQ] = &&L_IR_EQ,
+    [IR_NEQ] = &&L_IR_NEQ,
+    [IR_LESS] = &&L_IR_LESS,
+    [IR_GREATER] = &&L_IR_GREATER,
+    [IR_ADD_K] = &&L_IR_ADD_K,
+    [IR_SUB_K] = &&L_IR_SUB_K,
+    [IR_MUL_K] = &&L_IR_MUL_K,
+    [IR_DIV_K] = &&L_IR_DIV_K,
+    [IR_EQ_K] = &&L_IR_EQ_K,
+    [IR_NEQ_K] = &&L_IR_NEQ_K,
+    [IR_LESS_K] = &&L_IR_LESS_K,
+    [IR_GREATER_K] = &&L_IR_GREATER_K,
+    [IR_JMP] = &&L_IR_JMP,
+    [IR_JNT] = &&L_IR_JNT,
+    [IR_LESS_JNT] = &&L_IR_LESS_JNT,
+    [IR_GREATER_JNT] = &&L_IR_GREATER_JNT,
+    [IR_EQ_JNT] = &&L_IR_EQ_JNT,
+    [IR_NEQ_JNT] = &&L_IR_NEQ_JNT,
+    [IR_LESS_JNT_K] = &&L_IR_LESS_JNT_K,
+    [IR_GREATER_JNT_K] = &&L_IR_GREATER_JNT_K,
+    [IR_EQ_JNT_K] = &&L_IR_EQ_JNT_K,
+    [IR_NEQ_JNT_K] = &&L_IR_NEQ_JNT_K,
+    [IR_CALL] = &&L_IR_CALL,
+    [IR_CALL_METHOD] = &&L_IR_CALL_METHOD,
+    [IR_TAIL_CALL] = &&L_IR_TAIL_CALL,
+    [IR_LOAD_METHOD] = &&L_IR_LOAD_METHOD,
+    [IR_INSTANCE] = &&L_IR_INSTANCE,
+    [IR_LOAD_INSTANCE_VAL] = &&L_IR_LOAD_INSTANCE_VAL,
+    [IR_STORE_INSTANCE_VAL] = &&L_IR_STORE_INSTANCE_VAL,
+    [IR_BLOCK] = &&L_IR_BLOCK,
+    [IR_CALL_NATIVE] = &&L_IR_CALL_NATIVE,
+    [IR_CALL_NATIVE_BATCH] = &&L_IR_CALL_NATIVE_BATCH,
+    [IR_RETURN] = &&L_IR_RETURN,
+    [IR_RETURN_NIL] = &&L_IR_RETURN_NIL,
+    [IR_END] = &&L_IR_END,
+  };
+#endif
+  Function *top = &b->functions[0];
+  Frame *frame = &vm->frames[vm->frame_index-1];
+  Value *regs = frame->bp;
+  Value *k = frame->function->ir_constants;
+  IRInst *ip = frame->ir_ip;
+  IRInst *ir;
+  Value val;
+
+  for (;;) {
+    ir = ip++;
+    IR_STAT_COUNT();
+    switch (ir->op) {
+      CASE(IR_MOVE): {
+        regs[ir->a] = regs[ir->b];
+        DISPATCH();
+      }
+      CASE(IR_LOAD_K): {
+        regs[ir->a] = k[ir->b];
+        DISPATCH();
+      }
+      CASE(IR_LOAD_GLOBAL): {
+        regs[ir->a] = vm->global[ir->b];
+        DISPATCH();
+      }
+      CASE(IR_STORE_GLOBAL): {
+        vm->global[ir->a] = regs[ir->b];
+        DISPATCH();
+      }
+      CASE(IR_ADD_GLOBAL): GLOBAL_OP(OP_ADD, regs[ir->c], x + y)
+      CASE(IR_SUB_GLOBAL): GLOBAL_OP(OP_SUB, regs[ir->c], x - y)
+      CASE(IR_ADD_GLOBAL_K): GLOBAL_OP(OP_ADD, k[ir->c], x + y)
+      CASE(IR_SUB_GLOBAL_K): GLOBAL_OP(OP_SUB, k[ir->c], x - y)
+      CASE(IR_ADD): NUMBER_OP(OP_ADD, regs[ir->c], NUMBER_VAL(x + y))
+      CASE(IR_SUB): NUMBER_OP(OP_SUB, regs[ir->c], NUMBER_VAL(x - y))
+      CASE(IR_MUL): NUMBER_OP(OP_MUL, regs[ir->c], NUMBER_VAL(x * y))
+      CASE(IR_EQ): NUMBER_OP(OP_EQ, regs[ir->c], BOOL_VAL(x == y))
+      CASE(IR_NEQ): NUMBER_OP(OP_NEQ, regs[ir->c], BOOL_VAL(x != y))
+      CASE(IR_LESS): NUMBER_OP(OP_LESS, regs[ir->c], BOOL_VAL(x < y))
+      CASE(IR_GREATER): NUMBER_OP(OP_GREATER, regs[ir->c], BOOL_VAL(x > y))
+      CASE(IR_ADD_K): NUMBER_OP(OP_ADD, k[ir->c], NUMBER_VAL(x + y))
+      CASE(IR_SUB_K): NUMBER_OP(OP_SUB, k[ir->c], NUMBER_VAL(x - y))
+      CASE(IR_MUL_K): NUMBER_OP(OP_MUL, k[ir->c], NUMBER_VAL(x * y))
+      CASE(IR_EQ_K): NUMBER_OP(OP_EQ, k[ir->c], BOOL_VAL(x == y))
+      CASE(IR_NEQ_K): NUMBER_OP(OP_NEQ, k[ir->c], BOOL_VAL(x != y))
+      CASE(IR_LESS_K): NUMBER_OP(OP_LESS, k[ir->c], BOOL_VAL(x < y))
+      CASE(IR_GREATER_K): NUMBER_OP(OP_GREATER, k[ir->c], BOOL_VAL(x > y))
+      CASE(IR_DIV):
+      CASE(IR_DIV_K): {
+        // binary_op reports the division by zero
+        Value r = ir->op == IR_DIV ? regs[ir->c] : k[ir->c];
+        resultType error = binary_op(OP_DIV, regs[ir->b], r, &regs[ir->a]);
+        if (error != SUCCESS) return error;
+        DISPATCH();
+      }
+      CASE(IR_JMP): {
+        ip = ir->as.target;
+        TICK();
+        DISPATCH();
+      }
+      CASE(IR_JNT): {
+        if (!AS_BOOL(regs[ir->a])) {
+          ip = ir->as.target;
+          TICK();
+        }
+        DISPATCH();
+      }
+      CASE(IR_LESS_JNT): COMPARE_JNT(OP_LESS, regs[ir->b], x < y)
+      CASE(IR_GREATER_JNT): COMPARE_JNT(OP_GREATER, regs[ir->b], x > y)
+      CASE(IR_EQ_JNT): COMPARE_JNT(OP_EQ, regs[ir->b], x == y)
+      CASE(IR_NEQ_JNT): COMPARE_JNT(OP_NEQ, regs[ir->b], x != y)
+      CASE(IR_LESS_JNT_K): COMPARE_JNT(OP_LESS, k[ir->b], x < y)
+      CASE(IR_GREATER_JNT_K): COMPARE_JNT(OP_GREATER, k[ir->b], x > y)
+      CASE(IR_EQ_JNT_K): COMPARE_JNT(OP_EQ, k[ir->b], x == y)
+      CASE(IR_NEQ_JNT_K): COMPARE_JNT(OP_NEQ, k[ir->b], x != y)
+      CASE(IR_CALL):
+      CASE(IR_TAIL_CALL): {
+        Value function = regs[ir->a];
+        if (!IS_FUNCTION(function)) return ERROR_OTHER;
+        Function *callee = AS_FUNCTION(function);
+        if (callee->owner != NULL) return ERROR_NO_METHOD;
+        // the callee takes over the window of the current function, and
+        // returns where it would have; the top level code has no function
+        // slot and a constructor returns its receiver instead
+        if (ir->op == IR_TAIL_CALL && vm->frame_index > 1 && !(frame->f_method && frame->function->method_index == 0) &&
+            callee->ir_regs <= vm->stack_end - regs) {
+          memmove(regs - 1, regs + ir->a, sizeof(Value) * (ir->b + 1));
+          frame->arg_num = ir->b;
+          frame->f_method = false;
+          frame->function = callee;
+          for (int i = ir->b; i < callee->ir_regs; i++) {
+            regs[i] = NIL_VAL();
+          }
+          k = callee->ir_constants;
+          ip = callee->ir;
+          TICK();
+          DISPATCH();
+        }
+        Value *window = regs + ir->a + 1;
+        if (!WINDOW_FITS(callee, window)) return ERROR_STACK_OVERFLOW;
+        ENTER(callee, window, ir->b, false);
+        TICK();
+        DISPATCH();
+      }
+      CASE(IR_CALL_METHOD): {
+        if (!IS_METHOD_OF(regs[ir->a + 1], regs[ir->a])) return ERROR_NO_METHOD;
+        Function *callee = AS_FUNCTION(regs[ir->a + 1]);
+        Value *window = regs + ir->a + 2;
+        if (!WINDOW_FITS(callee, window)) return ERROR_STACK_OVERFLOW;
+        ENTER(callee, window, ir->b, true);
+        TICK();
+        DISPATCH();
+      }
+      CASE(IR_LOAD_METHOD): {
+        Value receiver = regs[ir->b];
+        if (!IS_INSTANCE(receiver)) return ERROR_NO_METHOD;
+        Class *c = AS_INSTANCE(receiver)->class;
+        Function *method = ir->as.function;
+        if (method == NULL || method->owner != c) {
+          if (ir->c >= c->method_size || c->methods[ir->c] == NULL) return ERROR_NO_METHOD;
+          method = c->methods[ir->c];
+          ir->as.function = method;
+        }
+        regs[ir->a] = FUNCTION_VAL(method);
+        DISPATCH();
+      }
+      CASE(IR_INSTANCE): {
+        // the collector scans vm->stack up to stack_top
+        vm->stack_top = regs + frame->function->ir_regs;
+        Instance *instance = heap_alloc_instance(vm, &b->classes[ir->b], ir->b);
+        if (instance == NULL) return ERROR_OUT_OF_MEMORY;
+        regs[ir->a] = INSTANCE_VAL(instance);
+        DISPATCH();
+      }
+      CASE(IR_LOAD_INSTANCE_VAL): {
+        regs[ir->a] = AS_INSTANCE(regs[-2])->variables[ir->b];
+        DISPATCH();
+      }
+      CASE(IR_STORE_INSTANCE_VAL): {
+        AS_INSTANCE(regs[-2])->variables[ir->a] = regs[ir->b];
+        DISPATCH();
+      }
+      CASE(IR_BLOCK): {
+        Value arg = NIL_VAL();
+        if (ir->b != OP_YIELD) {
+          arg = regs[ir->a];
+          if (!IS_NUMBER(arg)) return ERROR_TYPE;
+        }
+        vm->block_op = ir->b;
+        vm->block_arg = arg;
+        frame->ir_ip = ip;
+        vm->stack_top = regs + frame->function->ir_regs;
+        return BLOCKED;
+      }
+      CASE(IR_CALL_NATIVE):
+      CASE(IR_CALL_NATIVE_BATCH): {
+        vm->stack_top = regs + frame->function->ir_regs;
+        resultType error = call_builtin(vm, ir->c, &regs[ir->a], ir->b, ir->op == IR_CALL_NATIVE_BATCH, &regs[ir->a]);
+        if (error != SUCCESS) return error;
+        DISPATCH();
+      }
+      CASE(IR_RETURN):
+      CASE(IR_RETURN_NIL): {
+        val = ir->op == IR_RETURN ? regs[ir->a] : NIL_VAL();
+        // a return from the top level code ends the program
+        if (vm->frame_index == 1) goto end;
+        bool f_method = frame->f_method;
+        Function *callee = frame->function;
+        vm->frame_index--;
+        LEAVE();
+        // the call instruction says where the result goes; a constructor
+        // leaves the receiver there
+        if (!(f_method && callee->method_index == 0)) regs[ip[-1].a] = val;
+        DISPATCH();
+      }
+      CASE(IR_END): {
+        val = ir->b ? regs[ir->a] : NIL_VAL();
+        goto end;
+      }
+#ifdef IR_COMPUTED_GOTO
+      L_IR_UNKNOWN:
+#endif
+      default:
+        return ERROR_UNKNOWN_OPCODE;
+    }
+  }
+end:
+  // above the locals of the top level code, where the stack interpreter
+  // leaves it
+  vm->stack_top = vm->stack + top->locals;
+  *vm->stack_top++ = val;
+  return STOPPED;
+}
@@ -0,0 +1,366 @@
+#include "vm.h"
+
+static const char *opcode_names[OP_COUNT] = {
+  [OP_CONSTANT] = "CONSTANT", [OP_ADD] = "ADD", [OP_SUB] = "SUB", [OP_MUL] = "MUL", [OP_DIV] = "DIV",
+  [OP_DONE] = "DONE", [OP_EQ] = "EQ", [OP_NEQ] = "NEQ", [OP_LESS] = "LESS", [OP_GREATER] = "GREATER",
+  [OP_LOAD_GLOBAL] = "LOAD_GLOBAL", [OP_STORE_GLOBAL] = "STORE_GLOBAL", [OP_JNT] = "JNT", [OP_JMP] = "JMP",
+  [OP_CALL] = "CALL", [OP_RETURN_VAL] = "RETURN_VAL", [OP_LOAD_LOCAL] = "LOAD_LOCAL",
+  [OP_STORE_LOCAL] = "STORE_LOCAL", [OP_INSTANECE] = "INSTANECE", [OP_LOAD_METHOD] = "LOAD_METHOD",
+  [OP_CALL_METHOD] = "CALL_METHOD", [OP_LOAD_INSTANCE_VAL] = "LOAD_INSTANCE_VAL",
+  [OP_STORE_INSTANCE_VAL] = "STORE_INSTANCE_VAL", [OP_RETURN] = "RETURN", [OP_YIELD] = "YIELD",
+  [OP_SLEEP] = "SLEEP", [OP_WAIT] = "WAIT", [OP_CALL_NATIVE] = "CALL_NATIVE",
+  [OP_CALL_NATIVE_BATCH] = "CALL_NATIVE_BATCH", [OP_END] = "END",
+  [OP_ADD_CONSTANT] = "ADD_CONSTANT", [OP_SUB_CONSTANT] = "SUB_CONSTANT", [OP_LESS_CONSTANT] = "LESS_CONSTANT",
+  [OP_LESS_JNT] = "LESS_JNT", [OP_GREATER_JNT] = "GREATER_JNT", [OP_EQ_JNT] = "EQ_JNT", [OP_NEQ_JNT] = "NEQ_JNT",
+  [OP_LESS_CONSTANT_JNT] = "LESS_CONSTANT_JNT", [OP_TAIL_CALL] = "TAIL_CALL", [OP_ADD_NUM] = "ADD_NUM", [OP_SUB_NUM] = "SUB_NUM",
+  [OP_MUL_NUM] = "MUL_NUM", [OP_DIV_NUM] = "DIV_NUM", [OP_EQ_NUM] = "EQ_NUM", [OP_NEQ_NUM] = "NEQ_NUM",
+  [OP_LESS_NUM] = "LESS_NUM", [OP_GREATER_NUM] = "GREATER_NUM", [OP_ADD_CONSTANT_NUM] = "ADD_CONSTANT_NUM",
+  [OP_SUB_CONSTANT_NUM] = "SUB_CONSTANT_NUM", [OP_LESS_CONSTANT_NUM] = "LESS_CONSTANT_NUM",
+  [OP_LESS_JNT_NUM] = "LESS_JNT_NUM", [OP_GREATER_JNT_NUM] = "GREATER_JNT_NUM", [OP_EQ_JNT_NUM] = "EQ_JNT_NUM",
+  [OP_NEQ_JNT_NUM] = "NEQ_JNT_NUM", [OP_LESS_CONSTANT_JNT_NUM] = "LESS_CONSTANT_JNT_NUM",
+};
+
+const char *opcode_name(uint8_t op)
+{
+  return op < OP_COUNT && opcode_names[op] != NULL ? opcode_names[op] : "?";
+}
+
+// number of operand bytes that follow each opcode in the wire format
+uint8_t operand_size(uint8_t op)
+{
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_JNT:
+    case OP_JMP:
+    case OP_CALL_NATIVE:
+    case OP_CALL_NATIVE_BATCH:
+      return 2;
+    case OP_LOAD_GLOBAL:
+    case OP_STORE_GLOBAL:
+    case OP_CALL:
+    case OP_LOAD_LOCAL:
+    case OP_STORE_LOCAL:
+    case OP_INSTANECE:
+    case OP_LOAD_METHOD:
+    case OP_CALL_METHOD:
+    case OP_LOAD_INSTANCE_VAL:
+    case OP_STORE_INSTANCE_VAL:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// number of Insts a body decodes to, OP_END included
+uint32_t count_insts(uint8_t *code, uint16_t size)
+{
+  uint32_t count = 1;
+  for (uint32_t pos = 0; pos < size; pos += 1 + operand_size(code[pos])) {
+    count++;
+  }
+  return count;
+}
+
+static uint8_t byte_at(uint8_t *code, uint16_t size, uint32_t pos)
+{
+  return pos < size ? code[pos] : 0;
+}
+
+Value constant_value(Constant *constants, uint16_t constant_size, uint16_t index)
+{
+  if (index == 0 || index > constant_size) return NIL_VAL();
+  Constant *c = &constants[index-1];
+  switch (c->type) {
+    case CONST_INT:
+      return NUMBER_VAL(decode_constant(c->content[0], c->content[1]));
+    case CONST_FUNC:
+      return FUNCTION_VAL(c->function);
+  }
+  return NIL_VAL();
+}
+
+static bool is_jump(uint8_t op)
+{
+  switch (op) {
+    case OP_JMP:
+    case OP_JNT:
+    case OP_LESS_JNT:
+    case OP_GREATER_JNT:
+    case OP_EQ_JNT:
+    case OP_NEQ_JNT:
+    case OP_LESS_CONSTANT_JNT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Decodes the instruction at pos into inst and returns the position of the
+// next one. Jump targets are left as byte offsets.
+static uint32_t decode_inst(Inst *inst, uint8_t *code, uint16_t size, uint32_t pos,
+                            Constant *constants, uint16_t constant_size)
+{
+  uint8_t op = code[pos];
+  inst->op = op;
+  switch (operand_size(op)) {
+    case 1: {
+      inst->arg = byte_at(code, size, pos+1);
+      break;
+    }
+    case 2: {
+      if (op == OP_CALL_NATIVE || op == OP_CALL_NATIVE_BATCH) {
+        inst->arg = byte_at(code, size, pos+1);
+        inst->imm = byte_at(code, size, pos+2);
+        break;
+      }
+      uint16_t operand = decode_constant(byte_at(code, size, pos+1), byte_at(code, size, pos+2));
+      if (op == OP_CONSTANT) {
+        inst->as.value = constant_value(constants, constant_size, operand);
+      } else {
+        inst->as.offset = operand;
+      }
+      break;
+    }
+  }
+  return pos + 1 + operand_size(op);
+}
+
+// superinstruction that inst followed by next fuses into, OP_END if none
+static uint8_t fusion(Inst *inst, uint8_t next)
+{
+  static const uint8_t fusions[][3] = {
+    {OP_CONSTANT, OP_ADD, OP_ADD_CONSTANT},
+    {OP_CONSTANT, OP_SUB, OP_SUB_CONSTANT},
+    {OP_CONSTANT, OP_LESS, OP_LESS_CONSTANT},
+    {OP_LESS, OP_JNT, OP_LESS_JNT},
+    {OP_GREATER, OP_JNT, OP_GREATER_JNT},
+    {OP_EQ, OP_JNT, OP_EQ_JNT},
+    {OP_NEQ, OP_JNT, OP_NEQ_JNT},
+    {OP_LESS_CONSTANT, OP_JNT, OP_LESS_CONSTANT_JNT},
+  };
+  // only number constants are folded into the arithmetic
+  if (inst->op == OP_CONSTANT && !IS_NUMBER(inst->as.value)) return OP_END;
+  for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++) {
+    if (fusions[i][0] == inst->op && fusions[i][1] == next) return fusions[i][2];
+  }
+  return OP_END;
+}
+
+static void fuse(Inst *inst, uint8_t fused, Inst *next)
+{
+  if (next->op == OP_JNT) {
+    if (inst->op == OP_LESS_CONSTANT) inst->imm = AS_NUMBER(inst->as.value);
+    inst->as.offset = next->as.offset;
+  }
+  inst->op = fused;
+}
+
+// Decodes one function body into insts. Every body ends with OP_END, so
+// running off the end stops the interpreter as it did on the raw bytes.
+// Sequences that have a superinstruction are fused on the way, unless a
+// jump lands inside them. inst_index is scratch space for at least size + 1
+// entries.
+static Inst *predecode(Function *f, Inst *insts, uint16_t *inst_index, uint8_t *code, uint16_t size,
+                       Constant *constants, uint16_t constant_size)
+{
+  // first mark every byte offset a jump lands on
+  memset(inst_index, 0, sizeof(uint16_t) * (size + 1));
+  for (uint32_t pos = 0; pos < size; pos += 1 + operand_size(code[pos])) {
+    if (code[pos] == OP_JMP || code[pos] == OP_JNT) {
+      uint16_t operand = decode_constant(byte_at(code, size, pos+1), byte_at(code, size, pos+2));
+      if (operand < size) inst_index[operand] = 1;
+    }
+  }
+
+  // then decode, replacing the marks behind pos with the index of the
+  // instruction that starts at (or after) each byte offset
+  uint16_t count = 0;
+  uint32_t pos = 0;
+  while (pos < size) {
+    Inst *inst = &insts[count];
+    uint32_t next = decode_inst(inst, code, size, pos, constants, constant_size);
+    while (next < size && inst_index[next] == 0) {
+      uint8_t fused = fusion(inst, code[next]);
+      if (fused == OP_END) break;
+      Inst following = {0};
+      uint32_t after = decode_inst(&following, code, size, next, constants, constant_size);
+      fuse(inst, fused, &following);
+      next = after;
+    }
+    inst_index[pos] = count;
+    for (uint32_t i = pos + 1; i < next && i < size; i++) {
+      inst_index[i] = count + 1;
+    }
+    count++;
+    pos = next;
+  }
+  inst_index[size] = count;
+  insts[count].op = OP_END;
+
+  for (uint16_t i = 0; i < count; i++) {
+    if (is_jump(insts[i].op)) {
+      uint16_t offset = insts[i].as.offset;
+      insts[i].as.target = &insts[inst_index[offset < size ? offset : size]];
+    }
+    // the return stays behind the tail call for jumps to it and for calls
+    // that cannot reuse the frame
+    if (insts[i].op == OP_CALL && insts[i+1].op == OP_RETURN_VAL) {
+      insts[i].op = OP_TAIL_CALL;
+    }
+  }
+
+  f->code = insts;
+  f->size = count;
+  return insts + count + 1;
+}
+
+typedef struct {
+  uint16_t function_size;
+  uint32_t inst_size;
+  uint32_t method_slots;
+  uint16_t max_body;
+} CodeSize;
+
+static void measure_body(CodeSize *size, uint8_t *code, uint16_t body_size)
+{
+  size->function_size++;
+  size->inst_size += count_insts(code, body_size);
+  if (body_size > size->max_body) size->max_body = body_size;
+}
+
+static void measure_pool(CodeSize *size, Constant *constants, uint16_t constant_size)
+{
+  for (int i=0; i<constant_size; i++) {
+    if (constants[i].type == CONST_FUNC) {
+      measure_body(size, constants[i].content, constants[i].size);
+    }
+  }
+}
+
+static uint16_t method_size(Class *c)
+{
+  uint16_t size = 0;
+  for (int i=0; i<c->constant_size; i++) {
+    if (c->constants[i].type == CONST_FUNC && c->constants[i].method_index >= size) {
+      size = c->constants[i].method_index + 1;
+    }
+  }
+  return size;
+}
+
+// Functions, then the method tables of all classes, then the Insts
+size_t code_arena_size(uint16_t function_size, uint32_t inst_size, uint32_t method_slots)
+{
+  return ARENA_ALIGN(sizeof(Function) * function_size) + ARENA_ALIGN(sizeof(Function*) * method_slots)
+    + sizeof(Inst) * inst_size;
+}
+
+static uint16_t bind_functions(Function *functions, uint16_t n, Constant *constants, uint16_t constant_size, Class *owner)
+{
+  for (int i=0; i<constant_size; i++) {
+    if (constants[i].type == CONST_FUNC) {
+      constants[i].function = &functions[n++];
+      constants[i].function->method_index = constants[i].method_index;
+      constants[i].function->owner = owner;
+    }
+  }
+  return n;
+}
+
+// the first method with a given index wins, as the linear lookup did
+static Function **bind_methods(Class *c, Function **methods)
+{
+  c->methods = methods;
+  c->method_size = method_size(c);
+  for (int i=0; i<c->constant_size; i++) {
+    Constant *constant = &c->constants[i];
+    if (constant->type == CONST_FUNC && methods[constant->method_index] == NULL) {
+      methods[constant->method_index] = constant->function;
+    }
+  }
+  return methods + c->method_size;
+}
+
+static Inst *predecode_pool(Inst *insts, uint16_t *inst_index, Constant *constants, uint16_t constant_size)
+{
+  for (int i=0; i<constant_size; i++) {
+    Constant *c = &constants[i];
+    if (c->type == CONST_FUNC) {
+      insts = predecode(c->function, insts, inst_index, c->content, c->size, constants, constant_size);
+    }
+  }
+  return insts;
+}
+
+// Builds the internal instruction stream for the top level code and every
+// function constant. A sizing pass over all bodies comes first; Functions
+// and Insts then share one exactly sized block, taken from the reserve the
+// hex parser left in its arena or allocated here. Function constants are
+// bound before any body is decoded so that OP_CONSTANT can refer to any of
+// them. Methods are decoded against their class constant pool, everything
+// else against the global one, and every class gets a method table indexed
+// by method_index. Nothing is decoded unless verify_bytecode accepts every
+// body.
+bool load_bytecode(Bytecode *b)
+{
+  b->error = (VerifyError) {NULL, 0, 0};
+  CodeSize size = {0, 0, 0, 0};
+  measure_body(&size, b->instructions, b->instruction_size);
+  measure_pool(&size, b->constants, b->constant_size);
+  for (int i=0; i<b->class_size; i++) {
+    measure_pool(&size, b->classes[i].constants, b->classes[i].constant_size);
+    size.method_slots += method_size(&b->classes[i]);
+  }
+
+  size_t arena_size = code_arena_size(size.function_size, size.inst_size, size.method_slots);
+  uint8_t *arena;
+  if (b->reserve != NULL && b->reserve_size >= arena_size) {
+    arena = b->reserve;
+    memset(arena, 0, arena_size);
+  } else {
+    arena = b->code_arena = calloc(1, arena_size);
+  }
+  uint16_t *inst_index = malloc(sizeof(uint16_t) * (size.max_body + 1));
+  if (arena == NULL || inst_index == NULL) {
+    free(inst_index);
+    unload_bytecode(b);
+    return false;
+  }
+  b->functions = (Function*) arena;
+  b->function_size = size.function_size;
+  Function **methods = (Function**) (arena + ARENA_ALIGN(sizeof(Function) * size.function_size));
+  Inst *insts = (Inst*) ((uint8_t*) methods + ARENA_ALIGN(sizeof(Function*) * size.method_slots));
+
+  uint16_t n = bind_functions(b->functions, 1, b->constants, b->constant_size, NULL);
+  for (int i=0; i<b->class_size; i++) {
+    n = bind_functions(b->functions, n, b->classes[i].constants, b->classes[i].constant_size, &b->classes[i]);
+    methods = bind_methods(&b->classes[i], methods);
+  }
+  if (!verify_bytecode(b, inst_index)) {
+    free(inst_index);
+    unload_bytecode(b);
+    return false;
+  }
+
+  insts = predecode(&b->functions[0], insts, inst_index, b->instructions, b->instruction_size, b->constants, b->constant_size);
+  insts = predecode_pool(insts, inst_index, b->constants, b->constant_size);
+  for (int i=0; i<b->class_size; i++) {
+    insts = predecode_pool(insts, inst_index, b->classes[i].constants, b->classes[i].constant_size);
+  }
+  free(inst_index);
+  ir_translate(b);
+  return true;
+}
+
+void unload_bytecode(Bytecode *b)
+{
+  ir_unload(b);
+  free(b->code_arena);
+  b->code_arena = NULL;
+  b->functions = NULL;
+  b->function_size = 0;
+  for (int i=0; i<b->class_size; i++) {
+    b->classes[i].methods = NULL;
+    b->classes[i].method_size = 0;
+  }
+}
@@ -0,0 +1,105 @@
+#include "vm.h"
+
+// LZ payload of compressed programs. Every item starts with a control byte
+// c: below LZ_NEAR, c + 1 literal bytes follow; otherwise the item is a
+// match of (c & 0x3F) + LZ_MIN_MATCH bytes, copied from an offset back in
+// the output, which the copy may overlap. The offset is a u1 for LZ_NEAR
+// matches and a u2 (big endian) for LZ_FAR ones. Bytecode repeats opcode
+// sequences and constant headers a lot, and the format decodes byte by byte
+// as chunks arrive, with no window besides the image itself.
+
+bool is_compressed_program(const uint8_t *data, uint32_t size)
+{
+  return size >= COMPRESSED_HEADER_SIZE && memcmp(data, BINARY_MAGIC, MAGIC_SIZE-1) == 0 &&
+         (data[MAGIC_SIZE-1] & BINARY_COMPRESSED) != 0;
+}
+
+// size of the image once inflated, from the header of a compressed one
+uint32_t compressed_program_size(const uint8_t *data)
+{
+  const uint8_t *p = data + MAGIC_SIZE;
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void lz_init(LzStream *z)
+{
+  z->state = LZ_CONTROL;
+  z->count = 0;
+  z->offset = 0;
+}
+
+// Inflates n more bytes of payload into out, which holds *out_pos bytes so
+// far. False when the payload is corrupt: a match reaching before the start
+// of out, or output beyond out_size.
+bool lz_inflate(LzStream *z, const uint8_t *in, uint32_t n, uint8_t *out, uint32_t out_size, uint32_t *out_pos)
+{
+  uint32_t o = *out_pos;
+  uint32_t i = 0;
+  while (i < n) {
+    switch (z->state) {
+      case LZ_CONTROL: {
+        uint8_t c = in[i++];
+        if (c < LZ_NEAR) {
+          z->count = c + 1;
+          z->state = LZ_LITERALS;
+        } else {
+          z->count = (c & 0x3F) + LZ_MIN_MATCH;
+          z->offset = 0;
+          z->state = c < LZ_FAR ? LZ_OFFSET_LOW : LZ_OFFSET_HIGH;
+        }
+        break;
+      }
+      case LZ_LITERALS: {
+        uint32_t k = n - i < z->count ? n - i : z->count;
+        if (k > out_size - o) return false;
+        memcpy(out + o, in + i, k);
+        o += k;
+        i += k;
+        z->count -= k;
+        if (z->count == 0) z->state = LZ_CONTROL;
+        break;
+      }
+      case LZ_OFFSET_HIGH: {
+        z->offset = in[i++] << 8;
+        z->state = LZ_OFFSET_LOW;
+        break;
+      }
+      case LZ_OFFSET_LOW: {
+        z->offset |= in[i++];
+        if (z->offset == 0 || z->offset > o || z->count > out_size - o) return false;
+        for (uint8_t k = 0; k < z->count; k++, o++) {
+          out[o] = out[o - z->offset];
+        }
+        z->state = LZ_CONTROL;
+        break;
+      }
+    }
+  }
+  *out_pos = o;
+  return true;
+}
+
+// Inflates a whole compressed image into a new buffer, with the plain magic
+// in front. NULL when it is corrupt or does not fit in memory. Only for
+// tools that have the whole image anyway; the device inflates as frames
+// arrive (receive.c).
+uint8_t *inflate_program(const uint8_t *data, uint32_t size, uint32_t *out_size)
+{
+  if (!is_compressed_program(data, size)) return NULL;
+  uint32_t total = compressed_program_size(data);
+  if (total < MAGIC_SIZE) return NULL;
+  uint8_t *out = malloc(total);
+  if (out == NULL) return NULL;
+  memcpy(out, data, MAGIC_SIZE);
+  out[MAGIC_SIZE-1] &= ~BINARY_COMPRESSED;
+  LzStream z;
+  lz_init(&z);
+  uint32_t pos = MAGIC_SIZE;
+  if (!lz_inflate(&z, data + COMPRESSED_HEADER_SIZE, size - COMPRESSED_HEADER_SIZE, out, total, &pos) ||
+      pos != total || z.state != LZ_CONTROL) {
+    free(out);
+    return NULL;
+  }
+  *out_size = total;
+  return out;
+}
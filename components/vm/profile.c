@@ -0,0 +1,139 @@
+#include "vm.h"
+
+#ifdef TARTO_VM_PROFILE
+
+#if defined(ESP_PLATFORM)
+#include "xtensa/hal.h"
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// CPU cycles on the ESP32 and on x86 hosts, nanoseconds elsewhere. Only
+// differences are used, so wrapping is fine.
+uint32_t profile_cycles()
+{
+#if defined(ESP_PLATFORM)
+  return xthal_get_ccount();
+#elif defined(__x86_64__) || defined(__i386__)
+  return (uint32_t) __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+static int function_index(VM *vm, Function *function)
+{
+  // a scheduler's profile has no program to number functions in
+  if (function == NULL || vm->profile.bytecode == NULL) return -1;
+  int index = function - vm->profile.bytecode->functions;
+  return index < PROFILE_FUNCTION_MAX ? index : -1;
+}
+
+void profile_reset(VM *vm, Bytecode *b)
+{
+  memset(&vm->profile, 0, sizeof(Profile));
+  vm->profile.bytecode = b;
+  vm->profile.last_op = OP_END;
+  vm->profile.last = profile_cycles();
+}
+
+static void profile_charge(VM *vm, uint32_t now)
+{
+  Profile *p = &vm->profile;
+  uint32_t cycles = now - p->last;
+  if (p->last_op < OP_COUNT) {
+    p->ops[p->last_op].cycles += cycles;
+  }
+  int f = function_index(vm, p->last_function);
+  if (f >= 0) {
+    p->functions[f].cycles += cycles;
+  }
+  p->last = now;
+}
+
+void profile_dispatch(VM *vm, Frame *frame, uint8_t op)
+{
+  Profile *p = &vm->profile;
+  profile_charge(vm, profile_cycles());
+  if (op < OP_COUNT) {
+    p->ops[op].count++;
+  }
+  p->last_op = op;
+  p->last_function = frame->function;
+}
+
+// frame is the callee frame, site the calling instruction
+void profile_call(VM *vm, Frame *frame, Inst *site)
+{
+  Profile *p = &vm->profile;
+  int f = function_index(vm, frame->function);
+  if (f >= 0) {
+    p->functions[f].count++;
+  }
+  frame->site = -1;
+  frame->enter = profile_cycles();
+  for (int i=0; i<p->site_size; i++) {
+    if (p->sites[i].site == site) {
+      frame->site = i;
+      return;
+    }
+  }
+  if (p->site_size < PROFILE_SITE_MAX) {
+    // the caller is the frame below, the program may be freed by the
+    // time the report is printed
+    Function *caller = (frame-1)->function;
+    ProfileSite *s = &p->sites[p->site_size];
+    s->site = site;
+    s->function = function_index(vm, caller);
+    s->index = site - caller->code;
+    frame->site = p->site_size++;
+  } else {
+    p->dropped_sites++;
+  }
+}
+
+// charges the last instruction when the run ends
+void profile_finish(VM *vm)
+{
+  profile_charge(vm, profile_cycles());
+  vm->profile.last_op = OP_COUNT;
+  vm->profile.last_function = NULL;
+}
+
+void profile_return(VM *vm, Frame *frame)
+{
+  if (frame->site < 0) return;
+  ProfileCounter *counter = &vm->profile.sites[frame->site].counter;
+  counter->count++;
+  counter->cycles += profile_cycles() - frame->enter;
+}
+
+// Printed after the result, one line per opcode, function and call site
+// that ran: "op <name> <count> <cycles>", "fn <index> <calls> <self
+// cycles>" and "site <function>:<inst> <calls> <cycles>".
+void profile_report(VM *vm)
+{
+  Profile *p = &vm->profile;
+  printf("profile:\n");
+  for (int i=0; i<OP_COUNT; i++) {
+    if (p->ops[i].count == 0) continue;
+    printf("op %s %u %llu\n", opcode_name(i), p->ops[i].count, (unsigned long long) p->ops[i].cycles);
+  }
+  for (int i=0; i<PROFILE_FUNCTION_MAX; i++) {
+    if (p->functions[i].cycles == 0) continue;
+    printf("fn %d %u %llu\n", i, p->functions[i].count, (unsigned long long) p->functions[i].cycles);
+  }
+  for (int i=0; i<p->site_size; i++) {
+    printf("site %d:%d %u %llu\n", p->sites[i].function, p->sites[i].index, p->sites[i].counter.count,
+           (unsigned long long) p->sites[i].counter.cycles);
+  }
+  if (p->dropped_sites > 0) {
+    printf("site dropped %u\n", p->dropped_sites);
+  }
+}
+
+#endif
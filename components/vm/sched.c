@@ -0,0 +1,195 @@
+#include "vm.h"
+
+// Green threads. Coroutines share one VM and its heap: the scheduler points
+// vm->stack, vm->frames and vm->global at those of the one it runs, gives it a
+// time slice in vm->budget and resumes it. The interpreters stop at the
+// next taken jump or call once the slice is used up (PREEMPTED), or at a
+// yield, sleep or wait (BLOCKED), with their state written back to the
+// top frame, so vm_resume continues where they stopped.
+//
+// Each pass wakes the sleepers that are due and runs the ready coroutine
+// with the highest priority for one slice; a woken coroutine with a higher
+// priority therefore runs after at most one slice of another one.
+
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static uint32_t system_now(void *ctx)
+{
+  return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+static void system_idle(void *ctx, uint32_t until)
+{
+  int32_t ms = (int32_t) (until - system_now(ctx));
+  vTaskDelay(ms > 0 ? ms / portTICK_PERIOD_MS + 1 : 1);
+}
+#else
+#include <time.h>
+
+static uint32_t system_now(void *ctx)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000u + ts.tv_nsec / 1000000;
+}
+
+static void system_idle(void *ctx, uint32_t until)
+{
+  int32_t ms = (int32_t) (until - system_now(ctx));
+  if (ms <= 0) return;
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+#endif
+
+// Takes over vm for coroutines, whose slots the caller provides; their
+// stacks, frames and globals are allocated as programs are spawned. The
+// clock is the system one until the caller replaces it.
+void scheduler_init(Scheduler *s, VM *vm, Coroutine *coroutines, uint8_t capacity, uint32_t quantum)
+{
+  vm_init(vm, NULL);
+  vm->scheduler = s;
+  s->vm = vm;
+  s->coroutines = coroutines;
+  s->capacity = capacity;
+  s->size = 0;
+  s->quantum = quantum > 0 ? quantum : 1;
+  s->clock = (SchedulerClock){system_now, system_idle, NULL};
+  s->last = 0;
+}
+
+static void switch_to(Scheduler *s, Coroutine *c)
+{
+  VM *vm = s->vm;
+  vm->stack = c->stack;
+  vm->stack_end = c->stack + c->resources.stack;
+  vm->frames = c->frames;
+  vm->frame_max = c->resources.frames;
+  vm->global = c->global;
+  vm->global_size = c->resources.globals;
+  vm->stack_top = c->stack_top;
+  vm->frame_index = c->frame_index;
+}
+
+static void switch_from(Scheduler *s, Coroutine *c)
+{
+  c->stack_top = s->vm->stack_top;
+  c->frame_index = s->vm->frame_index;
+}
+
+// Adds a loaded program, ready to run. The program has to stay loaded
+// until the scheduler is done with it. NULL when there is no room, or no
+// memory for what the program declares.
+Coroutine *scheduler_spawn(Scheduler *s, Bytecode *b, uint8_t priority)
+{
+  if (s->size == s->capacity) return NULL;
+  Resources r = b->resources;
+  // one block: frames, then stack and globals
+  uint8_t *memory = malloc(sizeof(Frame) * r.frames + sizeof(Value) * (r.stack + r.globals));
+  if (memory == NULL) return NULL;
+  Coroutine *c = &s->coroutines[s->size++];
+  c->frames = (Frame*) memory;
+  c->stack = (Value*) (memory + sizeof(Frame) * r.frames);
+  c->global = c->stack + r.stack;
+  c->resources = r;
+  c->bytecode = b;
+  c->state = COROUTINE_READY;
+  c->priority = priority;
+  c->slices = 0;
+  c->result = EXEC_RESULT(SUCCESS, NIL_VAL());
+  memset(c->global, 0, sizeof(Value) * r.globals);
+  switch_to(s, c);
+  vm_start(s->vm, b);
+  switch_from(s, c);
+  return c;
+}
+
+// Readies every coroutine waiting for event.
+void scheduler_signal(Scheduler *s, uint16_t event)
+{
+  for (int i=0; i<s->size; i++) {
+    Coroutine *c = &s->coroutines[i];
+    if (c->state == COROUTINE_WAITING && c->event == event) c->state = COROUTINE_READY;
+  }
+}
+
+static Coroutine *next_ready(Scheduler *s)
+{
+  Coroutine *next = NULL;
+  for (int i=1; i<=s->size; i++) {
+    Coroutine *c = &s->coroutines[(s->last + i) % s->size];
+    if (c->state == COROUTINE_READY && (next == NULL || c->priority > next->priority)) next = c;
+  }
+  return next;
+}
+
+static void run_slice(Scheduler *s, Coroutine *c, uint32_t now)
+{
+  VM *vm = s->vm;
+  switch_to(s, c);
+  vm->budget = s->quantum;
+  resultType result = vm_resume(vm, c->bytecode);
+  c->slices++;
+  s->last = c - s->coroutines;
+  if (result == BLOCKED && vm->block_op == OP_SLEEP) {
+    c->state = COROUTINE_SLEEPING;
+    c->wake_at = now + AS_NUMBER(vm->block_arg);
+  } else if (result == BLOCKED && vm->block_op == OP_WAIT) {
+    c->state = COROUTINE_WAITING;
+    c->event = AS_NUMBER(vm->block_arg);
+  } else if (result != PREEMPTED && result != BLOCKED) {
+    c->result = vm_result(vm, c->bytecode, result);
+    c->state = COROUTINE_DONE;
+    c->done_at = now;
+  }
+  switch_from(s, c);
+}
+
+// Runs until every coroutine is done or waits for an event nobody can
+// signal any more. Returns how many are left waiting; scheduler_signal
+// and another run continue them.
+uint8_t scheduler_run(Scheduler *s)
+{
+  for (;;) {
+    uint32_t now = s->clock.now(s->clock.ctx);
+    bool sleeping = false;
+    uint32_t wake_at = 0;
+    for (int i=0; i<s->size; i++) {
+      Coroutine *c = &s->coroutines[i];
+      if (c->state != COROUTINE_SLEEPING) continue;
+      if ((int32_t) (now - c->wake_at) >= 0) {
+        c->state = COROUTINE_READY;
+      } else if (!sleeping || (int32_t) (c->wake_at - wake_at) < 0) {
+        sleeping = true;
+        wake_at = c->wake_at;
+      }
+    }
+    Coroutine *c = next_ready(s);
+    if (c != NULL) {
+      run_slice(s, c, now);
+    } else if (sleeping) {
+      s->clock.idle(s->clock.ctx, wake_at);
+    } else {
+      break;
+    }
+  }
+  uint8_t waiting = 0;
+  for (int i=0; i<s->size; i++) {
+    if (s->coroutines[i].state == COROUTINE_WAITING) waiting++;
+  }
+  return waiting;
+}
+
+// Frees what the coroutines were given. The scheduler is empty afterwards.
+void scheduler_release(Scheduler *s)
+{
+  for (int i=0; i<s->size; i++) {
+    free(s->coroutines[i].frames);
+    s->coroutines[i].frames = NULL;
+    s->coroutines[i].stack = NULL;
+    s->coroutines[i].global = NULL;
+  }
+  s->size = 0;
+}
@@ -0,0 +1,271 @@
+#include "vm.h"
+
+// Snapshots of a VM stopped where its program blocked, to be resumed after
+// a restart. The image holds no pointers: instances become offsets into
+// the heap, functions indices into Bytecode.functions and instructions
+// indices into their function, so restoring is a copy of every part and
+// one pass over it that turns them back into pointers. The program goes
+// along as its binary image; it is parsed and loaded again on restore,
+// which lays it out the same way, but starts without its inline caches.
+//
+// Layout, native byte order, every part 8-byte aligned:
+// SnapshotHeader, program image, SnapshotFrame per frame, value stack,
+// globals, the used part of the heap.
+
+#define NO_INDEX 0xFFFF
+
+typedef struct {
+  uint32_t magic;
+  // of the whole snapshot
+  uint32_t size;
+  // program_hash of everything after the header
+  uint32_t hash;
+  uint32_t image_size;
+  uint32_t heap_used;
+  // offset + 1 of the first free object of each size class, 0 for none
+  uint32_t free[HEAP_SIZE_CLASSES];
+  HeapStats heap_stats;
+  uint16_t stack_used;
+  uint16_t frame_count;
+  uint16_t globals;
+  // which interpreter the frames belong to
+  bool ir_tier;
+} SnapshotHeader;
+
+typedef struct {
+  uint16_t function;
+  uint16_t ip;
+  uint16_t ir_ip;
+  uint16_t bp;
+  uint8_t arg_num;
+  bool f_method;
+} SnapshotFrame;
+
+typedef struct {
+  uint32_t image;
+  uint32_t frames;
+  uint32_t stack;
+  uint32_t globals;
+  uint32_t heap;
+  uint32_t size;
+} SnapshotLayout;
+
+static SnapshotLayout layout(uint32_t image_size, uint16_t frame_count, uint16_t stack_used, uint16_t globals, uint32_t heap_used)
+{
+  SnapshotLayout l;
+  l.image = ARENA_ALIGN(sizeof(SnapshotHeader));
+  l.frames = l.image + ARENA_ALIGN(image_size);
+  l.stack = l.frames + ARENA_ALIGN(sizeof(SnapshotFrame) * frame_count);
+  l.globals = l.stack + sizeof(Value) * stack_used;
+  l.heap = l.globals + sizeof(Value) * globals;
+  l.size = l.heap + ARENA_ALIGN(heap_used);
+  return l;
+}
+
+static uint8_t *heap_memory(VM *vm)
+{
+  return (uint8_t*) vm->heap.memory;
+}
+
+// Anything that does not point at an object or function of this program
+// is a stale root (see mark_value) and becomes nil.
+static Value relative_value(VM *vm, Bytecode *b, Value v)
+{
+  if (IS_INSTANCE(v)) {
+    uint8_t *p = (uint8_t*) AS_INSTANCE(v);
+    if (p < heap_memory(vm) || p >= vm->heap.top) return NIL_VAL();
+    return (Value) (p - heap_memory(vm)) | TAG_INSTANCE;
+  }
+  if (IS_FUNCTION(v)) {
+    Function *f = AS_FUNCTION(v);
+    if (f < b->functions || f >= b->functions + b->function_size) return NIL_VAL();
+    return (Value) (f - b->functions) << 2 | TAG_FUNCTION;
+  }
+  return v;
+}
+
+static Value absolute_value(VM *vm, Bytecode *b, Value v, uint32_t heap_used)
+{
+  if (IS_INSTANCE(v)) {
+    uintptr_t offset = v - TAG_INSTANCE;
+    if (offset >= heap_used) return NIL_VAL();
+    return INSTANCE_VAL(heap_memory(vm) + offset);
+  }
+  if (IS_FUNCTION(v)) {
+    uintptr_t index = v >> 2;
+    if (index >= b->function_size) return NIL_VAL();
+    return FUNCTION_VAL(&b->functions[index]);
+  }
+  return v;
+}
+
+static uint32_t object_offset(VM *vm, Object *o)
+{
+  return o == NULL ? 0 : (uint8_t*) o - heap_memory(vm) + 1;
+}
+
+static Object *object_at(VM *vm, uint32_t offset)
+{
+  return offset == 0 ? NULL : (Object*) (heap_memory(vm) + offset - 1);
+}
+
+// Bytes snapshot_save needs, 0 when vm cannot be snapshotted: b has to be
+// a binary program run by the VM itself, not natives or a scheduler.
+uint32_t snapshot_size(VM *vm, Bytecode *b)
+{
+  if (b->image == NULL || b->functions[0].native != NULL || vm->scheduler != NULL || vm->frame_index == 0) return 0;
+  uint32_t heap_used = vm->heap.top - heap_memory(vm);
+  return layout(b->image_size, vm->frame_index, vm->stack_top - vm->stack, vm->global_size, heap_used).size;
+}
+
+// Writes the snapshot_size bytes of a snapshot of vm, stopped at a
+// checkpoint, to out.
+bool snapshot_save(VM *vm, Bytecode *b, uint8_t *out)
+{
+  uint32_t size = snapshot_size(vm, b);
+  if (size == 0) return false;
+  SnapshotHeader h;
+  memset(&h, 0, sizeof(SnapshotHeader));
+  h.magic = SNAPSHOT_MAGIC;
+  h.size = size;
+  h.image_size = b->image_size;
+  h.heap_used = vm->heap.top - heap_memory(vm);
+  h.heap_stats = vm->heap.stats;
+  h.stack_used = vm->stack_top - vm->stack;
+  h.frame_count = vm->frame_index;
+  h.globals = vm->global_size;
+  h.ir_tier = ir_tier(vm, b);
+  for (int k=0; k<HEAP_SIZE_CLASSES; k++) {
+    h.free[k] = object_offset(vm, vm->heap.free[k]);
+  }
+  SnapshotLayout l = layout(h.image_size, h.frame_count, h.stack_used, h.globals, h.heap_used);
+  memset(out, 0, size);
+
+  memcpy(out + l.image, b->image, b->image_size);
+  SnapshotFrame *frames = (SnapshotFrame*) (out + l.frames);
+  for (int i=0; i<vm->frame_index; i++) {
+    Frame *f = &vm->frames[i];
+    frames[i].function = f->function - b->functions;
+    // frames run on the register IR leave ip behind
+    frames[i].ip = f->ip >= f->function->code && f->ip < f->function->code + f->function->size ? f->ip - f->function->code : NO_INDEX;
+    frames[i].ir_ip = f->function->ir != NULL && f->ir_ip != NULL ? f->ir_ip - f->function->ir : NO_INDEX;
+    frames[i].bp = f->bp - vm->stack;
+    frames[i].arg_num = f->arg_num;
+    frames[i].f_method = f->f_method;
+  }
+  Value *values = (Value*) (out + l.stack);
+  for (int i=0; i<h.stack_used; i++) {
+    values[i] = relative_value(vm, b, vm->stack[i]);
+  }
+  values = (Value*) (out + l.globals);
+  for (int i=0; i<h.globals; i++) {
+    values[i] = relative_value(vm, b, vm->global[i]);
+  }
+  // objects keep their place; their class comes back from its index
+  uint8_t *heap = out + l.heap;
+  memcpy(heap, heap_memory(vm), h.heap_used);
+  for (uint32_t offset = 0; offset < h.heap_used; ) {
+    Instance *instance = (Instance*) (heap + offset);
+    Object *next = instance->obj.next;
+    instance->obj.next = (Object*) (uintptr_t) object_offset(vm, next);
+    instance->class = NULL;
+    for (int i=0; i<instance->val_size; i++) {
+      instance->variables[i] = instance->obj.free ? NIL_VAL() : relative_value(vm, b, instance->variables[i]);
+    }
+    offset += heap_object_bytes(instance->obj.size_class);
+  }
+  h.hash = program_hash(out + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader));
+  memcpy(out, &h, sizeof(SnapshotHeader));
+  return true;
+}
+
+// Loads the program of a snapshot into b and puts vm back where it was;
+// exec_resume runs it on. The program is parsed in place, so data has to
+// outlive b. ERROR_INVALID_PROGRAM when the snapshot is damaged or was
+// taken on the other tier.
+resultType snapshot_restore(VM *vm, Bytecode *b, const uint8_t *data, uint32_t size)
+{
+  SnapshotHeader h;
+  if (size < sizeof(SnapshotHeader)) return ERROR_INVALID_PROGRAM;
+  memcpy(&h, data, sizeof(SnapshotHeader));
+  if (h.magic != SNAPSHOT_MAGIC || h.size != size || h.heap_used > HEAP_SIZE) return ERROR_INVALID_PROGRAM;
+  SnapshotLayout l = layout(h.image_size, h.frame_count, h.stack_used, h.globals, h.heap_used);
+  if (l.size != size || program_hash(data + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) != h.hash) {
+    return ERROR_INVALID_PROGRAM;
+  }
+  // parse_binary only reads the image
+  if (!parse_binary((uint8_t*) data + l.image, h.image_size, b)) return ERROR_INVALID_PROGRAM;
+  if (!load_bytecode(b)) {
+    vm->error = b->error;
+    free_bytecode(b);
+    return ERROR_INVALID_PROGRAM;
+  }
+  Resources r = b->resources;
+  if (ir_tier(vm, b) != h.ir_tier || b->functions[0].native != NULL ||
+      h.frame_count == 0 || h.frame_count > r.frames || h.stack_used > r.stack || h.globals != r.globals) {
+    free_bytecode(b);
+    return ERROR_INVALID_PROGRAM;
+  }
+  if (!vm_reserve(vm, r)) {
+    free_bytecode(b);
+    return ERROR_OUT_OF_MEMORY;
+  }
+  // the globals come from the snapshot; the caller's setting stays
+  bool retain_globals = vm->retain_globals;
+  vm->retain_globals = false;
+  vm_init(vm, NULL);
+  vm->retain_globals = retain_globals;
+
+  const SnapshotFrame *frames = (const SnapshotFrame*) (data + l.frames);
+  for (int i=0; i<h.frame_count; i++) {
+    const SnapshotFrame *s = &frames[i];
+    Function *function = s->function < b->function_size ? &b->functions[s->function] : NULL;
+    if (function == NULL || s->bp > h.stack_used ||
+        (s->ip == NO_INDEX ? function->ir == NULL || s->ir_ip == NO_INDEX : s->ip >= function->size)) {
+      free_bytecode(b);
+      return ERROR_INVALID_PROGRAM;
+    }
+    Frame *f = &vm->frames[i];
+    memset(f, 0, sizeof(Frame));
+    f->function = function;
+    f->ip = function->code + (s->ip == NO_INDEX ? 0 : s->ip);
+    f->ir_ip = s->ir_ip != NO_INDEX && f->function->ir != NULL ? f->function->ir + s->ir_ip : f->function->ir;
+    f->bp = vm->stack + s->bp;
+    f->arg_num = s->arg_num;
+    f->f_method = s->f_method;
+  }
+  vm->frame_index = h.frame_count;
+  vm->stack_top = vm->stack + h.stack_used;
+  const Value *values = (const Value*) (data + l.stack);
+  for (int i=0; i<h.stack_used; i++) {
+    vm->stack[i] = absolute_value(vm, b, values[i], h.heap_used);
+  }
+  values = (const Value*) (data + l.globals);
+  for (int i=0; i<h.globals; i++) {
+    vm->global[i] = absolute_value(vm, b, values[i], h.heap_used);
+  }
+
+  memcpy(heap_memory(vm), data + l.heap, h.heap_used);
+  for (uint32_t offset = 0; offset < h.heap_used; ) {
+    Instance *instance = (Instance*) (heap_memory(vm) + offset);
+    uint32_t bytes = instance->obj.size_class < HEAP_SIZE_CLASSES ? heap_object_bytes(instance->obj.size_class) : 0;
+    if (bytes == 0 || bytes > h.heap_used - offset || sizeof(Instance) + sizeof(Value) * instance->val_size > bytes ||
+        (!instance->obj.free && (instance->index >= b->class_size ||
+                                 instance->val_size < b->classes[instance->index].instance_val_size))) {
+      free_bytecode(b);
+      return ERROR_INVALID_PROGRAM;
+    }
+    instance->obj.next = object_at(vm, (uint32_t) (uintptr_t) instance->obj.next);
+    instance->class = !instance->obj.free ? &b->classes[instance->index] : NULL;
+    for (int i=0; i<instance->val_size; i++) {
+      instance->variables[i] = absolute_value(vm, b, instance->variables[i], h.heap_used);
+    }
+    offset += bytes;
+  }
+  vm->heap.top = heap_memory(vm) + h.heap_used;
+  for (int k=0; k<HEAP_SIZE_CLASSES; k++) {
+    vm->heap.free[k] = object_at(vm, h.free[k]);
+  }
+  vm->heap.stats = h.heap_stats;
+  return SUCCESS;
+}
@@ -0,0 +1,233 @@
+#include "vm.h"
+
+// Load-time verifier. Every body is checked once, on the wire bytes and
+// before it is decoded, so the interpreter can run it without checks of its
+// own: operands are in range, jumps land on instructions, the operand stack
+// never underflows and has the same depth wherever paths meet. The number
+// of locals and the deepest the stack gets are kept in Function.locals and
+// Function.max_stack; calls compare them with the room that is left, which
+// together with the frame count is the only bounds check left at run time.
+// What a call finds on the stack is checked when it is made (IS_METHOD_OF).
+// Stack depths and global indices are checked against what the program
+// declares in Bytecode.resources.
+
+// marks in the per-byte depth table
+#define NOT_START 0xFFFF
+#define UNSEEN 0xFFFE
+
+typedef struct {
+  Bytecode *b;
+  Function *function;
+  uint8_t *code;
+  uint16_t size;
+  uint16_t constant_size;
+  // class whose pool holds the body, NULL for global functions
+  Class *owner;
+  uint16_t *depth;
+} Body;
+
+static bool fail(Body *body, uint32_t pos, const char *reason)
+{
+  body->b->error.reason = reason;
+  body->b->error.function = body->function - body->b->functions;
+  body->b->error.offset = pos;
+  return false;
+}
+
+static uint16_t operand_u2(Body *body, uint32_t pos)
+{
+  return decode_constant(body->code[pos+1], body->code[pos+2]);
+}
+
+static bool check_operands(Body *body, uint32_t pos)
+{
+  uint8_t op = body->code[pos];
+  if (op >= OP_END) return fail(body, pos, "unknown opcode");
+  if (pos + operand_size(op) >= body->size) return fail(body, pos, "truncated instruction");
+  uint8_t arg = operand_size(op) > 0 ? body->code[pos+1] : 0;
+  switch (op) {
+    case OP_CONSTANT: {
+      uint16_t index = operand_u2(body, pos);
+      if (index == 0 || index > body->constant_size) return fail(body, pos, "constant index out of range");
+      break;
+    }
+    case OP_JNT:
+    case OP_JMP: {
+      uint16_t target = operand_u2(body, pos);
+      if (target > body->size) return fail(body, pos, "jump out of range");
+      if (target < body->size && body->depth[target] == NOT_START) return fail(body, pos, "jump into an instruction");
+      break;
+    }
+    case OP_LOAD_LOCAL:
+    case OP_STORE_LOCAL: {
+      // arguments and locals share the index space
+      if (arg >= body->function->locals) body->function->locals = arg + 1;
+      break;
+    }
+    case OP_LOAD_GLOBAL:
+    case OP_STORE_GLOBAL: {
+      if (arg >= body->b->resources.globals) return fail(body, pos, "global index out of range");
+      break;
+    }
+    case OP_INSTANECE: {
+      if (arg >= body->b->class_size) return fail(body, pos, "class index out of range");
+      break;
+    }
+    case OP_LOAD_INSTANCE_VAL:
+    case OP_STORE_INSTANCE_VAL: {
+      if (body->owner == NULL) return fail(body, pos, "instance value outside a method");
+      if (arg >= body->owner->instance_val_size) return fail(body, pos, "instance value index out of range");
+      break;
+    }
+    case OP_RETURN:
+    case OP_RETURN_VAL: {
+      // the top level has no caller to return to; it ends with OP_DONE
+      if (body->function == &body->b->functions[0]) return fail(body, pos, "return outside a function");
+      break;
+    }
+  }
+  return true;
+}
+
+// values an instruction takes off the stack and puts back
+static void stack_effect(uint8_t op, uint8_t arg, uint16_t *pops, uint16_t *pushes)
+{
+  *pops = 0;
+  *pushes = 0;
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_LOAD_GLOBAL:
+    case OP_LOAD_LOCAL:
+    case OP_INSTANECE:
+    case OP_LOAD_INSTANCE_VAL:
+      *pushes = 1;
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_EQ:
+    case OP_NEQ:
+    case OP_LESS:
+    case OP_GREATER:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case OP_STORE_GLOBAL:
+    case OP_STORE_LOCAL:
+    case OP_STORE_INSTANCE_VAL:
+    case OP_JNT:
+    case OP_RETURN_VAL:
+    case OP_SLEEP:
+    case OP_WAIT:
+      *pops = 1;
+      break;
+    case OP_CALL:
+      // function and arguments, replaced by the result
+      *pops = arg + 1;
+      *pushes = 1;
+      break;
+    case OP_CALL_METHOD:
+      // receiver, method and arguments; a constructor leaves the receiver
+      *pops = arg + 2;
+      *pushes = 1;
+      break;
+    case OP_LOAD_METHOD:
+      // receiver, replaced by receiver and method
+      *pops = 1;
+      *pushes = 2;
+      break;
+    case OP_CALL_NATIVE:
+    case OP_CALL_NATIVE_BATCH:
+      // arguments, replaced by the result; the builtin is looked up at run
+      // time, in the table of the VM that runs the program
+      *pops = arg;
+      *pushes = 1;
+      break;
+  }
+}
+
+static bool flow(Body *body, uint32_t pos, uint32_t to, uint16_t depth, bool *changed)
+{
+  // running off the end stops the program
+  if (to >= body->size) return true;
+  if (body->depth[to] == UNSEEN) {
+    body->depth[to] = depth;
+    *changed = true;
+    return true;
+  }
+  if (body->depth[to] != depth) return fail(body, pos, "stack depth differs where paths meet");
+  return true;
+}
+
+// depth is scratch space for at least size + 1 entries
+static bool verify_body(Body *body)
+{
+  uint8_t *code = body->code;
+  uint16_t *depth = body->depth;
+  for (uint32_t i = 0; i <= body->size; i++) {
+    depth[i] = NOT_START;
+  }
+  for (uint32_t pos = 0; pos < body->size; pos += 1 + operand_size(code[pos])) {
+    depth[pos] = UNSEEN;
+  }
+  body->function->locals = 0;
+  for (uint32_t pos = 0; pos < body->size; pos += 1 + operand_size(code[pos])) {
+    if (!check_operands(body, pos)) return false;
+  }
+
+  // depths propagate along fallthrough and jumps; a pass that learns
+  // nothing new ends it. Code no path reaches keeps UNSEEN.
+  uint16_t max_stack = 0;
+  bool changed = body->size > 0;
+  if (changed) depth[0] = 0;
+  while (changed) {
+    changed = false;
+    for (uint32_t pos = 0; pos < body->size; pos += 1 + operand_size(code[pos])) {
+      if (depth[pos] == UNSEEN) continue;
+      uint8_t op = code[pos];
+      uint16_t pops, pushes;
+      stack_effect(op, operand_size(op) > 0 ? code[pos+1] : 0, &pops, &pushes);
+      if (depth[pos] < pops) return fail(body, pos, "stack underflow");
+      uint16_t after = depth[pos] - pops + pushes;
+      if (after > body->b->resources.stack) return fail(body, pos, "stack overflow");
+      if (after > max_stack) max_stack = after;
+      uint32_t next = pos + 1 + operand_size(op);
+      if (op != OP_JMP && op != OP_RETURN && op != OP_RETURN_VAL && !flow(body, pos, next, after, &changed)) {
+        return false;
+      }
+      if ((op == OP_JMP || op == OP_JNT) && !flow(body, pos, operand_u2(body, pos), after, &changed)) {
+        return false;
+      }
+    }
+  }
+  if (body->function->locals + max_stack > body->b->resources.stack) return fail(body, 0, "frame larger than the stack");
+  body->function->max_stack = max_stack;
+  return true;
+}
+
+static bool verify_pool(Bytecode *b, Constant *constants, uint16_t constant_size, Class *owner, uint16_t *scratch)
+{
+  for (int i=0; i<constant_size; i++) {
+    Constant *c = &constants[i];
+    if (c->type != CONST_FUNC) continue;
+    Body body = {b, c->function, c->content, c->size, constant_size, owner, scratch};
+    if (!verify_body(&body)) return false;
+  }
+  return true;
+}
+
+// Checks the top level code and every function of a bound program and
+// fills in their locals and max_stack. On failure b->error tells which instruction
+// was rejected and why.
+bool verify_bytecode(Bytecode *b, uint16_t *scratch)
+{
+  Body top = {b, &b->functions[0], b->instructions, b->instruction_size, b->constant_size, NULL, scratch};
+  if (!verify_body(&top)) return false;
+  if (!verify_pool(b, b->constants, b->constant_size, NULL, scratch)) return false;
+  for (int i=0; i<b->class_size; i++) {
+    Class *c = &b->classes[i];
+    if (!verify_pool(b, c->constants, c->constant_size, c, scratch)) return false;
+  }
+  return true;
+}
@@ -1,55 +1,131 @@
 #include "vm.h"
 
-Frame *current_frame()
+Frame *current_frame(VM *vm)
 {
-  return &vm.frames[vm.frame_index-1];
+  return &vm->frames[vm->frame_index-1];
 }
 
-Frame pop_frame()
+// Enters function with its arg_num arguments on top of the stack. Locals
+// that are not arguments start out nil right above them, and the operand
+// stack starts above both.
+Frame *push_frame(VM *vm, Function *function, uint8_t arg_num, bool f_method)
 {
-  vm.stack_top = current_frame()->bp;
-  vm.frame_index--;
-  return vm.frames[vm.frame_index];
+  Frame *f = &vm->frames[vm->frame_index++];
+  f->ip = function->code;
+  f->arg_num = arg_num;
+  f->f_method = f_method;
+  f->function = function;
+  f->bp = vm->stack_top-arg_num;
+  f->ir_ip = function->ir;
+  for (Value *v = vm->stack_top; v < f->bp + function->locals; v++) {
+    *v = NIL_VAL();
+  }
+  if (function->locals > arg_num) vm->stack_top = f->bp + function->locals;
+  return f;
 }
 
-void push_frame(Frame frame)
+// Starts the top level code of b on the empty stack of the running
+// coroutine.
+void vm_start(VM *vm, Bytecode *b)
 {
-  frame.bp = vm.stack_top-frame.arg_num;
-  vm.frames[vm.frame_index] = frame;
-  vm.frame_index++;
+  Function *top = &b->functions[0];
+  vm->stack_top = vm->stack;
+  vm->frame_index = 0;
+  // the register IR keeps temporaries above the locals, which the
+  // collector scans as well
+  for (int i=0; i<top->locals+top->max_stack; i++) {
+    vm->stack[i] = NIL_VAL();
+  }
+  push_frame(vm, top, 0, false);
+}
+
+// Sizes the VM's own stack, frames and globals to exactly what a program
+// asks for. Globals keep their values, new ones start out nil. On failure
+// the VM keeps what it had.
+bool vm_reserve(VM *vm, Resources r)
+{
+  if (r.stack != vm->capacity.stack || vm->stack_memory == NULL) {
+    Value *stack = realloc(vm->stack_memory, sizeof(Value) * (r.stack > 0 ? r.stack : 1));
+    if (stack == NULL) return false;
+    vm->stack_memory = stack;
+    vm->capacity.stack = r.stack;
+  }
+  if (r.frames != vm->capacity.frames || vm->frame_memory == NULL) {
+    Frame *frames = realloc(vm->frame_memory, sizeof(Frame) * (r.frames > 0 ? r.frames : 1));
+    if (frames == NULL) return false;
+    vm->frame_memory = frames;
+    vm->capacity.frames = r.frames;
+  }
+  if (r.globals != vm->capacity.globals || vm->global_memory == NULL) {
+    Value *global = realloc(vm->global_memory, sizeof(Value) * (r.globals > 0 ? r.globals : 1));
+    if (global == NULL) return false;
+    if (r.globals > vm->capacity.globals) {
+      memset(global + vm->capacity.globals, 0, sizeof(Value) * (r.globals - vm->capacity.globals));
+    }
+    vm->global_memory = global;
+    vm->capacity.globals = r.globals;
+  }
+  return true;
 }
 
-Frame new_frame(uint16_t ins_size, uint8_t* ins, uint8_t arg_num, Constant *constants, bool f_method)
+void vm_release(VM *vm)
 {
-  Frame frame;
-  frame.instruction_size = ins_size;
-  frame.instructions = ins;
-  frame.ip = -1;
-  frame.arg_num =  arg_num;
-  frame.constants = constants;
-  frame.f_method = f_method;
-  return frame;
+  free(vm->stack_memory);
+  free(vm->frame_memory);
+  free(vm->global_memory);
+  vm->stack_memory = NULL;
+  vm->frame_memory = NULL;
+  vm->global_memory = NULL;
+  vm->capacity = (Resources) {0, 0, 0};
 }
 
-void vm_init(Bytecode b)
+// Resets the VM to its own stack, and starts b on it unless b is NULL.
+void vm_init(VM *vm, Bytecode *b)
 {
-  vm.stack_top = vm.stack;
-  Frame main_func = new_frame(b.instruction_size, b.instructions, 0, b.constants, false);
-  main_func.bp = vm.stack_top;
-  vm.frames[0] = main_func;
-  vm.frame_index = 1;
+  vm->stack = vm->stack_memory;
+  vm->stack_end = vm->stack_memory + vm->capacity.stack;
+  vm->frames = vm->frame_memory;
+  vm->frame_max = vm->capacity.frames;
+  vm->global = vm->global_memory;
+  vm->global_size = vm->capacity.globals;
+  vm->scheduler = NULL;
+  vm->budget = UINT32_MAX;
+  // roots start clean so the collector never sees values of an earlier run.
+  // Retained globals keep immediates only, objects and functions belonged
+  // to the previous program.
+  if (vm->retain_globals) {
+    for (int i=0; i<vm->global_size; i++) {
+      if (IS_INSTANCE(vm->global[i]) || IS_FUNCTION(vm->global[i])) {
+        vm->global[i] = NIL_VAL();
+      }
+    }
+  } else {
+    memset(vm->global, 0, sizeof(Value) * vm->global_size);
+  }
+  if (b != NULL) vm_start(vm, b);
+  heap_init(vm);
+#ifdef TARTO_VM_STATS
+  vm->dispatch_count = 0;
+#endif
+#ifdef TARTO_VM_PROFILE
+  profile_reset(vm, b);
+#endif
+#ifdef TARTO_VM_PAIRS
+  vm->last_op = OP_END;
+  memset(vm->pair_count, 0, sizeof(vm->pair_count));
+#endif
 }
 
-void vm_push(Value value)
+void vm_push(VM *vm, Value value)
 {
-  *vm.stack_top = value;
-  vm.stack_top++;
+  *vm->stack_top = value;
+  vm->stack_top++;
 }
 
-Value vm_pop()
+Value vm_pop(VM *vm)
 {
-  vm.stack_top--;
-  return *vm.stack_top;
+  vm->stack_top--;
+  return *vm->stack_top;
 }
 
 uint8_t trans(unsigned char c)
@@ -72,428 +148,1052 @@ uint16_t decode_constant(uint8_t upper, uint8_t lower)
   return (255*upper + lower);
 }
 
-Constant find_method(Bytecode bytecode, uint8_t class_id, uint8_t method_id) {
-  Constant c;
-  for (int i=0; i<bytecode.classes[class_id].constant_size; i++) {
-    c = bytecode.classes[class_id].constants[i];
-    if (c.type == CONST_FUNC && c.method_index == method_id) {
-      break;
+// what each generic instruction computes, and its quickened form
+static const uint8_t binary_ops[OP_COUNT] = {
+  [OP_ADD] = OP_ADD, [OP_SUB] = OP_SUB, [OP_MUL] = OP_MUL, [OP_DIV] = OP_DIV,
+  [OP_EQ] = OP_EQ, [OP_NEQ] = OP_NEQ, [OP_LESS] = OP_LESS, [OP_GREATER] = OP_GREATER,
+  [OP_ADD_CONSTANT] = OP_ADD, [OP_SUB_CONSTANT] = OP_SUB, [OP_LESS_CONSTANT] = OP_LESS,
+  [OP_LESS_JNT] = OP_LESS, [OP_GREATER_JNT] = OP_GREATER, [OP_EQ_JNT] = OP_EQ, [OP_NEQ_JNT] = OP_NEQ,
+  [OP_LESS_CONSTANT_JNT] = OP_LESS,
+};
+static const uint8_t quickened_ops[OP_COUNT] = {
+  [OP_ADD] = OP_ADD_NUM, [OP_SUB] = OP_SUB_NUM, [OP_MUL] = OP_MUL_NUM, [OP_DIV] = OP_DIV_NUM,
+  [OP_EQ] = OP_EQ_NUM, [OP_NEQ] = OP_NEQ_NUM, [OP_LESS] = OP_LESS_NUM, [OP_GREATER] = OP_GREATER_NUM,
+  [OP_ADD_CONSTANT] = OP_ADD_CONSTANT_NUM, [OP_SUB_CONSTANT] = OP_SUB_CONSTANT_NUM,
+  [OP_LESS_CONSTANT] = OP_LESS_CONSTANT_NUM, [OP_LESS_JNT] = OP_LESS_JNT_NUM,
+  [OP_GREATER_JNT] = OP_GREATER_JNT_NUM, [OP_EQ_JNT] = OP_EQ_JNT_NUM, [OP_NEQ_JNT] = OP_NEQ_JNT_NUM,
+  [OP_LESS_CONSTANT_JNT] = OP_LESS_CONSTANT_JNT_NUM,
+};
+
+// Arithmetic and comparisons on any values, the slow path behind the
+// quickened forms. Numbers are the only type they are defined on; other
+// values are only equal to themselves. A new number type is added here and
+// gets quickened forms of its own.
+resultType binary_op(uint8_t op, Value l, Value r, Value *result)
+{
+  if (IS_NUMBERS(l, r)) {
+    uint16_t a = AS_NUMBER(l);
+    uint16_t b = AS_NUMBER(r);
+    switch (op) {
+      case OP_ADD: *result = NUMBER_VAL(a + b); return SUCCESS;
+      case OP_SUB: *result = NUMBER_VAL(a - b); return SUCCESS;
+      case OP_MUL: *result = NUMBER_VAL(a * b); return SUCCESS;
+      case OP_DIV: {
+        if (b == 0) return ERROR_DIVISION_BY_ZERO;
+        *result = NUMBER_VAL(a / b);
+        return SUCCESS;
+      }
+      case OP_EQ: *result = BOOL_VAL(a == b); return SUCCESS;
+      case OP_NEQ: *result = BOOL_VAL(a != b); return SUCCESS;
+      case OP_LESS: *result = BOOL_VAL(a < b); return SUCCESS;
+      case OP_GREATER: *result = BOOL_VAL(a > b); return SUCCESS;
     }
   }
-  return c;
+  switch (op) {
+    case OP_EQ: *result = BOOL_VAL(l == r); return SUCCESS;
+    case OP_NEQ: *result = BOOL_VAL(l != r); return SUCCESS;
+  }
+  return ERROR_TYPE;
 }
 
-ExecResult exec_interpret(Bytecode b)
-{
-  vm_init(b);
+#if defined(__GNUC__) && !defined(TARTO_VM_SWITCH_DISPATCH)
+#define VM_COMPUTED_GOTO
+#endif
 
-  while(current_frame()->ip < current_frame()->instruction_size - 1) {
-    current_frame()->ip++;
-    uint8_t* ins = current_frame()->instructions;
-    uint16_t ip = current_frame()->ip;
-    uint8_t op = ins[ip];
+#ifdef TARTO_VM_STATS
+#define VM_STAT_COUNT() (vm->dispatch_count++)
+#else
+#define VM_STAT_COUNT() ((void)0)
+#endif
+#ifdef TARTO_VM_PAIRS
+#define VM_STAT_PAIR() do { \
+    if (inst->op < OP_COUNT) { \
+      vm->pair_count[vm->last_op][inst->op]++; \
+      vm->last_op = inst->op; \
+    } \
+  } while (0)
+#else
+#define VM_STAT_PAIR() ((void)0)
+#endif
+// the profiler compiles away completely unless TARTO_VM_PROFILE is set
+#ifdef TARTO_VM_PROFILE
+#define VM_PROFILE_DISPATCH() profile_dispatch(vm, frame, inst->op)
+#define VM_PROFILE_CALL() profile_call(vm, frame, inst)
+#define VM_PROFILE_RETURN() profile_return(vm, frame)
+#define VM_PROFILE_FINISH() profile_finish(vm)
+#else
+#define VM_PROFILE_DISPATCH() ((void)0)
+#define VM_PROFILE_CALL() ((void)0)
+#define VM_PROFILE_RETURN() ((void)0)
+#define VM_PROFILE_FINISH() ((void)0)
+#endif
+#define VM_STAT_DISPATCH() do { \
+    VM_STAT_COUNT(); \
+    VM_STAT_PAIR(); \
+    VM_PROFILE_DISPATCH(); \
+  } while (0)
 
-    switch(op) {
-      case OP_CONSTANT: {
-        uint8_t upper = ins[ip+1];
-        uint8_t lower = ins[ip+2];
-        current_frame()->ip += 2;
-        uint16_t constant_index = decode_constant(upper, lower);
-        Constant c =  current_frame()->constants[constant_index-1];
-        switch(c.type) {
-          case CONST_INT: {
-            upper = c.content[0];
-            lower = c.content[1];
-            vm_push(NUMBER_VAL(decode_constant(upper, lower)));
-            break;
-          }
-          case CONST_FUNC: {
-            vm_push(FUNCTION_VAL(c));
-            break;
-          }
-        }
-        break;
+// ip, frame and stack top live in locals while the loop runs and are
+// written back to vm only around calls and returns.
+// The current instruction is inst, its operands are already decoded.
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+// The verifier has checked every body, so calls are the only place that
+// needs a bounds check: one more frame, and room for the callee's locals
+// and stack.
+#define CALL_FITS(callee) \
+  (vm->frame_index < vm->frame_max && (callee)->locals + (callee)->max_stack <= vm->stack_end - sp)
+// A call in tail position reuses the frame of its caller unless that is the
+// top level code, which has no function slot to move the callee to, or a
+// constructor, which returns its receiver instead. Natives pop a frame of
+// their own, and the profiler pairs every call with a return.
+#ifdef TARTO_VM_PROFILE
+#define TAIL_CALL_FITS(callee, base) false
+#else
+#define TAIL_CALL_FITS(callee, base) \
+  (vm->frame_index > 1 && !(frame->f_method && frame->function->method_index == 0) && \
+   (callee)->native == NULL && (callee)->locals + (callee)->max_stack <= vm->stack_end - (base) - 1)
+#endif
+// Taken jumps and calls use up the time slice in vm->budget. Only the
+// outermost interpreter can stop there: one that native code called into
+// keeps going, and its caller stops at the next one.
+#define TICK() \
+  if (--vm->budget == 0) { \
+    if (base == 0) { \
+      frame->ip = ip; \
+      vm->stack_top = sp; \
+      return PREEMPTED; \
+    } \
+    vm->budget = 1; \
+  }
+// A callee compiled ahead of time runs as a C function on the frame just
+// pushed and pops it again when it returns.
+// Quickening: a generic arithmetic or comparison instruction whose
+// operands turn out to be numbers rewrites itself into its _NUM form, which
+// only checks the tags. When that guard fails the instruction turns back
+// into the generic one and runs again as such.
+#define QUICKEN(numbers) do { \
+    if (numbers) inst->op = quickened_ops[inst->op]; \
+  } while (0)
+// (no do/while around these: DISPATCH may be a continue)
+#define GUARD(numbers, generic) \
+  if (!(numbers)) { \
+    inst->op = (generic); \
+    ip = inst; \
+    DISPATCH(); \
+  }
+#define CALL_NATIVE(callee) \
+  if ((callee)->native != NULL) { \
+    resultType native_result = (callee)->native(vm, b); \
+    if (native_result != SUCCESS) return native_result; \
+    sp = vm->stack_top; \
+    LOAD_FRAME(); \
+    DISPATCH(); \
+  }
+// after a return, hand control back to native code that called in here
+#define RETURN_DISPATCH() \
+  if (vm->frame_index == base) { \
+    vm->stack_top = sp; \
+    return SUCCESS; \
+  } \
+  DISPATCH()
+#define LOAD_FRAME() do { \
+    frame = &vm->frames[vm->frame_index-1]; \
+    ip = frame->ip; \
+  } while (0)
+
+#ifdef VM_COMPUTED_GOTO
+#define CASE(op) L_##op: case op
+#define DISPATCH() do { \
+    inst = ip++; \
+    VM_STAT_DISPATCH(); \
+    goto *dispatch_table[inst->op]; \
+  } while (0)
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+
+// Runs frames from the top one until the frame below base is returned to
+// (SUCCESS, with the result pushed for the caller) or the program stops at
+// OP_END (STOPPED). exec_interpret starts it at base 0; native code enters
+// it through aot_call to run an interpreted callee.
+resultType interpret(VM *vm, Bytecode *b, uint16_t base)
+{
+#ifdef VM_COMPUTED_GOTO
+  static void *dispatch_table[256] = {
+    [0 ... 255] = &&L_OP_UNKNOWN,
+    [OP_CONSTANT] = &&L_OP_CONSTANT,
+    [OP_ADD] = &&L_OP_ADD,
+    [OP_SUB] = &&L_OP_SUB,
+    [OP_MUL] = &&L_OP_MUL,
+    [OP_DIV] = &&L_OP_DIV,
+    [OP_DONE] = &&L_OP_DONE,
+    [OP_EQ] = &&L_OP_EQ,
+    [OP_NEQ] = &&L_OP_NEQ,
+    [OP_LESS] = &&L_OP_LESS,
+    [OP_GREATER] = &&L_OP_GREATER,
+    [OP_LOAD_GLOBAL] = &&L_OP_LOAD_GLOBAL,
+    [OP_STORE_GLOBAL] = &&L_OP_STORE_GLOBAL,
+    [OP_JNT] = &&L_OP_JNT,
+    [OP_JMP] = &&L_OP_JMP,
+    [OP_CALL] = &&L_OP_CALL,
+    [OP_RETURN_VAL] = &&L_OP_RETURN_VAL,
+    [OP_LOAD_LOCAL] = &&L_OP_LOAD_LOCAL,
+    [OP_STORE_LOCAL] = &&L_OP_STORE_LOCAL,
+    [OP_INSTANECE] = &&L_OP_INSTANECE,
+    [OP_LOAD_METHOD] = &&L_OP_LOAD_METHOD,
+    [OP_CALL_METHOD] = &&L_OP_CALL_METHOD,
+    [OP_LOAD_INSTANCE_VAL] = &&L_OP_LOAD_INSTANCE_VAL,
+    [OP_STORE_INSTANCE_VAL] = &&L_OP_STORE_INSTANCE_VAL,
+    [OP_RETURN] = &&L_OP_RETURN,
+    [OP_YIELD] = &&L_OP_YIELD,
+    [OP_SLEEP] = &&L_OP_SLEEP,
+    [OP_WAIT] = &&L_OP_WAIT,
+    [OP_CALL_NATIVE] = &&L_OP_CALL_NATIVE,
+    [OP_CALL_NATIVE_BATCH] = &&L_OP_CALL_NATIVE_BATCH,
+    [OP_END] = &&L_OP_END,
+    [OP_ADD_CONSTANT] = &&L_OP_ADD_CONSTANT,
+    [OP_SUB_CONSTANT] = &&L_OP_SUB_CONSTANT,
+    [OP_LESS_CONSTANT] = &&L_OP_LESS_CONSTANT,
+    [OP_LESS_JNT] = &&L_OP_LESS_JNT,
+    [OP_GREATER_JNT] = &&L_OP_GREATER_JNT,
+    [OP_EQ_JNT] = &&L_OP_EQ_JNT,
+    [OP_NEQ_JNT] = &&L_OP_NEQ_JNT,
+    [OP_LESS_CONSTANT_JNT] = &&L_OP_LESS_CONSTANT_JNT,
+    [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+    [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+    [OP_SUB_NUM] = &&L_OP_SUB_NUM,
+    [OP_MUL_NUM] = &&L_OP_MUL_NUM,
+    [OP_DIV_NUM] = &&L_OP_DIV_NUM,
+    [OP_EQ_NUM] = &&L_OP_EQ_NUM,
+    [OP_NEQ_NUM] = &&L_OP_NEQ_NUM,
+    [OP_LESS_NUM] = &&L_OP_LESS_NUM,
+    [OP_GREATER_NUM] = &&L_OP_GREATER_NUM,
+    [OP_ADD_CONSTANT_NUM] = &&L_OP_ADD_CONSTANT_NUM,
+    [OP_SUB_CONSTANT_NUM] = &&L_OP_SUB_CONSTANT_NUM,
+    [OP_LESS_CONSTANT_NUM] = &&L_OP_LESS_CONSTANT_NUM,
+    [OP_LESS_JNT_NUM] = &&L_OP_LESS_JNT_NUM,
+    [OP_GREATER_JNT_NUM] = &&L_OP_GREATER_JNT_NUM,
+    [OP_EQ_JNT_NUM] = &&L_OP_EQ_JNT_NUM,
+    [OP_NEQ_JNT_NUM] = &&L_OP_NEQ_JNT_NUM,
+    [OP_LESS_CONSTANT_JNT_NUM] = &&L_OP_LESS_CONSTANT_JNT_NUM,
+  };
+#endif
+  Frame *frame;
+  Inst *ip;
+  Inst *inst;
+  Value *sp = vm->stack_top;
+  LOAD_FRAME();
+
+  for (;;) {
+    inst = ip++;
+    VM_STAT_DISPATCH();
+    switch (inst->op) {
+      CASE(OP_CONSTANT): {
+        PUSH(inst->as.value);
+        DISPATCH();
       }
-      case OP_ADD: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        vm_push(NUMBER_VAL(l.as.number+r.as.number));
-        break;
+      CASE(OP_ADD):
+      CASE(OP_SUB):
+      CASE(OP_MUL):
+      CASE(OP_DIV):
+      CASE(OP_EQ):
+      CASE(OP_NEQ):
+      CASE(OP_LESS):
+      CASE(OP_GREATER): {
+        Value r = POP();
+        Value l = POP();
+        Value result;
+        resultType error = binary_op(inst->op, l, r, &result);
+        if (error != SUCCESS) return error;
+        QUICKEN(IS_NUMBERS(l, r));
+        PUSH(result);
+        DISPATCH();
       }
-      case OP_SUB: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        vm_push(NUMBER_VAL(l.as.number-r.as.number));
-        break;
+      CASE(OP_ADD_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_ADD);
+        sp--;
+        sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1])+AS_NUMBER(sp[0]));
+        DISPATCH();
       }
-      case OP_MUL: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        vm_push(NUMBER_VAL(l.as.number*r.as.number));
-        break;
+      CASE(OP_SUB_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_SUB);
+        sp--;
+        sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1])-AS_NUMBER(sp[0]));
+        DISPATCH();
       }
-      case OP_DIV: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        if (r.as.number == 0) {
-          return EXEC_RESULT(ERROR_DIVISION_BY_ZERO, NIL_VAL());
-        }
-        vm_push(NUMBER_VAL(l.as.number/r.as.number));
-        break;
+      CASE(OP_MUL_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_MUL);
+        sp--;
+        sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1])*AS_NUMBER(sp[0]));
+        DISPATCH();
       }
-      case OP_EQ: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        if (l.as.number-r.as.number == 0) {
-          vm_push(BOOL_VAL(true));
-          break;
+      CASE(OP_DIV_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_DIV);
+        sp--;
+        if (AS_NUMBER(sp[0]) == 0) {
+          return ERROR_DIVISION_BY_ZERO;
         }
-        vm_push(BOOL_VAL(false));
-        break;
+        sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1])/AS_NUMBER(sp[0]));
+        DISPATCH();
       }
-      case OP_NEQ: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        if (l.as.number-r.as.number == 0) {
-          vm_push(BOOL_VAL(false));
-          break;
+      CASE(OP_EQ_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_EQ);
+        sp--;
+        sp[-1] = BOOL_VAL(AS_NUMBER(sp[-1]) == AS_NUMBER(sp[0]));
+        DISPATCH();
+      }
+      CASE(OP_NEQ_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_NEQ);
+        sp--;
+        sp[-1] = BOOL_VAL(AS_NUMBER(sp[-1]) != AS_NUMBER(sp[0]));
+        DISPATCH();
+      }
+      CASE(OP_LESS_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_LESS);
+        sp--;
+        sp[-1] = BOOL_VAL(AS_NUMBER(sp[-1]) < AS_NUMBER(sp[0]));
+        DISPATCH();
+      }
+      CASE(OP_GREATER_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_GREATER);
+        sp--;
+        sp[-1] = BOOL_VAL(AS_NUMBER(sp[-1]) > AS_NUMBER(sp[0]));
+        DISPATCH();
+      }
+      CASE(OP_DONE): {
+        DISPATCH();
+      }
+      CASE(OP_LOAD_GLOBAL): {
+        PUSH(vm->global[inst->arg]);
+        DISPATCH();
+      }
+      CASE(OP_STORE_GLOBAL): {
+        vm->global[inst->arg] = POP();
+        DISPATCH();
+      }
+      CASE(OP_JNT): {
+        Value condition = POP();
+        if (!AS_BOOL(condition)) {
+          ip = inst->as.target;
+          TICK();
         }
-        vm_push(BOOL_VAL(true));
-        break;
+        DISPATCH();
       }
-      case OP_LESS: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        if (r.as.number-l.as.number > 0) {
-          vm_push(BOOL_VAL(true));
-          break;
+      CASE(OP_JMP): {
+        ip = inst->as.target;
+        TICK();
+        DISPATCH();
+      }
+      CASE(OP_CALL):
+      CASE(OP_TAIL_CALL): {
+        uint8_t arg_num = inst->arg;
+        Value constant = *(sp-arg_num-1);
+
+        if (!IS_FUNCTION(constant)) return ERROR_OTHER;
+        Function *callee = AS_FUNCTION(constant);
+        if (callee->owner != NULL) return ERROR_NO_METHOD;
+        // the function and arguments move down to where the caller's
+        // function (and receiver) are, as if it had returned first
+        Value *slot = frame->bp - (frame->f_method ? 2 : 1);
+        if (inst->op == OP_TAIL_CALL && TAIL_CALL_FITS(callee, slot)) {
+          memmove(slot, sp-arg_num-1, sizeof(Value) * (arg_num+1));
+          vm->stack_top = slot + 1 + arg_num;
+          vm->frame_index--;
+          push_frame(vm, callee, arg_num, false);
+          sp = vm->stack_top;
+          LOAD_FRAME();
+          TICK();
+          DISPATCH();
         }
-        vm_push(BOOL_VAL(false));
-        break;
+        if (!CALL_FITS(callee)) return ERROR_STACK_OVERFLOW;
+        frame->ip = ip;
+        vm->stack_top = sp;
+        push_frame(vm, callee, arg_num, false);
+        CALL_NATIVE(callee);
+        sp = vm->stack_top;
+        LOAD_FRAME();
+        VM_PROFILE_CALL();
+        TICK();
+        DISPATCH();
       }
-      case OP_GREATER: {
-        Value r = vm_pop();
-        Value l = vm_pop();
-        if (l.as.number-r.as.number > 0) {
-          vm_push(BOOL_VAL(true));
-          break;
+      CASE(OP_RETURN_VAL): {
+        Value val = POP();
+        bool f_method = frame->f_method;
+        sp = frame->bp;
+        VM_PROFILE_RETURN();
+        vm->frame_index--;
+        LOAD_FRAME();
+        Value function = POP(); // pop function
+        if (AS_FUNCTION(function)->method_index == 0 && f_method) {
+          // constructor
+          RETURN_DISPATCH();
         }
-        vm_push(BOOL_VAL(false));
-        break;
+        if (f_method) {
+          sp--; // pop receiver
+        }
+        PUSH(val);
+        RETURN_DISPATCH();
       }
-      case OP_DONE: {
-        break;
+      CASE(OP_LOAD_LOCAL): {
+        PUSH(frame->bp[inst->arg]);
+        DISPATCH();
       }
-      case OP_LOAD_GLOBAL: {
-        uint8_t index = ins[++current_frame()->ip];
-        vm_push(vm.global[index]);
-        break;
+      CASE(OP_STORE_LOCAL): {
+        frame->bp[inst->arg] = POP();
+        DISPATCH();
       }
-      case OP_STORE_GLOBAL: {
-        current_frame()->ip++;
-        uint8_t index = ins[current_frame()->ip];
-        vm.global[index] = vm_pop();
-        break;
+      CASE(OP_INSTANECE): {
+        uint8_t class_index = inst->arg;
+        vm->stack_top = sp;
+        Instance *instance = heap_alloc_instance(vm, &b->classes[class_index], class_index);
+        if (instance == NULL) {
+          return ERROR_OUT_OF_MEMORY;
+        }
+        PUSH(INSTANCE_VAL(instance));
+        DISPATCH();
       }
-      case OP_JNT: {
-        Value condition = vm_pop();
-        uint8_t upper = ins[++current_frame()->ip];
-        uint8_t lower = ins[++current_frame()->ip];
-        uint16_t jmp_offset = decode_constant(upper, lower);
-        if (condition.as.boolean) {
-          break;
+      CASE(OP_CALL_METHOD): {
+        uint8_t arg_num = inst->arg;
+        if (!IS_METHOD_OF(*(sp-arg_num-1), *(sp-arg_num-2))) return ERROR_NO_METHOD;
+        Function *callee = AS_FUNCTION(*(sp-arg_num-1));
+        if (!CALL_FITS(callee)) return ERROR_STACK_OVERFLOW;
+        frame->ip = ip;
+        vm->stack_top = sp;
+        push_frame(vm, callee, arg_num, true);
+        CALL_NATIVE(callee);
+        sp = vm->stack_top;
+        LOAD_FRAME();
+        VM_PROFILE_CALL();
+        TICK();
+        DISPATCH();
+      }
+      CASE(OP_LOAD_METHOD): {
+        Value receiver = POP();
+        if (!IS_INSTANCE(receiver)) {
+          return ERROR_NO_METHOD;
         }
-        current_frame()->ip = jmp_offset-1;
-        break;
+        Instance *instance = AS_INSTANCE(receiver);
+        Function *method;
+        if (inst->imm == instance->index + 1) {
+          method = inst->as.function;
+        } else {
+          Class *c = instance->class;
+          if (inst->arg >= c->method_size || c->methods[inst->arg] == NULL) {
+            return ERROR_NO_METHOD;
+          }
+          method = c->methods[inst->arg];
+          inst->imm = instance->index + 1;
+          inst->as.function = method;
+        }
+        PUSH(receiver);
+        PUSH(FUNCTION_VAL(method));
+        DISPATCH();
       }
-      case OP_JMP: {
-        uint8_t upper = ins[++current_frame()->ip];
-        uint8_t lower = ins[++current_frame()->ip];
-        uint16_t jmp_offset = decode_constant(upper, lower);
-        current_frame()->ip = jmp_offset-1;
-        break;
+      CASE(OP_LOAD_INSTANCE_VAL): {
+        uint8_t index = inst->arg;
+        Value receiver = *(frame->bp-2);
+        PUSH(AS_INSTANCE(receiver)->variables[index]);
+        DISPATCH();
       }
-      case OP_CALL: {
-        int8_t arg_num = ins[++current_frame()->ip];
-        Value constant = *(vm.stack_top-arg_num-1);
-
-        if (constant.as.function.type != CONST_FUNC) return EXEC_RESULT(ERROR_OTHER, NIL_VAL());
-        push_frame(new_frame(constant.as.function.size, constant.as.function.content, arg_num, b.constants, false));
-        break;
+      CASE(OP_STORE_INSTANCE_VAL): {
+        uint8_t index = inst->arg;
+        Value receiver = *(frame->bp-2);
+        AS_INSTANCE(receiver)->variables[index] = POP();
+        DISPATCH();
       }
-      case OP_RETURN_VAL: {
-        Value val = vm_pop();
-        Frame f = pop_frame();
-        Value function = vm_pop(); // pop function
-        if (function.as.function.method_index == 0 && f.f_method) {
+      CASE(OP_RETURN): {
+        bool f_method = frame->f_method;
+        sp = frame->bp;
+        VM_PROFILE_RETURN();
+        vm->frame_index--;
+        LOAD_FRAME();
+        Value function = POP(); // pop function
+        if (AS_FUNCTION(function)->method_index == 0 && f_method) {
           // constructor
-          break;
+          RETURN_DISPATCH();
         }
-        if (f.f_method) {
-          vm_pop(); // pop receiver
+        if (f_method) {
+          sp--; // pop receiver
         }
-        vm_push(val);
-        break;
+        PUSH(NIL_VAL());
+        RETURN_DISPATCH();
       }
-      case OP_LOAD_LOCAL: {
-        uint8_t index = ins[++current_frame()->ip];
-        if (index < current_frame()->arg_num) {
-          Value arg_val = current_frame()->bp[index];
-          vm_push(arg_val);
-          break;
+      CASE(OP_YIELD):
+      CASE(OP_SLEEP):
+      CASE(OP_WAIT): {
+        Value arg = NIL_VAL();
+        if (inst->op != OP_YIELD) {
+          arg = POP();
+          if (!IS_NUMBER(arg)) return ERROR_TYPE;
         }
-        vm_push(current_frame()->local[index]);
-        break;
+        // native code on the C stack cannot be suspended
+        if (base != 0) DISPATCH();
+        vm->block_op = inst->op;
+        vm->block_arg = arg;
+        frame->ip = ip;
+        vm->stack_top = sp;
+        return BLOCKED;
       }
-      case OP_STORE_LOCAL: {
-        uint8_t index = ins[++current_frame()->ip];
-        if (index < current_frame()->arg_num) {
-          current_frame()->bp[index] = vm_pop();
-          break;
+      CASE(OP_CALL_NATIVE):
+      CASE(OP_CALL_NATIVE_BATCH): {
+        // no frame: the builtin reads its arguments off the stack and its
+        // result replaces them
+        Value *args = sp - inst->arg;
+        vm->stack_top = sp;
+        resultType error = call_builtin(vm, inst->imm, args, inst->arg, inst->op == OP_CALL_NATIVE_BATCH, args);
+        if (error != SUCCESS) return error;
+        sp = args + 1;
+        DISPATCH();
+      }
+      CASE(OP_END): {
+        VM_PROFILE_FINISH();
+        vm->stack_top = sp;
+        return STOPPED;
+      }
+      CASE(OP_ADD_CONSTANT):
+      CASE(OP_SUB_CONSTANT):
+      CASE(OP_LESS_CONSTANT): {
+        Value result;
+        resultType error = binary_op(binary_ops[inst->op], sp[-1], inst->as.value, &result);
+        if (error != SUCCESS) return error;
+        QUICKEN(IS_NUMBER(sp[-1]));
+        sp[-1] = result;
+        DISPATCH();
+      }
+      CASE(OP_LESS_JNT):
+      CASE(OP_GREATER_JNT):
+      CASE(OP_EQ_JNT):
+      CASE(OP_NEQ_JNT):
+      CASE(OP_LESS_CONSTANT_JNT): {
+        Value r = inst->op == OP_LESS_CONSTANT_JNT ? NUMBER_VAL(inst->imm) : POP();
+        Value l = POP();
+        Value result;
+        resultType error = binary_op(binary_ops[inst->op], l, r, &result);
+        if (error != SUCCESS) return error;
+        QUICKEN(IS_NUMBERS(l, r));
+        if (!AS_BOOL(result)) {
+          ip = inst->as.target;
+          TICK();
         }
-        current_frame()->local[index] = vm_pop();
-        break;
+        DISPATCH();
       }
-      case OP_INSTANECE: {
-        uint8_t class_index = ins[++current_frame()->ip];
-        Class c = b.classes[class_index];
-        // TODO 確保できるinstance valサイズの拡張
-        Value *variables = calloc(sizeof(Value), INSTANCE_VAL_MAX);
-        vm_push(INSTANCE_VAL(INSTANCE(&c, class_index, c.instance_val_size, variables)));
-        break;
+      CASE(OP_ADD_CONSTANT_NUM): {
+        GUARD(IS_NUMBER(sp[-1]), OP_ADD_CONSTANT);
+        sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1])+AS_NUMBER(inst->as.value));
+        DISPATCH();
       }
-      case OP_CALL_METHOD: {
-        uint8_t arg_num = ins[++current_frame()->ip];
-        Value val = *(vm.stack_top-arg_num-1);
-        Value receiver = *(vm.stack_top-arg_num-2);
-        push_frame(new_frame(val.as.function.size, val.as.function.content, arg_num, b.classes[receiver.as.instance.index].constants, true));
-        break;
+      CASE(OP_SUB_CONSTANT_NUM): {
+        GUARD(IS_NUMBER(sp[-1]), OP_SUB_CONSTANT);
+        sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1])-AS_NUMBER(inst->as.value));
+        DISPATCH();
       }
-      case OP_LOAD_METHOD: {
-        Value receiver = vm_pop();
-        if (receiver.type != VAL_INSTANCE) {
-          return EXEC_RESULT(ERROR_NO_METHOD, NIL_VAL());
+      CASE(OP_LESS_CONSTANT_NUM): {
+        GUARD(IS_NUMBER(sp[-1]), OP_LESS_CONSTANT);
+        sp[-1] = BOOL_VAL(AS_NUMBER(sp[-1]) < AS_NUMBER(inst->as.value));
+        DISPATCH();
+      }
+      CASE(OP_LESS_JNT_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_LESS_JNT);
+        sp -= 2;
+        if (!(AS_NUMBER(sp[0]) < AS_NUMBER(sp[1]))) {
+          ip = inst->as.target;
+          TICK();
         }
-        uint8_t index = ins[++current_frame()->ip];
-        Constant constant = find_method(b, receiver.as.instance.index, index);
-        vm_push(receiver);
-        vm_push(FUNCTION_VAL(constant));
-        break;
+        DISPATCH();
       }
-      case OP_LOAD_INSTANCE_VAL: {
-        uint8_t index = ins[++current_frame()->ip];
-        Value receiver = *(current_frame()->bp-2);
-        vm_push(receiver.as.instance.variables[index]);
-        break;
+      CASE(OP_GREATER_JNT_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_GREATER_JNT);
+        sp -= 2;
+        if (!(AS_NUMBER(sp[0]) > AS_NUMBER(sp[1]))) {
+          ip = inst->as.target;
+          TICK();
+        }
+        DISPATCH();
       }
-      case OP_STORE_INSTANCE_VAL: {
-        uint8_t index = ins[++current_frame()->ip];
-        Value receiver = *(current_frame()->bp-2);
-        receiver.as.instance.variables[index] = vm_pop();
-        break;
+      CASE(OP_EQ_JNT_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_EQ_JNT);
+        sp -= 2;
+        if (AS_NUMBER(sp[0]) != AS_NUMBER(sp[1])) {
+          ip = inst->as.target;
+          TICK();
+        }
+        DISPATCH();
       }
-      case OP_RETURN: {
-        Frame f = pop_frame();
-        Value function = vm_pop(); // pop function
-        if (function.as.function.method_index == 0 && f.f_method) {
-          // constructor
-          break;
+      CASE(OP_NEQ_JNT_NUM): {
+        GUARD(IS_NUMBERS(sp[-2], sp[-1]), OP_NEQ_JNT);
+        sp -= 2;
+        if (AS_NUMBER(sp[0]) == AS_NUMBER(sp[1])) {
+          ip = inst->as.target;
+          TICK();
         }
-        if (f.f_method) {
-          vm_pop(); // pop receiver
+        DISPATCH();
+      }
+      CASE(OP_LESS_CONSTANT_JNT_NUM): {
+        GUARD(IS_NUMBER(sp[-1]), OP_LESS_CONSTANT_JNT);
+        sp--;
+        if (!(AS_NUMBER(sp[0]) < inst->imm)) {
+          ip = inst->as.target;
+          TICK();
         }
-        vm_push(NIL_VAL());
-        break;
+        DISPATCH();
       }
+#ifdef VM_COMPUTED_GOTO
+      L_OP_UNKNOWN:
+#endif
       default:
-        return EXEC_RESULT(ERROR_UNKNOWN_OPCODE, NIL_VAL());
+        return ERROR_UNKNOWN_OPCODE;
     }
   }
-  Value val = vm_pop();
+}
+
+// Programs run on the register IR when they have it. The profiler and the
+// pair histogram count stack opcodes, so their builds stay on the stack tier.
+bool ir_tier(VM *vm, Bytecode *b)
+{
+#if defined(TARTO_VM_PROFILE) || defined(TARTO_VM_PAIRS)
+  return false;
+#else
+  return b->functions[0].ir != NULL && !vm->stack_tier;
+#endif
+}
+
+// Runs the running coroutine on until it stops, fails, or is preempted or
+// blocked. Natives are never preempted, so they only ever start.
+resultType vm_resume(VM *vm, Bytecode *b)
+{
+  if (b->functions[0].native != NULL) return b->functions[0].native(vm, b);
+  if (ir_tier(vm, b)) return ir_interpret(vm, b);
+  return interpret(vm, b, 0);
+}
+
+// What the program reports once it has stopped with result.
+ExecResult vm_result(VM *vm, Bytecode *b, resultType result)
+{
+  if (result != SUCCESS && result != STOPPED) {
+    return EXEC_RESULT(result, NIL_VAL());
+  }
+  // a program may end with nothing on the stack above its locals
+  Value val = vm->stack_top > vm->stack + b->functions[0].locals ? vm_pop(vm) : NIL_VAL();
   return EXEC_RESULT(SUCCESS, val);
 }
 
+ExecResult exec_interpret(VM *vm, Bytecode *b)
+{
+  if (!vm_reserve(vm, b->resources)) {
+    return EXEC_RESULT(ERROR_OUT_OF_MEMORY, NIL_VAL());
+  }
+  vm_init(vm, b);
+  return exec_resume(vm, b);
+}
+
+// Runs b on from where its top frame is until it is done: the rest of
+// exec_interpret, or a program restored from a snapshot.
+ExecResult exec_resume(VM *vm, Bytecode *b)
+{
+  resultType result;
+  do {
+    // with nothing else to run, time slices and blocking just continue
+    vm->budget = UINT32_MAX;
+    result = vm_resume(vm, b);
+    if (result == BLOCKED && vm->checkpoint != NULL) vm->checkpoint(vm, b);
+  } while (result == PREEMPTED || result == BLOCKED);
+  return vm_result(vm, b, result);
+}
+
+typedef struct {
+  char *str;
+  uint32_t len;
+  uint32_t cnt;
+  bool ok;
+} HexReader;
+
+static uint8_t hex_u1(HexReader *r)
+{
+  if (r->len - r->cnt < 2) {
+    r->ok = false;
+    return 0;
+  }
+  uint8_t up = r->str[r->cnt++];
+  uint8_t low = r->str[r->cnt++];
+  return calc_byte(up, low);
+}
+
+static uint16_t hex_u2(HexReader *r)
+{
+  uint8_t upper = hex_u1(r);
+  uint8_t lower = hex_u1(r);
+  return decode_constant(upper, lower);
+}
+
+static bool hex_skip(HexReader *r, uint16_t size)
+{
+  if ((r->len - r->cnt) / 2 < size) {
+    r->ok = false;
+    return false;
+  }
+  r->cnt += 2 * size;
+  return true;
+}
+
+// count_insts on a body that is still hex encoded
+static uint32_t count_hex_insts(HexReader *r, uint16_t size)
+{
+  uint32_t count = 1;
+  for (uint32_t pos = 0; pos < size; pos += 1 + operand_size(calc_byte(r->str[r->cnt+2*pos], r->str[r->cnt+2*pos+1]))) {
+    count++;
+  }
+  return count;
+}
+
+// int constants always get two bytes, the interpreter reads both
+static uint16_t content_size(uint8_t type, uint16_t size)
+{
+  return (type == CONST_INT && size < 2) ? 2 : size;
+}
+
+typedef struct {
+  uint32_t constant_size;
+  uint32_t content_size;
+  uint16_t function_size;
+  uint32_t inst_size;
+  uint32_t method_slots;
+} HexLayout;
+
+// returns the method table size the pool needs if it is a class pool
+static uint16_t measure_hex_pool(HexReader *r, uint16_t constant_size, HexLayout *layout)
+{
+  uint16_t method_size = 0;
+  layout->constant_size += constant_size;
+  for (int i=0; i<constant_size && r->ok; i++) {
+    uint8_t type = hex_u1(r);
+    if (type == CONST_FUNC) {
+      uint8_t method_index = hex_u1(r);
+      if (method_index >= method_size) method_size = method_index + 1;
+    }
+    uint16_t size = hex_u2(r);
+    if (!r->ok || (r->len - r->cnt) / 2 < size) {
+      r->ok = false;
+      return 0;
+    }
+    if (type == CONST_FUNC) {
+      layout->function_size++;
+      layout->inst_size += count_hex_insts(r, size);
+    }
+    layout->content_size += content_size(type, size);
+    hex_skip(r, size);
+  }
+  return method_size;
+}
+
+static Constant *parse_hex_pool(HexReader *r, Constant *constants, uint16_t constant_size, uint8_t **content)
+{
+  for (int i=0; i<constant_size; i++) {
+    Constant *c = &constants[i];
+    c->type = hex_u1(r);
+    c->method_index = c->type == CONST_FUNC ? hex_u1(r) : 0;
+    c->size = hex_u2(r);
+    c->content = *content;
+    for (int k=0; k<c->size; k++) {
+      c->content[k] = hex_u1(r);
+    }
+    *content += content_size(c->type, c->size);
+  }
+  return constants + constant_size;
+}
+
+// Parses a hex program. A sizing pass over the whole program comes first so
+// that the classes, every constant table, constant content and the instructions fit in
+// one exactly sized arena, which also reserves the room load_bytecode needs.
+// The arena is released with free_bytecode. On malformed input the returned
+// Bytecode has no arena.
 Bytecode parse_bytecode(char* str)
 {
   Bytecode bytecode;
-  uint8_t* insts = calloc(sizeof(uint8_t), INST_MAX);
-  Constant* constants = calloc(sizeof(Constant), CONST_MAX);
-  int cnt = 0;
-  int pos = 0;
+  memset(&bytecode, 0, sizeof(Bytecode));
 
   // u4 skip magic number
-  for (int i=0; i<4; i++) {
-    cnt += 2;
-    pos++;
-  }
-
-  // u1 parse class_pool_count
-  uint8_t up =  str[cnt++];
-  uint8_t low = str[cnt++];
-  uint8_t class_pool_size = calc_byte(up, low);
-
-  // parse class pool
-  for (int i=0; i<class_pool_size; i++) {
-    up =  str[cnt++];
-    low = str[cnt++];
-    uint8_t instance_val_size = calc_byte(up, low);
-
-    up =  str[cnt++];
-    low = str[cnt++];
-    uint8_t upper = calc_byte(up, low);
-    pos++;
-    up =  str[cnt++];
-    low = str[cnt++];
-    pos++;
-    uint8_t lower= calc_byte(up, low);
-    uint8_t class_constant_pool_size = decode_constant(upper, lower);
-    Constant* class_constants = calloc(sizeof(Constant), CONST_MAX);
-
-    // parse class constant pool
-    for (int j=0; j<class_constant_pool_size; j++) {
-      up =  str[cnt++];
-      low = str[cnt++];
-      pos++;
-      uint8_t class_const_type = calc_byte(up, low);
-      uint8_t class_func_id = 0;
-      if (class_const_type == CONST_FUNC) {
-        up =  str[cnt++];
-        low = str[cnt++];
-        pos++;
-        class_func_id = calc_byte(up, low);
-      }
-      up =  str[cnt++];
-      low = str[cnt++];
-      pos++;
-      upper = calc_byte(up, low);
-      up =  str[cnt++];
-      low = str[cnt++];
-      pos++;
-      lower = calc_byte(up, low);
-      uint16_t class_const_size = decode_constant(upper, lower);
-      switch (class_const_type) {
-        case CONST_INT: {
-          uint8_t *content = calloc(sizeof(uint8_t), 2);
-          for (int k=0; k<class_const_size; k++) {
-            up =  str[cnt++];
-            low = str[cnt++];
-            pos++;
-            content[k] = calc_byte(up, low);
-          }
-          class_constants[j].content = content;
-          break;
+  HexReader r = {str, strlen(str), 0, true};
+  hex_skip(&r, MAGIC_SIZE);
+  HexLayout layout = {0, 0, 0, 0, 0};
+  uint8_t class_pool_size = hex_u1(&r);
+  for (int i=0; i<class_pool_size && r.ok; i++) {
+    hex_u1(&r);
+    layout.method_slots += measure_hex_pool(&r, hex_u2(&r), &layout);
+  }
+  measure_hex_pool(&r, hex_u2(&r), &layout);
+  uint16_t inst_size = hex_u2(&r);
+  if (!r.ok || (r.len - r.cnt) / 2 < inst_size) {
+    return bytecode;
+  }
+  layout.function_size++;
+  layout.inst_size += count_hex_insts(&r, inst_size);
+  layout.content_size += inst_size;
+
+  size_t classes_bytes = ARENA_ALIGN(sizeof(Class) * class_pool_size);
+  size_t constants_bytes = ARENA_ALIGN(sizeof(Constant) * layout.constant_size);
+  size_t reserve_size = code_arena_size(layout.function_size, layout.inst_size, layout.method_slots);
+  uint8_t *arena = calloc(1, classes_bytes + constants_bytes + reserve_size + layout.content_size);
+  if (arena == NULL) {
+    return bytecode;
+  }
+  bytecode.arena = arena;
+  bytecode.classes = (Class*) arena;
+  bytecode.reserve = arena + classes_bytes + constants_bytes;
+  bytecode.reserve_size = reserve_size;
+  // the hex format has no room to declare sizes
+  bytecode.resources = (Resources) {STACK_DEFAULT, FRAME_DEFAULT, GLOBAL_DEFAULT};
+  Constant *constants = (Constant*) (arena + classes_bytes);
+  uint8_t *content = arena + classes_bytes + constants_bytes + reserve_size;
+
+  // the sizing pass has checked every length, so this one reads blindly
+  r.cnt = 0;
+  hex_skip(&r, MAGIC_SIZE);
+  bytecode.class_size = hex_u1(&r);
+  for (int i=0; i<bytecode.class_size; i++) {
+    Class *c = &bytecode.classes[i];
+    c->index = i;
+    c->instance_val_size = hex_u1(&r);
+    c->constant_size = hex_u2(&r);
+    c->constants = constants;
+    constants = parse_hex_pool(&r, constants, c->constant_size, &content);
+  }
+  bytecode.constant_size = hex_u2(&r);
+  bytecode.constants = constants;
+  parse_hex_pool(&r, constants, bytecode.constant_size, &content);
+
+  bytecode.instruction_size = hex_u2(&r);
+  bytecode.instructions = content;
+  for (int i=0; i<bytecode.instruction_size; i++) {
+    bytecode.instructions[i] = hex_u1(&r);
+  }
+  return bytecode;
+}
+
+bool is_binary_program(uint8_t *data, uint32_t size)
+{
+  return size >= MAGIC_SIZE && memcmp(data, BINARY_MAGIC, MAGIC_SIZE-1) == 0;
+}
+
+// 32-bit FNV-1a over a binary program image, the key of the program cache.
+uint32_t program_hash(const uint8_t *data, uint32_t size)
+{
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void program_stream_init(ProgramStream *s, Bytecode *bytecode, uint8_t *data, uint32_t size)
+{
+  memset(s, 0, sizeof(ProgramStream));
+  memset(bytecode, 0, sizeof(Bytecode));
+  s->state = STREAM_MAGIC;
+  bytecode->image = data;
+  bytecode->image_size = size;
+  s->bytecode = bytecode;
+  s->data = data;
+  s->size = size;
+}
+
+static void free_binary(Bytecode*);
+
+static streamState stream_fail(ProgramStream *s)
+{
+  free_binary(s->bytecode);
+  s->state = STREAM_ERROR;
+  return s->state;
+}
+
+// Called when the next item is not complete yet. Once the whole program has
+// been received that means it is truncated.
+static streamState stream_wait(ProgramStream *s)
+{
+  if (s->received == s->size) return stream_fail(s);
+  return s->state;
+}
+
+static bool stream_available(ProgramStream *s, uint32_t n)
+{
+  return s->received - s->pos >= n;
+}
+
+static uint8_t *stream_take(ProgramStream *s, uint32_t n)
+{
+  uint8_t *p = s->data + s->pos;
+  s->pos += n;
+  return p;
+}
+
+static void stream_start_pool(ProgramStream *s, Constant **constants, uint16_t size)
+{
+  *constants = calloc(sizeof(Constant), size > 0 ? size : 1);
+  s->pool = *constants;
+  s->pool_size = size;
+  s->pool_index = 0;
+  if (s->pool == NULL) {
+    stream_fail(s);
+    return;
+  }
+  s->state = STREAM_CONSTANT;
+}
+
+static void stream_end_pool(ProgramStream *s)
+{
+  Bytecode *b = s->bytecode;
+  if (s->class_index < b->class_size) {
+    s->class_index++;
+    s->state = s->class_index < b->class_size ? STREAM_CLASS : STREAM_POOL_COUNT;
+    return;
+  }
+  s->state = STREAM_INSTRUCTION_COUNT;
+}
+
+// Parses as much of the program as the first `received` bytes of the buffer
+// allow. Each item is consumed only once it is complete, so the call can be
+// repeated after every chunk. Returns STREAM_DONE, STREAM_ERROR or the
+// state it is waiting in.
+streamState program_stream_parse(ProgramStream *s, uint32_t received)
+{
+  Bytecode *b = s->bytecode;
+  s->received = received < s->size ? received : s->size;
+  for (;;) {
+    switch (s->state) {
+      case STREAM_MAGIC: {
+        if (!stream_available(s, MAGIC_SIZE)) return stream_wait(s);
+        uint8_t *p = stream_take(s, MAGIC_SIZE);
+        if (memcmp(p, BINARY_MAGIC, MAGIC_SIZE-1) != 0) return stream_fail(s);
+        if (p[MAGIC_SIZE-1] == BINARY_VERSION_UNSIZED) {
+          b->resources = (Resources) {STACK_DEFAULT, FRAME_DEFAULT, GLOBAL_DEFAULT};
+          s->state = STREAM_CLASS_COUNT;
+        } else if (p[MAGIC_SIZE-1] == BINARY_VERSION) {
+          s->state = STREAM_RESOURCES;
+        } else {
+          return stream_fail(s);
         }
-        case CONST_FUNC: {
-          uint8_t *content = calloc(sizeof(uint8_t), INST_MAX);
-          for (int k=0; k<class_const_size; k++) {
-            up =  str[cnt++];
-            low = str[cnt++];
-            pos++;
-            content[k] = calc_byte(up, low);
-          }
-          class_constants[j].content = content;
+        break;
+      }
+      case STREAM_RESOURCES: {
+        if (!stream_available(s, RESOURCES_SIZE)) return stream_wait(s);
+        uint8_t *p = stream_take(s, RESOURCES_SIZE);
+        b->resources.stack = decode_constant(p[0], p[1]);
+        b->resources.frames = decode_constant(p[2], p[3]);
+        b->resources.globals = decode_constant(p[4], p[5]);
+        // the top level code needs a frame
+        if (b->resources.frames == 0 || b->resources.globals > GLOBAL_LIMIT) return stream_fail(s);
+        s->state = STREAM_CLASS_COUNT;
+        break;
+      }
+      case STREAM_CLASS_COUNT: {
+        if (!stream_available(s, 1)) return stream_wait(s);
+        uint8_t class_size = *stream_take(s, 1);
+        b->classes = calloc(sizeof(Class), class_size > 0 ? class_size : 1);
+        if (b->classes == NULL) return stream_fail(s);
+        b->class_size = class_size;
+        s->state = b->class_size > 0 ? STREAM_CLASS : STREAM_POOL_COUNT;
+        break;
+      }
+      case STREAM_CLASS: {
+        if (!stream_available(s, 3)) return stream_wait(s);
+        uint8_t *p = stream_take(s, 3);
+        Class *c = &b->classes[s->class_index];
+        c->index = s->class_index;
+        c->instance_val_size = p[0];
+        c->constant_size = decode_constant(p[1], p[2]);
+        stream_start_pool(s, &c->constants, c->constant_size);
+        break;
+      }
+      case STREAM_POOL_COUNT: {
+        if (!stream_available(s, 2)) return stream_wait(s);
+        uint8_t *p = stream_take(s, 2);
+        b->constant_size = decode_constant(p[0], p[1]);
+        stream_start_pool(s, &b->constants, b->constant_size);
+        break;
+      }
+      case STREAM_CONSTANT: {
+        if (s->pool_index == s->pool_size) {
+          stream_end_pool(s);
           break;
         }
+        if (!stream_available(s, 1)) return stream_wait(s);
+        uint8_t type = s->data[s->pos];
+        if (type != CONST_INT && type != CONST_FUNC) return stream_fail(s);
+        // type, method index (functions only), u2 size
+        uint32_t header = type == CONST_FUNC ? 4 : 3;
+        if (!stream_available(s, header)) return stream_wait(s);
+        uint16_t size = decode_constant(s->data[s->pos+header-2], s->data[s->pos+header-1]);
+        if (type == CONST_INT && size < 2) return stream_fail(s);
+        if (!stream_available(s, header + size)) return stream_wait(s);
+        uint8_t *p = stream_take(s, header + size);
+        Constant *c = &s->pool[s->pool_index++];
+        c->type = type;
+        c->method_index = type == CONST_FUNC ? p[1] : 0;
+        c->size = size;
+        c->content = p + header;
+        break;
       }
-      class_constants[j].type = class_const_type;
-      class_constants[j].size = class_const_size;
-      class_constants[j].method_index = class_func_id;
-    }
-    bytecode.classes[i].constant_size = class_constant_pool_size;
-    bytecode.classes[i].constants = class_constants;
-    bytecode.classes[i].index = i;
-    bytecode.classes[i].instance_val_size = instance_val_size;
-  }
-
-  // parse constant_pool_count
-  up =  str[cnt++];
-  low = str[cnt++];
-  uint8_t upper = calc_byte(up, low);
-  pos++;
-  up =  str[cnt++];
-  low = str[cnt++];
-  pos++;
-  uint8_t lower= calc_byte(up, low);
-  uint8_t constant_pool_size = decode_constant(upper, lower);
-
-  // parse content
-  for (int i=0; i<constant_pool_size; i++) {
-    up =  str[cnt++];
-    low = str[cnt++];
-    pos++;
-    uint8_t const_type = calc_byte(up, low);
-    if (const_type == CONST_FUNC) {
-      // skip function id
-      up =  str[cnt++];
-      low = str[cnt++];
-      pos++;
-    }
-    up =  str[cnt++];
-    low = str[cnt++];
-    pos++;
-    upper = calc_byte(up, low);
-    up =  str[cnt++];
-    low = str[cnt++];
-    pos++;
-    lower = calc_byte(up, low);
-    uint16_t const_size = decode_constant(upper, lower);
-    switch (const_type) {
-      case CONST_INT: {
-        uint8_t *content = calloc(sizeof(uint8_t), 2);
-        for (int j=0; j<const_size; j++) {
-          up =  str[cnt++];
-          low = str[cnt++];
-          pos++;
-          content[j] = calc_byte(up, low);
-        }
-        constants[i].content = content;
+      case STREAM_INSTRUCTION_COUNT: {
+        if (!stream_available(s, 2)) return stream_wait(s);
+        uint8_t *p = stream_take(s, 2);
+        b->instruction_size = decode_constant(p[0], p[1]);
+        s->state = STREAM_INSTRUCTIONS;
         break;
       }
-      case CONST_FUNC: {
-        uint8_t *content = calloc(sizeof(uint8_t), INST_MAX);
-        for (int j=0; j<const_size; j++) {
-          up =  str[cnt++];
-          low = str[cnt++];
-          pos++;
-          content[j] = calc_byte(up, low);
-        }
-        constants[i].content = content;
+      case STREAM_INSTRUCTIONS: {
+        if (!stream_available(s, b->instruction_size)) return stream_wait(s);
+        b->instructions = stream_take(s, b->instruction_size);
+        s->state = STREAM_DONE;
         break;
       }
+      case STREAM_DONE:
+      case STREAM_ERROR:
+        return s->state;
     }
-    constants[i].type = const_type;
-    constants[i].size = const_size;
-  }
-
-  // parse instructions
-  up =  str[cnt++];
-  low = str[cnt++];
-  pos++;
-  upper = calc_byte(up, low);
-  up =  str[cnt++];
-  low = str[cnt++];
-  pos++;
-  lower = calc_byte(up, low);
-  uint16_t inst_size = decode_constant(upper, lower);
-  // parse content
-  for (int i=0; i<inst_size; i++) {
-    uint8_t up =  str[cnt++];
-    uint8_t low = str[cnt++];
-    pos++;
-    insts[i] = calc_byte(up, low);
-  }
-
-  bytecode.instruction_size = inst_size;
-  bytecode.instructions = insts;
-  bytecode.constants = constants;
-  bytecode.constant_size = constant_pool_size;
-  bytecode.class_size = class_pool_size;
-  return bytecode;
+  }
+}
+
+// Parses a binary program in place. The layout is the one of the hex format
+// with every byte sent raw; instructions and constant contents keep pointing
+// into data, which must outlive the Bytecode.
+bool parse_binary(uint8_t *data, uint32_t size, Bytecode *bytecode)
+{
+  ProgramStream s;
+  program_stream_init(&s, bytecode, data, size);
+  return program_stream_parse(&s, size) == STREAM_DONE;
 }
 
-ExecResult tarto_vm_run(char* input)
+static void free_binary(Bytecode *bytecode)
+{
+  for (int i=0; i<bytecode->class_size; i++) {
+    free(bytecode->classes[i].constants);
+    bytecode->classes[i].constants = NULL;
+  }
+  free(bytecode->classes);
+  bytecode->classes = NULL;
+  bytecode->class_size = 0;
+  free(bytecode->constants);
+  bytecode->constants = NULL;
+}
+
+void free_bytecode(Bytecode *bytecode)
+{
+  unload_bytecode(bytecode);
+  if (bytecode->arena != NULL) {
+    free(bytecode->arena);
+    bytecode->arena = NULL;
+    return;
+  }
+  free_binary(bytecode);
+}
+
+ExecResult tarto_vm_run(VM *vm, char* input)
 {
   Bytecode bytecode = parse_bytecode(input);
+  if (bytecode.arena == NULL) {
+    return EXEC_RESULT(ERROR_INVALID_PROGRAM, NIL_VAL());
+  }
 
   // for debug
   // printf("** instruction**\n");
@@ -501,8 +1201,33 @@ ExecResult tarto_vm_run(char* input)
   //   printf("%d: %d\n", i, bytecode.instructions[i]);
   // }
 
-  ExecResult er = exec_interpret(bytecode);
-  free(bytecode.constants);
-  free(bytecode.instructions);
+  return tarto_vm_run_parsed(vm, &bytecode);
+}
+
+ExecResult tarto_vm_run_binary(VM *vm, uint8_t* data, uint32_t size)
+{
+  Bytecode bytecode;
+  // inflating here would hold the compressed and the whole image at once;
+  // compressed programs come in frames, which inflate them as they arrive
+  if (is_compressed_program(data, size)) {
+    vm->error = (VerifyError) {"compressed program outside a frame", 0, 0};
+    return EXEC_RESULT(ERROR_INVALID_PROGRAM, NIL_VAL());
+  }
+  if (!parse_binary(data, size, &bytecode)) {
+    return EXEC_RESULT(ERROR_INVALID_PROGRAM, NIL_VAL());
+  }
+  return tarto_vm_run_parsed(vm, &bytecode);
+}
+
+// Runs a parsed program and releases it afterwards.
+ExecResult tarto_vm_run_parsed(VM *vm, Bytecode* bytecode)
+{
+  if (!load_bytecode(bytecode)) {
+    vm->error = bytecode->error;
+    free_bytecode(bytecode);
+    return EXEC_RESULT(vm->error.reason != NULL ? ERROR_INVALID_PROGRAM : ERROR_OTHER, NIL_VAL());
+  }
+  ExecResult er = exec_interpret(vm, bytecode);
+  free_bytecode(bytecode);
   return er;
 }
@@ -1,28 +1,89 @@
+#ifndef VM_H
+#define VM_H
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-#define CLASS_MAX 10
-#define STACK_MAX 256
-#define INST_MAX 100
-#define CONST_MAX 100
-#define GLOBAL_MAX 256
-#define LOCAL_MAX 10
-#define FRAME_MAX 20
-#define INSTANCE_VAL_MAX 10
+// Stack slots, frames and globals of programs that do not declare them
+// (hex programs and version 1 images). A frame that passes an argument on
+// takes at least two stack slots, so such recursion runs out of stack
+// before it runs out of frames.
+#ifndef STACK_DEFAULT
+#define STACK_DEFAULT 256
+#endif
+#define FRAME_DEFAULT (STACK_DEFAULT / 2)
+// global operands are u1
+#define GLOBAL_LIMIT 256
+#define GLOBAL_DEFAULT GLOBAL_LIMIT
+// register IR instructions per function
 #define IR_MAX 300
-#define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value } })
-#define BOOL_VAL(value) ((Value){ VAL_BOOL, { .boolean = value } })
-#define NIL_VAL() ((Value){.type = VAL_NIL})
-#define FUNCTION_VAL(value) ((Value){VAL_FUNCTION, { .function = value}})
-#define INSTANCE_VAL(value) ((Value){VAL_INSTANCE, { .instance = value}})
-#define INSTANCE(value, index, size, variables) ((Instance){value, index, size, variables})
+// binary programs start with "TVM" and the format version instead of the
+// four bytes the hex format skips
+#define BINARY_MAGIC "TVM"
+#define BINARY_VERSION 2
+#define MAGIC_SIZE 4
+// version 2 follows the magic with what the program needs: u2 stack slots,
+// u2 frames and u2 globals; version 1 images get the defaults
+#define BINARY_VERSION_UNSIZED 1
+#define RESOURCES_SIZE 6
+// set in the version byte of a compressed image: the magic is followed by
+// the u4 (big endian) size of the whole image, then by the rest of it LZ
+// compressed (lz.c)
+#define BINARY_COMPRESSED 0x80
+#define COMPRESSED_HEADER_SIZE (MAGIC_SIZE + 4)
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (0x3F + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 0x80
+#define LZ_NEAR 0x80
+#define LZ_FAR 0xC0
+#define LZ_MAX_NEAR_OFFSET 0xFF
+#define LZ_MAX_OFFSET 0xFFFF
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+// first u4 (native order) of a VM snapshot (snapshot.c), followed by the
+// u4 size of the whole snapshot; storage writes it last, so a snapshot cut
+// short never looks valid
+#define SNAPSHOT_MAGIC 0x53564d54
+#ifndef HEAP_SIZE
+#define HEAP_SIZE 8192
+#endif
+// instances are allocated in size classes of 1, 2, 4, ... 256 values
+#define HEAP_SIZE_CLASSES 9
+#define GC_MARK_STACK 32
+// A Value is one tagged word. The low two bits are the tag; numbers keep
+// their u2 above it, functions and instances are aligned pointers, and
+// nil, false and true are small immediates with tag 0 (all zero is nil).
+#define TAG_MASK 3
+#define TAG_SPECIAL 0
+#define TAG_NUMBER 1
+#define TAG_FUNCTION 2
+#define TAG_INSTANCE 3
+#define VALUE_TAG(value) ((value) & TAG_MASK)
+#define NUMBER_VAL(value) (((Value)(uint16_t)(value) << 2) | TAG_NUMBER)
+#define BOOL_VAL(value) ((value) ? (Value)8 : (Value)4)
+#define NIL_VAL() ((Value)0)
+#define FUNCTION_VAL(value) ((Value)(uintptr_t)(value) | TAG_FUNCTION)
+#define INSTANCE_VAL(value) ((Value)(uintptr_t)(value) | TAG_INSTANCE)
+#define IS_NUMBER(value) (VALUE_TAG(value) == TAG_NUMBER)
+#define IS_NUMBERS(l, r) (((((l) ^ TAG_NUMBER) | ((r) ^ TAG_NUMBER)) & TAG_MASK) == 0)
+#define IS_BOOL(value) ((value) == BOOL_VAL(true) || (value) == BOOL_VAL(false))
+#define IS_NIL(value) ((value) == NIL_VAL())
+#define IS_FUNCTION(value) (VALUE_TAG(value) == TAG_FUNCTION)
+#define IS_INSTANCE(value) (VALUE_TAG(value) == TAG_INSTANCE)
+#define AS_NUMBER(value) ((uint16_t)((value) >> 2))
+#define AS_BOOL(value) ((value) == BOOL_VAL(true))
+#define AS_FUNCTION(value) ((struct Function*)((value) - TAG_FUNCTION))
+#define AS_INSTANCE(value) ((struct Instance*)((value) - TAG_INSTANCE))
+// The verifier cannot tell what a call finds on the stack, so calls check
+// it: a method runs only on an instance of its class, through
+// OP_CALL_METHOD, and OP_CALL only calls functions that are not methods.
+#define IS_METHOD_OF(f, receiver) (IS_FUNCTION(f) && IS_INSTANCE(receiver) && AS_FUNCTION(f)->owner == AS_INSTANCE(receiver)->class)
 #define EXEC_RESULT(type, value) ((ExecResult){type, value})
 
-struct Value;
 struct Instance;
+struct Function;
 typedef enum {
   OP_CONSTANT,
   OP_ADD,
@@ -48,15 +109,76 @@ typedef enum {
   OP_LOAD_INSTANCE_VAL,
   OP_STORE_INSTANCE_VAL,
   OP_RETURN,
+  // give up the rest of the time slice; sleep for the popped number of
+  // milliseconds; wait for the popped event number (Scheduler)
+  OP_YIELD,
+  OP_SLEEP,
+  OP_WAIT,
+  // call builtin (second operand byte) with the number of arguments in the
+  // first; the batch form calls it once per group of its own arity
+  OP_CALL_NATIVE,
+  OP_CALL_NATIVE_BATCH,
+  // internal opcodes, produced by the loader only
+  OP_END,
+  // superinstructions fused by the loader, picked from the opcode pair
+  // histogram of the host corpus (make bench PAIRS=1)
+  OP_ADD_CONSTANT,
+  OP_SUB_CONSTANT,
+  OP_LESS_CONSTANT,
+  OP_LESS_JNT,
+  OP_GREATER_JNT,
+  OP_EQ_JNT,
+  OP_NEQ_JNT,
+  OP_LESS_CONSTANT_JNT,
+  // OP_CALL right before an OP_RETURN_VAL, which it skips when it can reuse
+  // the caller's frame for the callee
+  OP_TAIL_CALL,
+  // quickened forms of the arithmetic and comparisons above, written by
+  // the interpreter once their operands were seen to be numbers
+  OP_ADD_NUM,
+  OP_SUB_NUM,
+  OP_MUL_NUM,
+  OP_DIV_NUM,
+  OP_EQ_NUM,
+  OP_NEQ_NUM,
+  OP_LESS_NUM,
+  OP_GREATER_NUM,
+  OP_ADD_CONSTANT_NUM,
+  OP_SUB_CONSTANT_NUM,
+  OP_LESS_CONSTANT_NUM,
+  OP_LESS_JNT_NUM,
+  OP_GREATER_JNT_NUM,
+  OP_EQ_JNT_NUM,
+  OP_NEQ_JNT_NUM,
+  OP_LESS_CONSTANT_JNT_NUM,
+  OP_COUNT,
 } opcode;
 
+typedef uintptr_t Value;
+
 typedef enum {
-  VAL_BOOL,
-  VAL_NIL,
-  VAL_NUMBER,
-  VAL_FUNCTION,
-  VAL_INSTANCE,
-} valueType;
+  SUCCESS,
+  ERROR_DIVISION_BY_ZERO,
+  ERROR_UNKNOWN_OPCODE,
+  ERROR_NO_METHOD,
+  ERROR_OTHER,
+  ERROR_INVALID_PROGRAM,
+  ERROR_OUT_OF_MEMORY,
+  // a run cached program request for a hash the cache does not hold
+  ERROR_NOT_CACHED,
+  // too many frames, or no room for the operand stack of a callee
+  ERROR_STACK_OVERFLOW,
+  // arithmetic or ordering on values that are not numbers
+  ERROR_TYPE,
+  // no such builtin, or the wrong number of arguments for it
+  ERROR_NO_BUILTIN,
+  // internal: the program ran into OP_END, exec_interpret reports SUCCESS
+  STOPPED,
+  // internal: the time slice is used up, or the program yields, sleeps or
+  // waits (VM.block_op); it continues with vm_resume
+  PREEMPTED,
+  BLOCKED,
+} resultType;
 
 typedef enum {
   CONST_INT,
@@ -68,6 +190,7 @@ typedef struct {
   uint16_t size;
   uint8_t *content;
   uint8_t method_index;
+  struct Function *function;
 } Constant;
 
 typedef struct {
@@ -75,65 +198,510 @@ typedef struct {
   uint16_t constant_size;
   Constant *constants;
   uint8_t instance_val_size;
+  // indexed by method_index, built by load_bytecode
+  struct Function **methods;
+  uint16_t method_size;
 } Class;
 
+// header of every object in the VM heap
+typedef struct Object {
+  struct Object *next;
+  uint8_t size_class;
+  bool marked;
+  bool free;
+} Object;
+
 typedef struct Instance {
+  Object obj;
   Class *class;
   uint8_t index;
   uint8_t val_size;
-  struct Value *variables;
+  Value variables[];
 } Instance;
 
-typedef struct Value {
-  valueType type;
+// Pre-decoded instruction, built by the loader from the wire bytecode.
+// u1 operands live in arg, OP_CONSTANT carries its materialized value and
+// OP_JMP/OP_JNT point straight at their target instruction.
+// OP_LOAD_METHOD caches the last receiver class (index + 1, 0 when empty)
+// in imm and the method it resolved to in as.function. Fused compares
+// against a constant keep the number in imm. OP_CALL_NATIVE keeps the
+// argument count in arg and the builtin in imm.
+typedef struct Inst {
+  uint8_t op;
+  uint8_t arg;
+  uint16_t imm;
+  union {
+    Value value;
+    struct Inst *target;
+    struct Function *function;
+    // byte offset of a jump target, until the loader resolves it
+    uint16_t offset;
+  } as;
+} Inst;
+
+// Register IR, the second tier, translated from the verified stack code
+// (ir.c). Operands name registers of the frame's window on vm->stack:
+// locals first, then one per operand stack slot. The _K forms take their
+// last operand from the function's constants instead. IR_LOAD_METHOD
+// caches the method it resolved in as.function.
+#define IR_REGS_MAX 256
+typedef enum {
+  IR_MOVE,
+  IR_LOAD_K,
+  IR_LOAD_GLOBAL,
+  IR_STORE_GLOBAL,
+  // global a = global a + (or -) register c, or constant c for _K
+  IR_ADD_GLOBAL,
+  IR_SUB_GLOBAL,
+  IR_ADD_GLOBAL_K,
+  IR_SUB_GLOBAL_K,
+  IR_ADD,
+  IR_SUB,
+  IR_MUL,
+  IR_DIV,
+  IR_EQ,
+  IR_NEQ,
+  IR_LESS,
+  IR_GREATER,
+  IR_ADD_K,
+  IR_SUB_K,
+  IR_MUL_K,
+  IR_DIV_K,
+  IR_EQ_K,
+  IR_NEQ_K,
+  IR_LESS_K,
+  IR_GREATER_K,
+  IR_JMP,
+  IR_JNT,
+  // compare and jump when false
+  IR_LESS_JNT,
+  IR_GREATER_JNT,
+  IR_EQ_JNT,
+  IR_NEQ_JNT,
+  IR_LESS_JNT_K,
+  IR_GREATER_JNT_K,
+  IR_EQ_JNT_K,
+  IR_NEQ_JNT_K,
+  IR_CALL,
+  IR_CALL_METHOD,
+  // IR_CALL whose result is returned right away
+  IR_TAIL_CALL,
+  IR_LOAD_METHOD,
+  IR_INSTANCE,
+  IR_LOAD_INSTANCE_VAL,
+  IR_STORE_INSTANCE_VAL,
+  // OP_YIELD, OP_SLEEP or OP_WAIT in b, the operand in register a
+  IR_BLOCK,
+  // builtin c on the b registers from a, result into a
+  IR_CALL_NATIVE,
+  IR_CALL_NATIVE_BATCH,
+  IR_RETURN,
+  IR_RETURN_NIL,
+  IR_END,
+  IR_COUNT,
+} irOpcode;
+
+typedef struct IRInst {
+  uint8_t op;
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
   union {
-    bool boolean;
-    uint16_t number;
-    Constant function;
-    Instance instance;
+    struct IRInst *target;
+    struct Function *function;
+    // byte offset of a jump target, until the translation resolves it
+    uint16_t offset;
   } as;
-} Value;
+} IRInst;
+
+struct VM;
+struct Bytecode;
+// A C function scripts call with OP_CALL_NATIVE. It gets its arguments
+// where they are on the value stack and returns SUCCESS or an error; result
+// starts out nil.
+typedef resultType (*BuiltinFunction)(struct VM*, Value *args, uint8_t arg_num, Value *result);
+#define BUILTIN_VARIADIC 0xFF
 
 typedef struct {
-  uint16_t instruction_size;
-  uint8_t *instructions;
-  int ip;
-  Value local[LOCAL_MAX];
+  const char *name;
+  BuiltinFunction function;
+  // BUILTIN_VARIADIC takes any number, but cannot be batched
+  uint8_t arg_num;
+} Builtin;
+
+// Scripts name builtins by their index, so entries are only ever appended.
+typedef struct {
+  const Builtin *entries;
+  uint8_t size;
+} BuiltinTable;
+
+// A function compiled ahead of time by tarto_aot. It runs on the frame its
+// caller pushed, pops it like OP_RETURN does and returns SUCCESS, or an
+// error, or STOPPED when it runs off its end.
+typedef resultType (*NativeFunction)(struct VM*, struct Bytecode*);
+
+typedef struct Function {
+  Inst *code;
+  uint16_t size;
+  uint8_t method_index;
+  // class whose pool holds the function, NULL unless it is a method
+  Class *owner;
+  // arguments and locals, and the deepest the operand stack gets above
+  // them, from the verifier
+  uint16_t locals;
+  uint16_t max_stack;
+  // NULL unless the function was compiled ahead of time
+  NativeFunction native;
+  // register IR and its constants, NULL when the program runs on the
+  // stack interpreter; ir_regs is the size of its register window
+  IRInst *ir;
+  Value *ir_constants;
+  uint16_t ir_regs;
+} Function;
+
+// Arguments and then the rest of the locals live on vm->stack from bp,
+// with the function at bp[-1] and the receiver of a method below it, so a
+// frame only keeps where to continue.
+typedef struct {
+  Inst *ip;
   uint8_t arg_num;
   Value *bp;
-  Constant *constants;
   bool f_method;
+  Function *function;
+  // where the register IR continues, bp is the register window
+  IRInst *ir_ip;
+#ifdef TARTO_VM_PROFILE
+  // call site and cycle count when the frame was entered
+  int8_t site;
+  uint32_t enter;
+#endif
 } Frame;
 
+// Why load_bytecode rejected a program: the instruction at byte offset
+// of functions[function] (0 is the top level code).
+typedef struct {
+  const char *reason;
+  uint16_t function;
+  uint16_t offset;
+} VerifyError;
+
+// What a program asks the VM to allocate for it.
 typedef struct {
+  uint16_t stack;
+  uint16_t frames;
+  uint16_t globals;
+} Resources;
+
+typedef struct Bytecode {
+  Resources resources;
   uint8_t class_size;
-  Class classes[CLASS_MAX];
+  Class *classes;
   Constant *constants;
   uint16_t constant_size;
   uint8_t *instructions;
   uint16_t instruction_size;
+  // parse_bytecode lays the whole program out in arena and leaves reserve
+  // at its end for load_bytecode; binary programs have no arena
+  void *arena;
+  uint8_t *reserve;
+  size_t reserve_size;
+  // filled by load_bytecode, functions[0] is the top level code
+  Function *functions;
+  uint16_t function_size;
+  void *code_arena;
+  // the binary image the program was parsed from, NULL for hex programs;
+  // snapshots carry it along
+  const uint8_t *image;
+  uint32_t image_size;
+  // reason is NULL unless the verifier rejected the program
+  VerifyError error;
 } Bytecode;
 
-struct {
-  Value stack[STACK_MAX];
-  Value global[GLOBAL_MAX];
+typedef struct {
+  uint32_t live_bytes;
+  uint32_t collections;
+  uint32_t last_pause_us;
+  uint32_t max_pause_us;
+  uint32_t total_pause_us;
+} HeapStats;
+
+// Non-moving object heap: free lists per size class, bump allocation from
+// memory when they are empty, mark-sweep when memory runs out.
+typedef struct {
+  uint8_t *top;
+  Object *free[HEAP_SIZE_CLASSES];
+  HeapStats stats;
+  uint64_t memory[HEAP_SIZE / sizeof(uint64_t)];
+} ObjectHeap;
+
+#ifdef TARTO_VM_PROFILE
+#define PROFILE_FUNCTION_MAX 32
+#define PROFILE_SITE_MAX 16
+
+typedef struct {
+  uint32_t count;
+  uint64_t cycles;
+} ProfileCounter;
+
+typedef struct {
+  Inst *site;
+  int16_t function;
+  uint16_t index;
+  ProfileCounter counter;
+} ProfileSite;
+
+// Opt-in profile of one run (TARTO_VM_PROFILE). Every dispatch charges the
+// cycles since the previous one to the previous opcode and to the function
+// it ran in; call sites get calls and cycles including their callees.
+typedef struct {
+  Bytecode *bytecode;
+  uint32_t last;
+  uint8_t last_op;
+  Function *last_function;
+  ProfileCounter ops[OP_COUNT];
+  ProfileCounter functions[PROFILE_FUNCTION_MAX];
+  ProfileSite sites[PROFILE_SITE_MAX];
+  uint8_t site_size;
+  uint32_t dropped_sites;
+} Profile;
+#endif
+
+// All interpreter state. Every entry point takes the VM it runs on, so
+// independent VMs can run on separate tasks or threads. Inline caches
+// patch the loaded program, so concurrent VMs each load their own copy.
+typedef struct VM {
+  // stack, frames and globals of the running coroutine, the VM's own when
+  // there is no scheduler
+  Value *stack;
   Value *stack_top;
-  Frame frames[FRAME_MAX];
-  uint8_t frame_index;
-} vm;
+  Value *stack_end;
+  Frame *frames;
+  uint16_t frame_index;
+  uint16_t frame_max;
+  Value *global;
+  uint16_t global_size;
+  // taken jumps and calls left in the time slice
+  uint32_t budget;
+  // what the last BLOCKED was for, with its operand
+  uint8_t block_op;
+  Value block_arg;
+  struct Scheduler *scheduler;
+  // keep number and bool globals of the previous run (service mode)
+  bool retain_globals;
+  // run on the stack interpreter even when the program has register IR
+  bool stack_tier;
+  // what OP_CALL_NATIVE calls, NULL for none
+  const BuiltinTable *builtins;
+  // called each time a program run by exec_interpret or exec_resume
+  // blocks, the point at which it can be snapshotted; NULL for none
+  void (*checkpoint)(struct VM*, struct Bytecode*);
+  // details of the last ERROR_INVALID_PROGRAM from the verifier
+  VerifyError error;
+  ObjectHeap heap;
+#ifdef TARTO_VM_STATS
+  uint32_t dispatch_count;
+#endif
+#ifdef TARTO_VM_PROFILE
+  Profile profile;
+#endif
+#ifdef TARTO_VM_PAIRS
+  // how often each opcode was dispatched right after another one
+  uint8_t last_op;
+  uint32_t pair_count[OP_COUNT][OP_COUNT];
+#endif
+  // the VM's own stack, frames and globals, sized by vm_reserve for the
+  // program it runs
+  Resources capacity;
+  Value *stack_memory;
+  Frame *frame_memory;
+  Value *global_memory;
+} VM;
 
 typedef enum {
-  SUCCESS,
-  ERROR_DIVISION_BY_ZERO,
-  ERROR_UNKNOWN_OPCODE,
-  ERROR_NO_METHOD,
-  ERROR_OTHER,
-} resultType;
+  STREAM_MAGIC,
+  STREAM_RESOURCES,
+  STREAM_CLASS_COUNT,
+  STREAM_CLASS,
+  STREAM_POOL_COUNT,
+  STREAM_CONSTANT,
+  STREAM_INSTRUCTION_COUNT,
+  STREAM_INSTRUCTIONS,
+  STREAM_DONE,
+  STREAM_ERROR,
+} streamState;
+
+// Resumable parser for binary programs that arrive in chunks. data is the
+// final buffer of the whole program; the parser reads what has been
+// received so far and leaves everything it parsed pointing into it.
+typedef struct {
+  streamState state;
+  Bytecode *bytecode;
+  uint8_t *data;
+  uint32_t size;
+  uint32_t received;
+  uint32_t pos;
+  uint8_t class_index;
+  Constant *pool;
+  uint16_t pool_size;
+  uint16_t pool_index;
+} ProgramStream;
+
+typedef enum {
+  LZ_CONTROL,
+  LZ_LITERALS,
+  LZ_OFFSET_HIGH,
+  LZ_OFFSET_LOW,
+} lzState;
+
+// Resumable decoder of the LZ payload. Matches refer back into the output,
+// so the only window it needs is the image being inflated.
+typedef struct {
+  lzState state;
+  uint8_t count;
+  uint16_t offset;
+} LzStream;
+
 
 typedef struct {
   resultType type;
   Value return_value;
 } ExecResult;
 
+typedef enum {
+  COROUTINE_READY,
+  COROUTINE_SLEEPING,
+  COROUTINE_WAITING,
+  COROUTINE_DONE,
+} coroutineState;
+
+// A program run by a Scheduler, with a stack, frames and globals of its
+// own, sized as the program asks. The heap is the VM's, shared by all
+// coroutines.
+typedef struct {
+  Value *stack;
+  Frame *frames;
+  Value *global;
+  Resources resources;
+  Value *stack_top;
+  uint16_t frame_index;
+  Bytecode *bytecode;
+  coroutineState state;
+  // the ready coroutine with the highest priority runs next
+  uint8_t priority;
+  // COROUTINE_SLEEPING until the clock reads wake_at, COROUTINE_WAITING
+  // for scheduler_signal(event)
+  uint32_t wake_at;
+  uint16_t event;
+  // COROUTINE_DONE: what exec_interpret would have returned, and when
+  ExecResult result;
+  uint32_t done_at;
+  uint32_t slices;
+} Coroutine;
+
+// Milliseconds for sleeping coroutines. idle is called when nothing is
+// ready before until.
+typedef struct {
+  uint32_t (*now)(void *ctx);
+  void (*idle)(void *ctx, uint32_t until);
+  void *ctx;
+} SchedulerClock;
+
+// Runs coroutines on one VM in time slices of quantum taken jumps and
+// calls, or until they yield, sleep or wait.
+typedef struct Scheduler {
+  VM *vm;
+  Coroutine *coroutines;
+  uint8_t capacity;
+  uint8_t size;
+  uint32_t quantum;
+  SchedulerClock clock;
+  // equal priorities take turns, starting after the one that ran last
+  uint8_t last;
+} Scheduler;
+
+// A program compiled by tarto_aot: the binary image it was compiled from,
+// which still provides constants, classes and method tables, and one
+// native per entry of Bytecode.functions (NULL ones are interpreted).
+typedef struct {
+  const char *name;
+  const uint8_t *image;
+  uint32_t image_size;
+  const NativeFunction *natives;
+  uint16_t native_size;
+} AotProgram;
+
+uint16_t decode_constant(uint8_t, uint8_t);
+Bytecode parse_bytecode(char*);
+bool is_binary_program(uint8_t*, uint32_t);
+bool is_compressed_program(const uint8_t*, uint32_t);
+uint32_t compressed_program_size(const uint8_t*);
+void lz_init(LzStream*);
+bool lz_inflate(LzStream*, const uint8_t*, uint32_t, uint8_t*, uint32_t, uint32_t*);
+uint8_t *inflate_program(const uint8_t*, uint32_t, uint32_t*);
+uint32_t program_hash(const uint8_t*, uint32_t);
+bool parse_binary(uint8_t*, uint32_t, Bytecode*);
+void free_bytecode(Bytecode*);
+void program_stream_init(ProgramStream*, Bytecode*, uint8_t*, uint32_t);
+streamState program_stream_parse(ProgramStream*, uint32_t);
+uint8_t operand_size(uint8_t);
+uint32_t count_insts(uint8_t*, uint16_t);
+size_t code_arena_size(uint16_t, uint32_t, uint32_t);
+bool verify_bytecode(Bytecode*, uint16_t*);
+bool load_bytecode(Bytecode*);
+void unload_bytecode(Bytecode*);
+Value constant_value(Constant*, uint16_t, uint16_t);
+bool ir_translate(Bytecode*);
+void ir_unload(Bytecode*);
+resultType ir_interpret(VM*, Bytecode*);
+bool ir_tier(VM*, Bytecode*);
+resultType binary_op(uint8_t, Value, Value, Value*);
+resultType call_builtin(VM*, uint8_t, Value*, uint8_t, bool, Value*);
+resultType builtin_min(VM*, Value*, uint8_t, Value*);
+resultType builtin_max(VM*, Value*, uint8_t, Value*);
+resultType builtin_clamp(VM*, Value*, uint8_t, Value*);
+resultType builtin_ema(VM*, Value*, uint8_t, Value*);
+resultType builtin_crc16(VM*, Value*, uint8_t, Value*);
+bool vm_reserve(VM*, Resources);
+void vm_release(VM*);
+void vm_init(VM*, Bytecode*);
+void vm_start(VM*, Bytecode*);
+resultType vm_resume(VM*, Bytecode*);
+ExecResult vm_result(VM*, Bytecode*, resultType);
+ExecResult exec_interpret(VM*, Bytecode*);
+ExecResult exec_resume(VM*, Bytecode*);
+uint32_t snapshot_size(VM*, Bytecode*);
+bool snapshot_save(VM*, Bytecode*, uint8_t*);
+resultType snapshot_restore(VM*, Bytecode*, const uint8_t*, uint32_t);
+resultType interpret(VM*, Bytecode*, uint16_t);
+Frame *current_frame(VM*);
+Frame *push_frame(VM*, Function*, uint8_t, bool);
+bool aot_bind(Bytecode*, const AotProgram*);
+resultType aot_call(VM*, Bytecode*, uint8_t, bool);
+void aot_return(VM*, Value);
+Function *aot_method(Value, uint8_t);
+const char *opcode_name(uint8_t);
+void scheduler_init(Scheduler*, VM*, Coroutine*, uint8_t, uint32_t);
+Coroutine *scheduler_spawn(Scheduler*, Bytecode*, uint8_t);
+void scheduler_signal(Scheduler*, uint16_t);
+uint8_t scheduler_run(Scheduler*);
+void scheduler_release(Scheduler*);
+void heap_init(VM*);
+size_t heap_object_bytes(uint8_t);
+Instance *heap_alloc_instance(VM*, Class*, uint8_t);
+void heap_collect(VM*);
+HeapStats heap_stats(VM*);
+#ifdef TARTO_VM_PROFILE
+uint32_t profile_cycles();
+void profile_reset(VM*, Bytecode*);
+void profile_dispatch(VM*, Frame*, uint8_t);
+void profile_call(VM*, Frame*, Inst*);
+void profile_return(VM*, Frame*);
+void profile_finish(VM*);
+void profile_report(VM*);
+#endif
+ExecResult tarto_vm_run(VM*, char*);
+ExecResult tarto_vm_run_binary(VM*, uint8_t*, uint32_t);
+ExecResult tarto_vm_run_parsed(VM*, Bytecode*);
+ExecResult tarto_vm_run_aot(VM*, const AotProgram*);
 
-ExecResult tarto_vm_run(char*);
+#endif
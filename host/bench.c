@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "vm.h"
+#include "builtins.h"
+#include "bench.h"
+#include "program_file.h"
+
+#define RESULT_MAX 64
+#define CALIBRATE_NS 50000000.0
+
+// -B: load the corpus through the binary format instead of hex
+static bool binary_mode;
+// -A: run the natives tarto_aot compiled the corpus to
+static bool aot_mode;
+// -Z: also compress every image and time inflating it
+static bool compress_mode;
+static VM vm;
+
+typedef struct {
+  char *hex;
+  uint8_t *image;
+  uint32_t image_size;
+  // -A: the program compiled by tarto_aot
+  const AotProgram *aot;
+} Source;
+
+#ifdef TARTO_VM_AOT
+extern const AotProgram *const aot_programs[];
+
+static const AotProgram *find_aot(const char *name)
+{
+  for (int i = 0; aot_programs[i] != NULL; i++) {
+    if (strcmp(aot_programs[i]->name, name) == 0) return aot_programs[i];
+  }
+  return NULL;
+}
+#endif
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void program_name(const char *path, char *name, size_t size)
+{
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  snprintf(name, size, "%s", base);
+  char *ext = strrchr(name, '.');
+  if (ext != NULL) *ext = '\0';
+}
+
+static bool open_program(Source *src, Bytecode *b)
+{
+  if (src->aot != NULL) {
+    if (!parse_binary((uint8_t*) src->aot->image, src->aot->image_size, b)) return false;
+  } else if (binary_mode) {
+    if (!parse_binary(src->image, src->image_size, b)) return false;
+  } else {
+    *b = parse_bytecode(src->hex);
+    if (b->arena == NULL) return false;
+  }
+  if (load_bytecode(b)) {
+    if (src->aot == NULL || aot_bind(b, src->aot)) return true;
+  }
+  if (b->error.reason != NULL) {
+    fprintf(stderr, "verify: %s (function %d, offset %d)\n", b->error.reason, b->error.function, b->error.offset);
+  }
+  free_bytecode(b);
+  return false;
+}
+
+static void close_program(Bytecode *b)
+{
+  free_bytecode(b);
+}
+
+static void free_source(Source *src)
+{
+  free(src->hex);
+  free(src->image);
+}
+
+#ifdef TARTO_VM_PAIRS
+#define PAIR_TOP 16
+
+// opcode pairs of the first run of every program, summed over the corpus
+static uint64_t pair_total[OP_COUNT][OP_COUNT];
+
+static void add_pairs()
+{
+  for (int i = 0; i < OP_COUNT; i++) {
+    for (int j = 0; j < OP_COUNT; j++) {
+      pair_total[i][j] += vm.pair_count[i][j];
+    }
+  }
+}
+
+static void print_pairs()
+{
+  uint64_t all = 0;
+  for (int i = 0; i < OP_COUNT; i++) {
+    for (int j = 0; j < OP_COUNT; j++) {
+      all += pair_total[i][j];
+    }
+  }
+  printf("\n%-40s %12s %7s\n", "opcode pair", "count", "share");
+  for (int k = 0; k < PAIR_TOP; k++) {
+    int best_i = 0, best_j = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+      for (int j = 0; j < OP_COUNT; j++) {
+        if (pair_total[i][j] > pair_total[best_i][best_j]) {
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+    if (pair_total[best_i][best_j] == 0) break;
+    char pair[64];
+    snprintf(pair, sizeof(pair), "%s %s", opcode_name(best_i), opcode_name(best_j));
+    printf("%-40s %12llu %6.1f%%\n", pair, (unsigned long long)pair_total[best_i][best_j],
+           100.0 * pair_total[best_i][best_j] / all);
+    pair_total[best_i][best_j] = 0;
+  }
+}
+#endif
+
+static long result_value(ExecResult er)
+{
+  if (er.type != SUCCESS) return -(long)er.type - 1000;
+  if (!IS_NUMBER(er.return_value)) return -1;
+  return AS_NUMBER(er.return_value);
+}
+
+typedef struct {
+  VM *vm;
+  Bytecode bytecode;
+  int reps;
+} Worker;
+
+static void *worker_main(void *arg)
+{
+  Worker *w = arg;
+  for (int i = 0; i < w->reps; i++) {
+    exec_interpret(w->vm, &w->bytecode);
+  }
+  return NULL;
+}
+
+// Wall time of threads independent VMs running reps runs each, every one
+// with its own context and its own copy of the program. -1 on failure.
+static double run_parallel(Source *src, int threads, int reps)
+{
+  Worker *workers = calloc(threads, sizeof(Worker));
+  pthread_t *ids = calloc(threads, sizeof(pthread_t));
+  int opened = 0;
+  double wall = -1;
+  if (workers == NULL || ids == NULL) goto out;
+  for (; opened < threads; opened++) {
+    Worker *w = &workers[opened];
+    w->vm = calloc(1, sizeof(VM));
+    w->reps = reps;
+    if (w->vm == NULL || !open_program(src, &w->bytecode)) {
+      free(w->vm);
+      goto out;
+    }
+    w->vm->builtins = &device_builtins;
+  }
+  double start = now_ns();
+  int started = 0;
+  for (; started < threads; started++) {
+    if (pthread_create(&ids[started], NULL, worker_main, &workers[started]) != 0) break;
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  if (started == threads) wall = now_ns() - start;
+out:
+  for (int i = 0; i < opened; i++) {
+    close_program(&workers[i].bytecode);
+    vm_release(workers[i].vm);
+    free(workers[i].vm);
+  }
+  free(workers);
+  free(ids);
+  return wall;
+}
+
+// Best time of one run over rounds, each of enough runs to take about
+// CALIBRATE_NS; reps is how many that was.
+static double time_runs(Bytecode *b, int rounds, int *reps)
+{
+  double start = now_ns();
+  exec_interpret(&vm, b);
+  double once = now_ns() - start;
+  *reps = once > 0 ? (int)(CALIBRATE_NS / once) : 1;
+  if (*reps < 1) *reps = 1;
+
+  double best = 0;
+  for (int i = 0; i < rounds; i++) {
+    start = now_ns();
+    for (int j = 0; j < *reps; j++) {
+      exec_interpret(&vm, b);
+    }
+    double t = (now_ns() - start) / *reps;
+    if (i == 0 || t < best) best = t;
+  }
+  return best;
+}
+
+// Dispatches and time per run on the stack interpreter (stack_tier) or the
+// register IR. Both have to produce the expected result.
+static int run_tier(Bytecode *b, bool stack_tier, long expect, int rounds, const char *name, uint32_t *dispatches, double *us)
+{
+  vm.stack_tier = stack_tier;
+  ExecResult er = exec_interpret(&vm, b);
+  *dispatches = vm.dispatch_count;
+  long result = result_value(er);
+  if (expect >= 0 && result != expect) {
+    fprintf(stderr, "%s: expected %ld, got %ld on the %s tier\n", name, expect, result, stack_tier ? "stack" : "register");
+    vm.stack_tier = false;
+    return -1;
+  }
+  int reps;
+  *us = time_runs(b, rounds, &reps) / 1e3;
+  vm.stack_tier = false;
+  return 0;
+}
+
+static int run_program(const char *path, int rounds, int parse_reps, int threads, BenchResult *r)
+{
+  long expect;
+  Resources declared;
+  Source src = {0};
+  src.hex = read_tvm_file(path, &expect, &declared);
+  if (src.hex == NULL) return -1;
+  src.image = tvm_to_binary(src.hex, &declared, &src.image_size);
+  program_name(path, r->name, sizeof(r->name));
+
+  // natives dispatch nothing: count what the interpreter would have
+  // dispatched, so ns/op and time per run stay comparable
+  uint32_t interpreted_dispatches = 0;
+  if (aot_mode) {
+    Bytecode b;
+    if (open_program(&src, &b)) {
+      exec_interpret(&vm, &b);
+      interpreted_dispatches = vm.dispatch_count;
+      close_program(&b);
+    }
+#ifdef TARTO_VM_AOT
+    src.aot = find_aot(r->name);
+#endif
+    if (src.aot == NULL) {
+      fprintf(stderr, "%s: not compiled ahead of time\n", r->name);
+      free_source(&src);
+      return -1;
+    }
+  }
+
+  // first run: correctness, dispatch count and peak heap of one load + run,
+  // which includes the stack, frames and globals the VM allocates for it
+  vm_release(&vm);
+  size_t heap_base = heap_current_bytes();
+  heap_reset_peak();
+  unsigned long allocs = heap_alloc_count();
+  Bytecode b;
+  if (!open_program(&src, &b)) {
+    fprintf(stderr, "%s: load failed\n", r->name);
+    free_source(&src);
+    return -1;
+  }
+  r->load_allocs = heap_alloc_count() - allocs;
+  ExecResult er = exec_interpret(&vm, &b);
+  r->peak_heap = heap_peak_bytes() - heap_base;
+  r->dispatches = aot_mode ? interpreted_dispatches : vm.dispatch_count;
+#ifdef TARTO_VM_PAIRS
+  add_pairs();
+#endif
+  HeapStats gc = heap_stats(&vm);
+  r->gc_collections = gc.collections;
+  r->gc_max_pause_us = gc.max_pause_us;
+  r->result = result_value(er);
+  if (expect >= 0 && r->result != expect) {
+    fprintf(stderr, "%s: expected %ld, got %ld\n", r->name, expect, r->result);
+    close_program(&b);
+    free_source(&src);
+    return -1;
+  }
+
+  double best_parse = 0;
+  for (int i = 0; i < parse_reps; i++) {
+    double start = now_ns();
+    Bytecode parsed;
+    open_program(&src, &parsed);
+    double t = now_ns() - start;
+    close_program(&parsed);
+    if (i == 0 || t < best_parse) best_parse = t;
+  }
+  r->parse_us = best_parse / 1e3;
+
+  r->compressed_size = 0;
+  if (compress_mode) {
+    uint8_t *compressed = compress_binary(src.image, src.image_size, &r->compressed_size);
+    if (compressed == NULL) {
+      fprintf(stderr, "%s: out of memory compressing the image\n", r->name);
+      close_program(&b);
+      free_source(&src);
+      return -1;
+    }
+    double best_inflate = 0;
+    for (int i = 0; i < parse_reps; i++) {
+      double start = now_ns();
+      uint32_t size;
+      uint8_t *image = inflate_program(compressed, r->compressed_size, &size);
+      double t = now_ns() - start;
+      bool same = image != NULL && size == src.image_size && memcmp(image, src.image, size) == 0;
+      free(image);
+      if (!same) {
+        fprintf(stderr, "%s: compressed image does not inflate back\n", r->name);
+        free(compressed);
+        close_program(&b);
+        free_source(&src);
+        return -1;
+      }
+      if (i == 0 || t < best_inflate) best_inflate = t;
+    }
+    free(compressed);
+    r->image_size = src.image_size;
+    r->inflate_us = best_inflate / 1e3;
+  }
+
+  int reps;
+  double best = time_runs(&b, rounds, &reps);
+  r->ns_per_op = r->dispatches ? best / r->dispatches : 0;
+  r->insts_per_sec = best > 0 ? r->dispatches / (best / 1e9) : 0;
+  r->speedup = 0;
+  if (threads > 1) {
+    double wall = run_parallel(&src, threads, reps);
+    if (wall > 0) r->speedup = threads * best * reps / wall;
+  }
+  r->ir_dispatches = 0;
+  if (!aot_mode && ir_tier(&vm, &b)) {
+    if (run_tier(&b, true, expect, rounds, r->name, &r->stack_dispatches, &r->stack_us) != 0 ||
+        run_tier(&b, false, expect, rounds, r->name, &r->ir_dispatches, &r->ir_us) != 0) {
+      close_program(&b);
+      free_source(&src);
+      return -1;
+    }
+  }
+  close_program(&b);
+  free_source(&src);
+  return 0;
+}
+
+static void write_results(FILE *fp, BenchResult *results, int n)
+{
+  fprintf(fp, "# program\tdispatches\tns_per_op\tinsts_per_sec\tparse_us\tpeak_heap\tresult\tload_allocs\tgc_collections\tgc_max_pause_us\n");
+  for (int i = 0; i < n; i++) {
+    BenchResult *r = &results[i];
+    fprintf(fp, "%s\t%u\t%.3f\t%.0f\t%.3f\t%zu\t%ld\t%lu\t%u\t%u\n",
+            r->name, r->dispatches, r->ns_per_op, r->insts_per_sec, r->parse_us, r->peak_heap, r->result, r->load_allocs,
+            r->gc_collections, r->gc_max_pause_us);
+  }
+}
+
+// Compares against a file written by -o. Only time per run (dispatches times
+// ns per dispatch, so that fused opcodes are not penalized) is treated as a
+// regression; dispatch counts and heap are reported for context.
+static int compare_baseline(const char *path, BenchResult *results, int n, double threshold)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  int regressions = 0;
+  char line[256];
+  printf("\n%-12s %10s %10s %8s %10s %10s\n", "vs baseline", "us/run", "base", "delta", "dispatch", "heap");
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#') continue;
+    BenchResult base;
+    if (sscanf(line, "%63s %u %lf %lf %lf %zu %ld", base.name, &base.dispatches, &base.ns_per_op,
+               &base.insts_per_sec, &base.parse_us, &base.peak_heap, &base.result) < 7) {
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      BenchResult *r = &results[i];
+      if (strcmp(r->name, base.name) != 0) continue;
+      double run_us = r->dispatches * r->ns_per_op / 1e3;
+      double base_us = base.dispatches * base.ns_per_op / 1e3;
+      double delta = base_us > 0 ? (run_us / base_us - 1.0) * 100.0 : 0;
+      bool regressed = delta > threshold;
+      regressions += regressed;
+      printf("%-12s %10.1f %10.1f %+7.1f%% %+10ld %+10ld%s\n", r->name, run_us, base_us, delta,
+             (long)r->dispatches - (long)base.dispatches, (long)r->peak_heap - (long)base.peak_heap,
+             regressed ? "  REGRESSION" : "");
+    }
+  }
+  fclose(fp);
+  return regressions;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-B] [-A] [-Z] [-j threads] [-r rounds] [-p parse_reps] [-o out.tsv] [-b baseline.tsv] [-t threshold%%] program.tvm...\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+  int rounds = 5;
+  int parse_reps = 200;
+  const char *out = NULL;
+  const char *baseline = NULL;
+  double threshold = 10.0;
+  int threads = 1;
+  int opt;
+  // GPIO builtins act on the mock pins of gpio_host.c
+  vm.builtins = &device_builtins;
+  while ((opt = getopt(argc, argv, "BAZj:r:p:o:b:t:h")) != -1) {
+    switch (opt) {
+      case 'B': binary_mode = true; break;
+      case 'A': aot_mode = true; break;
+      case 'Z': compress_mode = true; break;
+      case 'j': threads = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      case 'p': parse_reps = atoi(optarg); break;
+      case 'o': out = optarg; break;
+      case 'b': baseline = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+  if (optind >= argc || rounds < 1 || parse_reps < 1 || threads < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  BenchResult results[RESULT_MAX];
+  int n = 0;
+  int failed = 0;
+  printf("%-12s %10s %10s %14s %10s %10s %8s %7s %5s %9s\n", "program", "dispatch", "ns/op", "insts/sec", "parse_us", "peak_heap", "result", "allocs", "gcs", "pause_us");
+  for (int i = optind; i < argc && n < RESULT_MAX; i++) {
+    BenchResult *r = &results[n];
+    if (run_program(argv[i], rounds, parse_reps, threads, r) != 0) {
+      failed++;
+      continue;
+    }
+    printf("%-12s %10u %10.3f %14.0f %10.3f %10zu %8ld %7lu %5u %9u\n",
+           r->name, r->dispatches, r->ns_per_op, r->insts_per_sec, r->parse_us, r->peak_heap, r->result, r->load_allocs,
+           r->gc_collections, r->gc_max_pause_us);
+    n++;
+  }
+
+  if (out != NULL) {
+    FILE *fp = fopen(out, "w");
+    if (fp == NULL) {
+      perror(out);
+      return 2;
+    }
+    write_results(fp, results, n);
+    fclose(fp);
+  }
+  if (threads > 1) {
+    printf("\n%-12s %10s %10s\n", "scaling", "threads", "speedup");
+    for (int i = 0; i < n; i++) {
+      printf("%-12s %10d %9.2fx\n", results[i].name, threads, results[i].speedup);
+    }
+  }
+  bool tiers = false;
+  for (int i = 0; i < n; i++) {
+    tiers |= results[i].ir_dispatches > 0;
+  }
+  if (tiers) {
+    printf("\n%-12s %10s %10s %10s %10s %8s\n", "tiers", "stack", "us/run", "register", "us/run", "speedup");
+    for (int i = 0; i < n; i++) {
+      BenchResult *r = &results[i];
+      if (r->ir_dispatches == 0) {
+        printf("%-12s %10s\n", r->name, "stack only");
+        continue;
+      }
+      printf("%-12s %10u %10.1f %10u %10.1f %7.2fx\n", r->name, r->stack_dispatches, r->stack_us,
+             r->ir_dispatches, r->ir_us, r->ir_us > 0 ? r->stack_us / r->ir_us : 0);
+    }
+  }
+  if (compress_mode) {
+    printf("\n%-12s %10s %10s %8s %10s\n", "compression", "bytes", "lz", "ratio", "inflate_us");
+    uint32_t total = 0, total_lz = 0;
+    for (int i = 0; i < n; i++) {
+      BenchResult *r = &results[i];
+      printf("%-12s %10u %10u %7.1f%% %10.3f\n", r->name, r->image_size, r->compressed_size,
+             100.0 * r->compressed_size / r->image_size, r->inflate_us);
+      total += r->image_size;
+      total_lz += r->compressed_size;
+    }
+    if (total > 0) printf("%-12s %10u %10u %7.1f%%\n", "total", total, total_lz, 100.0 * total_lz / total);
+  }
+#ifdef TARTO_VM_PAIRS
+  print_pairs();
+#endif
+  if (failed) return 1;
+  if (baseline != NULL && compare_baseline(baseline, results, n, threshold) != 0) return 1;
+  return 0;
+}
@@ -0,0 +1,31 @@
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  char name[64];
+  uint32_t dispatches;
+  double ns_per_op;
+  double insts_per_sec;
+  double parse_us;
+  size_t peak_heap;
+  long result;
+  unsigned long load_allocs;
+  uint32_t gc_collections;
+  uint32_t gc_max_pause_us;
+  // -j: throughput of that many VMs in parallel over one
+  double speedup;
+  // the same program on each tier; ir_dispatches is 0 when it has no IR
+  uint32_t stack_dispatches;
+  double stack_us;
+  uint32_t ir_dispatches;
+  double ir_us;
+  // -Z: binary image, compressed, and the time to inflate it
+  uint32_t image_size;
+  uint32_t compressed_size;
+  double inflate_us;
+} BenchResult;
+
+void heap_reset_peak();
+size_t heap_current_bytes();
+size_t heap_peak_bytes();
+unsigned long heap_alloc_count();
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "peripheral.h"
+#include "cache_host.h"
+
+// Host stand-in for components/peripheral/cache_flash.c.
+static uint8_t *mapped[REGION_COUNT];
+static uint32_t mapped_size[REGION_COUNT];
+
+bool host_region_open(regionId id, const char *path, uint32_t size)
+{
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  bool fresh = st.st_size == 0;
+  if (fresh && ftruncate(fd, size) != 0) {
+    perror(path);
+    close(fd);
+    return false;
+  }
+  if (!fresh) size = st.st_size;
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  mapped[id] = p;
+  mapped_size[id] = size;
+  if (fresh) memset(mapped[id], 0xFF, size);
+  return true;
+}
+
+bool flash_region_open(regionId id, FlashRegion *region)
+{
+  if (mapped[id] == NULL) return false;
+  region->base = mapped[id];
+  region->size = mapped_size[id];
+  return true;
+}
+
+// Like a flash write, only clears bits.
+bool flash_region_write(regionId id, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+  if (offset > mapped_size[id] || len > mapped_size[id] - offset) return false;
+  for (uint32_t i = 0; i < len; i++) {
+    mapped[id][offset + i] &= data[i];
+  }
+  return msync(mapped[id], mapped_size[id], MS_ASYNC) == 0;
+}
+
+bool flash_region_erase(regionId id, uint32_t size)
+{
+  uint32_t sectors = (size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+  if (sectors > mapped_size[id]) sectors = mapped_size[id];
+  memset(mapped[id], 0xFF, sectors);
+  return msync(mapped[id], mapped_size[id], MS_ASYNC) == 0;
+}
@@ -0,0 +1,9 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HOST_CACHE_SIZE (256 * 1024)
+#define HOST_SNAPSHOT_SIZE (64 * 1024)
+
+// Backs a flash region (the program cache, the VM snapshot) with a file,
+// created erased with the given size if it does not exist yet.
+bool host_region_open(regionId id, const char *path, uint32_t size);
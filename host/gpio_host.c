@@ -0,0 +1,59 @@
+#include <string.h>
+#include "peripheral.h"
+#include "gpio_host.h"
+
+// Host stand-in for components/peripheral/gpio.c. Pins have the ESP32's
+// numbering: 34 and up are input only. Unlike the device it refuses writes
+// to pins that were not made outputs, so such programs fail on the host.
+// Every thread has its own pins, so VMs running side by side (bench -j)
+// do not share them.
+#define OUTPUT_PIN_COUNT 34
+
+static __thread bool outputs[GPIO_PIN_COUNT];
+static __thread bool levels[GPIO_PIN_COUNT];
+static __thread uint32_t writes[GPIO_PIN_COUNT];
+
+void host_gpio_reset(void)
+{
+  memset(outputs, 0, sizeof(outputs));
+  memset(levels, 0, sizeof(levels));
+  memset(writes, 0, sizeof(writes));
+}
+
+void host_gpio_set_input(uint8_t pin, bool level)
+{
+  if (pin < GPIO_PIN_COUNT && !outputs[pin]) levels[pin] = level;
+}
+
+bool host_gpio_level(uint8_t pin)
+{
+  return pin < GPIO_PIN_COUNT && levels[pin];
+}
+
+uint32_t host_gpio_writes(uint8_t pin)
+{
+  return pin < GPIO_PIN_COUNT ? writes[pin] : 0;
+}
+
+bool gpio_pin_mode(uint8_t pin, bool output)
+{
+  if (pin >= (output ? OUTPUT_PIN_COUNT : GPIO_PIN_COUNT)) return false;
+  outputs[pin] = output;
+  levels[pin] = false;
+  return true;
+}
+
+bool gpio_pin_write(uint8_t pin, bool level)
+{
+  if (pin >= GPIO_PIN_COUNT || !outputs[pin]) return false;
+  levels[pin] = level;
+  writes[pin]++;
+  return true;
+}
+
+bool gpio_pin_read(uint8_t pin, bool *level)
+{
+  if (pin >= GPIO_PIN_COUNT) return false;
+  *level = levels[pin];
+  return true;
+}
@@ -0,0 +1,10 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+// The mock pins of the calling thread, for runners that check what a
+// program did to them.
+void host_gpio_reset(void);
+// the level an input pin reads
+void host_gpio_set_input(uint8_t pin, bool level);
+bool host_gpio_level(uint8_t pin);
+uint32_t host_gpio_writes(uint8_t pin);
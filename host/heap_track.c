@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <malloc.h>
+#include "bench.h"
+
+// The benchmark links with -Wl,--wrap=malloc,... so every allocation made by
+// the VM object files goes through these hooks and is accounted here.
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void*, size_t);
+void __real_free(void*);
+
+// The workers of the parallel benchmark allocate at the same time, so the
+// counters are only updated atomically.
+static size_t heap_current;
+static size_t heap_peak;
+static unsigned long heap_allocs;
+
+static void heap_add(void *p)
+{
+  if (p == NULL) return;
+  __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+  size_t current = __atomic_add_fetch(&heap_current, malloc_usable_size(p), __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+  while (current > peak &&
+         !__atomic_compare_exchange_n(&heap_peak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static void heap_sub(void *p)
+{
+  if (p == NULL) return;
+  __atomic_sub_fetch(&heap_current, malloc_usable_size(p), __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size)
+{
+  void *p = __real_malloc(size);
+  heap_add(p);
+  return p;
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+  void *p = __real_calloc(n, size);
+  heap_add(p);
+  return p;
+}
+
+void *__wrap_realloc(void *old, size_t size)
+{
+  heap_sub(old);
+  void *p = __real_realloc(old, size);
+  heap_add(p == NULL ? old : p);
+  return p;
+}
+
+void __wrap_free(void *p)
+{
+  heap_sub(p);
+  __real_free(p);
+}
+
+void heap_reset_peak()
+{
+  __atomic_store_n(&heap_peak, __atomic_load_n(&heap_current, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+size_t heap_current_bytes()
+{
+  return __atomic_load_n(&heap_current, __ATOMIC_RELAXED);
+}
+
+size_t heap_peak_bytes()
+{
+  return __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+}
+
+unsigned long heap_alloc_count()
+{
+  return __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+}
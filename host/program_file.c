@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "program_file.h"
+
+static void read_tag(char *p, char *eol, const char *tag, long *value)
+{
+  char *found = strstr(p, tag);
+  if (found != NULL && (eol == NULL || found < eol)) {
+    *value = strtol(found + strlen(tag), NULL, 10);
+  }
+}
+
+// Loads a corpus program: hex digits with '#' comments and free whitespace.
+// A "# expect: N" comment gives the value the program must return.
+// "# frames: N" and "# stack: N" size a program whose call depth
+// tvm_to_binary cannot work out; declared may be NULL.
+char *read_tvm_file(const char *path, long *expect, Resources *declared)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *text = malloc(size + 1);
+  char *hex = malloc(size + 1);
+  size_t len = fread(text, 1, size, fp);
+  text[len] = '\0';
+  fclose(fp);
+
+  *expect = -1;
+  long frames = 0, stack = 0;
+  size_t n = 0;
+  for (char *p = text; *p != '\0'; p++) {
+    if (*p == '#') {
+      char *eol = strchr(p, '\n');
+      read_tag(p, eol, "expect:", expect);
+      read_tag(p, eol, "frames:", &frames);
+      read_tag(p, eol, "stack:", &stack);
+      if (eol == NULL) break;
+      p = eol;
+      continue;
+    }
+    if (('0' <= *p && *p <= '9') || ('a' <= *p && *p <= 'f') || ('A' <= *p && *p <= 'F')) {
+      hex[n++] = *p;
+    }
+  }
+  hex[n] = '\0';
+  free(text);
+  if (declared != NULL) {
+    declared->frames = frames > 0 && frames <= U2_MAX ? frames : 0;
+    declared->stack = stack > 0 && stack <= U2_MAX ? stack : 0;
+    declared->globals = 0;
+  }
+  return hex;
+}
+
+typedef struct {
+  uint16_t globals;
+  bool top_calls;
+  bool nested_calls;
+} BodyScan;
+
+static void scan_body(BodyScan *scan, const uint8_t *code, uint16_t size, bool top)
+{
+  for (uint32_t pos = 0; pos < size; pos += 1 + operand_size(code[pos])) {
+    uint8_t op = code[pos];
+    if ((op == OP_LOAD_GLOBAL || op == OP_STORE_GLOBAL) && pos + 1 < size && code[pos+1] >= scan->globals) {
+      scan->globals = code[pos+1] + 1;
+    }
+    if (op == OP_CALL || op == OP_CALL_METHOD) {
+      if (top) {
+        scan->top_calls = true;
+      } else {
+        scan->nested_calls = true;
+      }
+    }
+  }
+}
+
+static void scan_pool(BodyScan *scan, Constant *constants, uint16_t constant_size)
+{
+  for (int i = 0; i < constant_size; i++) {
+    if (constants[i].type == CONST_FUNC) scan_body(scan, constants[i].content, constants[i].size, false);
+  }
+}
+
+// What the program needs from the VM: globals up to the highest index it
+// uses, and a frame per level of calls, each with room for the locals and
+// operand stack of the largest function. Call targets are not known here,
+// so once a function calls anything the depth could be anything and comes
+// from "# frames:", or is FRAME_DEFAULT. Programs the loader rejects get
+// the defaults; the device rejects them as well.
+static Resources program_resources(const char *hex, const Resources *declared)
+{
+  Resources r = {STACK_DEFAULT, FRAME_DEFAULT, GLOBAL_DEFAULT};
+  char *copy = strdup(hex);
+  Bytecode b = parse_bytecode(copy);
+  if (b.arena == NULL) {
+    free(copy);
+    return r;
+  }
+  // verify against the largest sizes, then size to what it found
+  b.resources = (Resources) {U2_MAX, 1, GLOBAL_LIMIT};
+  if (load_bytecode(&b)) {
+    BodyScan scan = {0, false, false};
+    scan_body(&scan, b.instructions, b.instruction_size, true);
+    scan_pool(&scan, b.constants, b.constant_size);
+    for (int i = 0; i < b.class_size; i++) {
+      scan_pool(&scan, b.classes[i].constants, b.classes[i].constant_size);
+    }
+    uint32_t largest = 0;
+    for (int i = 1; i < b.function_size; i++) {
+      uint32_t need = b.functions[i].locals + b.functions[i].max_stack;
+      if (need > largest) largest = need;
+    }
+    r.globals = scan.globals;
+    r.frames = !scan.top_calls && !scan.nested_calls ? 1 : !scan.nested_calls ? 2 : FRAME_DEFAULT;
+    if (declared != NULL && declared->frames > 0) r.frames = declared->frames;
+    uint32_t stack = b.functions[0].locals + b.functions[0].max_stack + (uint32_t) (r.frames - 1) * largest;
+    r.stack = stack < U2_MAX ? stack : U2_MAX;
+  }
+  if (declared != NULL && declared->stack > 0) r.stack = declared->stack;
+  free_bytecode(&b);
+  free(copy);
+  return r;
+}
+
+static void put_u2(uint8_t *p, uint16_t value)
+{
+  // the u2 of the program format, see decode_constant
+  p[0] = value / 255;
+  p[1] = value % 255;
+}
+
+// The binary image is the hex program with its bytes decoded, the versioned
+// magic in front and what it needs from the VM after that, as a host would
+// send it. declared, which may be NULL, overrides what is worked out here.
+uint8_t *tvm_to_binary(const char *hex, const Resources *declared, uint32_t *size)
+{
+  uint32_t hex_size = strlen(hex) / 2;
+  uint32_t body = hex_size > MAGIC_SIZE ? hex_size - MAGIC_SIZE : 0;
+  *size = MAGIC_SIZE + RESOURCES_SIZE + body;
+  uint8_t *image = malloc(*size);
+  for (uint32_t i = 0; i < body; i++) {
+    char byte[3] = {hex[2*(MAGIC_SIZE+i)], hex[2*(MAGIC_SIZE+i)+1], '\0'};
+    image[MAGIC_SIZE + RESOURCES_SIZE + i] = strtol(byte, NULL, 16);
+  }
+  memcpy(image, BINARY_MAGIC, MAGIC_SIZE-1);
+  image[MAGIC_SIZE-1] = BINARY_VERSION;
+  Resources r = program_resources(hex, declared);
+  put_u2(image + MAGIC_SIZE, r.stack);
+  put_u2(image + MAGIC_SIZE + 2, r.frames);
+  put_u2(image + MAGIC_SIZE + 4, r.globals);
+  return image;
+}
+
+#define HASH_BITS 12
+#define CHAIN_MAX 64
+
+static uint32_t hash3(const uint8_t *p)
+{
+  uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// bytes a match saves over sending its bytes as literals
+static int32_t match_gain(uint32_t len, uint32_t offset)
+{
+  return (int32_t) len - (offset <= LZ_MAX_NEAR_OFFSET ? 2 : 3);
+}
+
+static void put_literals(uint8_t *out, uint32_t *o, const uint8_t *p, uint32_t n)
+{
+  while (n > 0) {
+    uint32_t k = n < LZ_MAX_LITERALS ? n : LZ_MAX_LITERALS;
+    out[(*o)++] = k - 1;
+    memcpy(out + *o, p, k);
+    *o += k;
+    p += k;
+    n -= k;
+  }
+}
+
+// Compresses a binary image into the format of lz.c, greedily taking the
+// match that saves the most bytes among the last CHAIN_MAX places with the
+// same 3-byte hash. Returns NULL when out of memory.
+uint8_t *compress_binary(const uint8_t *image, uint32_t size, uint32_t *compressed_size)
+{
+  // worst case: all literals, one control byte per LZ_MAX_LITERALS
+  uint8_t *out = malloc(COMPRESSED_HEADER_SIZE + size + size / LZ_MAX_LITERALS + 1);
+  int32_t *head = malloc(sizeof(int32_t) << HASH_BITS);
+  int32_t *prev = malloc(sizeof(int32_t) * (size > 0 ? size : 1));
+  if (out == NULL || head == NULL || prev == NULL) {
+    free(out);
+    free(head);
+    free(prev);
+    return NULL;
+  }
+  memset(head, 0xFF, sizeof(int32_t) << HASH_BITS);
+  memcpy(out, image, MAGIC_SIZE);
+  out[MAGIC_SIZE-1] |= BINARY_COMPRESSED;
+  out[4] = size >> 24;
+  out[5] = size >> 16;
+  out[6] = size >> 8;
+  out[7] = size;
+  uint32_t o = COMPRESSED_HEADER_SIZE;
+  uint32_t literals = MAGIC_SIZE;
+  uint32_t pos = MAGIC_SIZE;
+  while (pos < size) {
+    uint32_t best = 0, best_offset = 0;
+    if (pos + LZ_MIN_MATCH <= size) {
+      uint32_t h = hash3(image + pos);
+      int32_t candidate = head[h];
+      for (int chain = 0; candidate >= MAGIC_SIZE && chain < CHAIN_MAX; chain++, candidate = prev[candidate]) {
+        if (pos - candidate > LZ_MAX_OFFSET) break;
+        uint32_t len = 0;
+        while (len < LZ_MAX_MATCH && pos + len < size && image[candidate + len] == image[pos + len]) len++;
+        if (len >= LZ_MIN_MATCH && match_gain(len, pos - candidate) > (best > 0 ? match_gain(best, best_offset) : 0)) {
+          best = len;
+          best_offset = pos - candidate;
+        }
+      }
+    }
+    uint32_t step = best >= LZ_MIN_MATCH ? best : 1;
+    if (best >= LZ_MIN_MATCH) {
+      put_literals(out, &o, image + literals, pos - literals);
+      if (best_offset <= LZ_MAX_NEAR_OFFSET) {
+        out[o++] = LZ_NEAR | (best - LZ_MIN_MATCH);
+      } else {
+        out[o++] = LZ_FAR | (best - LZ_MIN_MATCH);
+        out[o++] = best_offset >> 8;
+      }
+      out[o++] = best_offset;
+    }
+    for (uint32_t end = pos + step; pos < end; pos++) {
+      if (pos + LZ_MIN_MATCH <= size) {
+        uint32_t h = hash3(image + pos);
+        prev[pos] = head[h];
+        head[h] = pos;
+      }
+    }
+    if (best >= LZ_MIN_MATCH) literals = pos;
+  }
+  put_literals(out, &o, image + literals, pos - literals);
+  free(head);
+  free(prev);
+  *compressed_size = o;
+  return out;
+}
@@ -0,0 +1,9 @@
+#include <stdint.h>
+#include "vm.h"
+
+// largest value of a u2 in the program format
+#define U2_MAX (255 * 255 + 254)
+
+char *read_tvm_file(const char *path, long *expect, Resources *declared);
+uint8_t *tvm_to_binary(const char *hex, const Resources *declared, uint32_t *size);
+uint8_t *compress_binary(const uint8_t *image, uint32_t size, uint32_t *compressed_size);
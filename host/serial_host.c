@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "peripheral.h"
+#include "serial_host.h"
+
+#define BUF_SIZE (1024)
+
+// Host stand-in for components/peripheral/usb_serial.c.
+static int in_fd = 0;
+static int out_fd = 1;
+static bool echo = true;
+
+void usb_serial_set_echo(bool on)
+{
+  echo = on;
+}
+
+bool usb_serial_echo()
+{
+  return echo;
+}
+
+bool host_serial_open(const char *path)
+{
+  if (strcmp(path, "-") == 0) {
+    in_fd = 0;
+    out_fd = 1;
+    return true;
+  }
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  if (isatty(fd)) {
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  in_fd = fd;
+  out_fd = fd;
+  return true;
+}
+
+static speed_t tty_speed(uint32_t baud)
+{
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+    case 2000000: return B2000000;
+#endif
+#ifdef B3000000
+    case 3000000: return B3000000;
+#endif
+    default: return B0;
+  }
+}
+
+bool host_tty_configure(int fd, uint32_t baud, bool flow_control)
+{
+  if (!isatty(fd)) return true;
+  speed_t speed = tty_speed(baud);
+  struct termios tio;
+  if (speed == B0 || tcgetattr(fd, &tio) != 0) return false;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (flow_control) {
+    tio.c_cflag |= CRTSCTS;
+  } else {
+    tio.c_cflag &= ~CRTSCTS;
+  }
+  return tcsetattr(fd, TCSADRAIN, &tio) == 0;
+}
+
+void usb_serial_init()
+{
+}
+
+bool usb_serial_configure(uint32_t baud, bool flow_control)
+{
+  if (!host_tty_configure(in_fd, baud, flow_control)) return false;
+  return out_fd == in_fd || host_tty_configure(out_fd, baud, flow_control);
+}
+
+// Same contract as on the device, plus -1 once the other end has closed.
+int read_usb_serial(uint8_t *buf, uint32_t len, uint32_t timeout_ms)
+{
+  struct pollfd pfd = {in_fd, POLLIN, 0};
+  int ready = poll(&pfd, 1, timeout_ms);
+  if (ready <= 0) return 0;
+  ssize_t n = read(in_fd, buf, len);
+  if (n == 0) return -1;
+  return n > 0 ? n : 0;
+}
+
+void write_usb_serial(const uint8_t *buf, uint32_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(out_fd, buf, len);
+    if (n <= 0) return;
+    buf += n;
+    len -= n;
+  }
+}
+
+InputData read_data_from_usb_serial()
+{
+  uint8_t *data = malloc(BUF_SIZE);
+  for (;;) {
+    int len = read_usb_serial(data, BUF_SIZE, 100);
+    if (len < 0) return (InputData) {0, data};
+    if (len > 0) {
+      if (echo) write_usb_serial(data, len);
+      return (InputData) {len, data};
+    }
+  }
+}
@@ -0,0 +1,9 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+// Points the peripheral serial API at a file, pipe or pty instead of UART0.
+// "-" uses stdin/stdout.
+bool host_serial_open(const char *path);
+// Sets the speed and RTS/CTS flow control of a tty. Other files are left
+// alone and count as configured; false for a rate termios has no speed for.
+bool host_tty_configure(int fd, uint32_t baud, bool flow_control);
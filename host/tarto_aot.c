@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "vm.h"
+#include "program_file.h"
+
+#define INTERPRETED_MAX 32
+
+// -x: functions left to the interpreter, by index into Bytecode.functions
+static uint16_t interpreted[INTERPRETED_MAX];
+static int interpreted_size;
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-o out.c] [-x function]... program.tvm...\n", argv0);
+}
+
+static bool is_interpreted(uint16_t index)
+{
+  for (int i = 0; i < interpreted_size; i++) {
+    if (interpreted[i] == index) return true;
+  }
+  return false;
+}
+
+// C identifier from the file name, "fib" for programs/fib.tvm
+static void program_symbol(const char *path, char *name, size_t size)
+{
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  snprintf(name, size, "%s", base);
+  char *ext = strrchr(name, '.');
+  if (ext != NULL) *ext = '\0';
+  for (char *p = name; *p != '\0'; p++) {
+    if (!isalnum((unsigned char) *p)) *p = '_';
+  }
+}
+
+static uint16_t operand_u2(uint8_t *code, uint32_t pos)
+{
+  return decode_constant(code[pos+1], code[pos+2]);
+}
+
+static bool uses_frame(uint8_t *code, uint16_t size)
+{
+  for (uint32_t pos = 0; pos < size; pos += 1 + operand_size(code[pos])) {
+    switch (code[pos]) {
+      case OP_LOAD_LOCAL:
+      case OP_STORE_LOCAL:
+      case OP_LOAD_INSTANCE_VAL:
+      case OP_STORE_INSTANCE_VAL:
+        return true;
+    }
+  }
+  return false;
+}
+
+// the number case inline, anything else through binary_op like the
+// generic instruction does
+static void emit_binary(FILE *out, uint8_t op, const char *expr)
+{
+  fprintf(out, "  sp--;\n");
+  fprintf(out, "  if (IS_NUMBERS(sp[-1], sp[0])%s) sp[-1] = %s;\n", op == OP_DIV ? " && AS_NUMBER(sp[0]) != 0" : "", expr);
+  fprintf(out, "  else if ((result = binary_op(%u, sp[-1], sp[0], &sp[-1])) != SUCCESS) return result;\n", op);
+}
+
+static void emit_call(FILE *out, uint8_t arg_num, bool f_method)
+{
+  fprintf(out, "  vm->stack_top = sp;\n");
+  fprintf(out, "  if ((result = aot_call(vm, b, %u, %s)) != SUCCESS) return result;\n", arg_num, f_method ? "true" : "false");
+  fprintf(out, "  sp = vm->stack_top;\n");
+}
+
+// One C function per body. It mirrors the handlers of exec_interpret on
+// the same stack and frame, minus decoding and dispatch; jumps become gotos
+// to labels at their byte offsets. The body has been verified, so operands
+// are in range.
+static void emit_body(FILE *out, Bytecode *b, const char *symbol, uint16_t index,
+                      uint8_t *code, uint16_t size, Constant *constants)
+{
+  bool *target = calloc(size + 1, sizeof(bool));
+  // calls and arithmetic need a result variable
+  bool calls = false;
+  // whether control can reach the end of the body
+  bool falls_off = true;
+  for (uint32_t pos = 0; pos < size; pos += 1 + operand_size(code[pos])) {
+    if (code[pos] == OP_JMP || code[pos] == OP_JNT) target[operand_u2(code, pos)] = true;
+    if (code[pos] == OP_CALL || code[pos] == OP_CALL_METHOD || code[pos] == OP_CALL_NATIVE ||
+        code[pos] == OP_CALL_NATIVE_BATCH || (code[pos] >= OP_ADD && code[pos] <= OP_GREATER && code[pos] != OP_DONE)) {
+      calls = true;
+    }
+    falls_off = code[pos] != OP_JMP && code[pos] != OP_RETURN && code[pos] != OP_RETURN_VAL;
+  }
+
+  fprintf(out, "static resultType %s_%u(VM *vm, Bytecode *b)\n{\n", symbol, index);
+  if (uses_frame(code, size)) fprintf(out, "  Frame *frame = current_frame(vm);\n");
+  if (calls) fprintf(out, "  resultType result;\n");
+  fprintf(out, "  Value *sp = vm->stack_top;\n");
+  for (uint32_t pos = 0; pos < size; pos += 1 + operand_size(code[pos])) {
+    uint8_t op = code[pos];
+    uint8_t arg = operand_size(op) > 0 ? code[pos+1] : 0;
+    if (target[pos]) fprintf(out, "L%u:\n", pos);
+    fprintf(out, "  // %u: %s\n", pos, opcode_name(op));
+    switch (op) {
+      case OP_CONSTANT: {
+        Constant *c = &constants[operand_u2(code, pos) - 1];
+        if (c->type == CONST_INT) {
+          fprintf(out, "  *sp++ = NUMBER_VAL(%u);\n", decode_constant(c->content[0], c->content[1]));
+        } else {
+          fprintf(out, "  *sp++ = FUNCTION_VAL(&b->functions[%d]);\n", (int) (c->function - b->functions));
+        }
+        break;
+      }
+      case OP_ADD: emit_binary(out, op, "NUMBER_VAL(AS_NUMBER(sp[-1]) + AS_NUMBER(sp[0]))"); break;
+      case OP_SUB: emit_binary(out, op, "NUMBER_VAL(AS_NUMBER(sp[-1]) - AS_NUMBER(sp[0]))"); break;
+      case OP_MUL: emit_binary(out, op, "NUMBER_VAL(AS_NUMBER(sp[-1]) * AS_NUMBER(sp[0]))"); break;
+      case OP_DIV: emit_binary(out, op, "NUMBER_VAL(AS_NUMBER(sp[-1]) / AS_NUMBER(sp[0]))"); break;
+      case OP_EQ: emit_binary(out, op, "BOOL_VAL(AS_NUMBER(sp[-1]) == AS_NUMBER(sp[0]))"); break;
+      case OP_NEQ: emit_binary(out, op, "BOOL_VAL(AS_NUMBER(sp[-1]) != AS_NUMBER(sp[0]))"); break;
+      case OP_LESS: emit_binary(out, op, "BOOL_VAL(AS_NUMBER(sp[-1]) < AS_NUMBER(sp[0]))"); break;
+      case OP_GREATER: emit_binary(out, op, "BOOL_VAL(AS_NUMBER(sp[-1]) > AS_NUMBER(sp[0]))"); break;
+      case OP_DONE:
+        break;
+      case OP_LOAD_GLOBAL: fprintf(out, "  *sp++ = vm->global[%u];\n", arg); break;
+      case OP_STORE_GLOBAL: fprintf(out, "  vm->global[%u] = *--sp;\n", arg); break;
+      case OP_JNT: fprintf(out, "  if (!AS_BOOL(*--sp)) goto L%u;\n", operand_u2(code, pos)); break;
+      case OP_JMP: fprintf(out, "  goto L%u;\n", operand_u2(code, pos)); break;
+      case OP_CALL: emit_call(out, arg, false); break;
+      case OP_CALL_METHOD: emit_call(out, arg, true); break;
+      case OP_RETURN_VAL: fprintf(out, "  aot_return(vm, sp[-1]);\n  return SUCCESS;\n"); break;
+      case OP_RETURN: fprintf(out, "  aot_return(vm, NIL_VAL());\n  return SUCCESS;\n"); break;
+      // natives run to the end of their program, they neither yield nor block
+      case OP_YIELD: break;
+      case OP_SLEEP:
+      case OP_WAIT: fprintf(out, "  if (!IS_NUMBER(*--sp)) return ERROR_TYPE;\n"); break;
+      case OP_CALL_NATIVE:
+      case OP_CALL_NATIVE_BATCH: {
+        fprintf(out, "  vm->stack_top = sp;\n  sp -= %u;\n", arg);
+        fprintf(out, "  if ((result = call_builtin(vm, %u, sp, %u, %s, sp)) != SUCCESS) return result;\n",
+                code[pos+2], arg, op == OP_CALL_NATIVE_BATCH ? "true" : "false");
+        fprintf(out, "  sp++;\n");
+        break;
+      }
+      case OP_LOAD_LOCAL: {
+        fprintf(out, "  *sp++ = frame->bp[%u];\n", arg);
+        break;
+      }
+      case OP_STORE_LOCAL: {
+        fprintf(out, "  frame->bp[%u] = *--sp;\n", arg);
+        break;
+      }
+      case OP_INSTANECE: {
+        fprintf(out, "  {\n    vm->stack_top = sp;\n");
+        fprintf(out, "    Instance *instance = heap_alloc_instance(vm, &b->classes[%u], %u);\n", arg, arg);
+        fprintf(out, "    if (instance == NULL) return ERROR_OUT_OF_MEMORY;\n");
+        fprintf(out, "    *sp++ = INSTANCE_VAL(instance);\n  }\n");
+        break;
+      }
+      case OP_LOAD_METHOD: {
+        fprintf(out, "  {\n    Function *method = aot_method(sp[-1], %u);\n", arg);
+        fprintf(out, "    if (method == NULL) return ERROR_NO_METHOD;\n");
+        fprintf(out, "    *sp++ = FUNCTION_VAL(method);\n  }\n");
+        break;
+      }
+      case OP_LOAD_INSTANCE_VAL: fprintf(out, "  *sp++ = AS_INSTANCE(frame->bp[-2])->variables[%u];\n", arg); break;
+      case OP_STORE_INSTANCE_VAL: fprintf(out, "  AS_INSTANCE(frame->bp[-2])->variables[%u] = *--sp;\n", arg); break;
+    }
+  }
+  if (target[size]) fprintf(out, "L%u:\n", size);
+  if (falls_off || target[size]) fprintf(out, "  vm->stack_top = sp;\n  return STOPPED;\n");
+  fprintf(out, "}\n\n");
+  free(target);
+}
+
+static void emit_pool(FILE *out, Bytecode *b, const char *symbol, Constant *constants, uint16_t constant_size)
+{
+  for (int i=0; i<constant_size; i++) {
+    Constant *c = &constants[i];
+    if (c->type != CONST_FUNC) continue;
+    uint16_t index = c->function - b->functions;
+    if (!is_interpreted(index)) emit_body(out, b, symbol, index, c->content, c->size, constants);
+  }
+}
+
+static bool emit_program(FILE *out, const char *path, char *symbol, size_t symbol_size)
+{
+  long expect;
+  Resources declared;
+  char *hex = read_tvm_file(path, &expect, &declared);
+  if (hex == NULL) return false;
+  uint32_t image_size;
+  uint8_t *image = tvm_to_binary(hex, &declared, &image_size);
+  free(hex);
+  Bytecode b;
+  if (image == NULL || !parse_binary(image, image_size, &b)) {
+    fprintf(stderr, "%s: not a valid program\n", path);
+    free(image);
+    return false;
+  }
+  if (!load_bytecode(&b)) {
+    if (b.error.reason != NULL) {
+      fprintf(stderr, "%s: %s (function %d, offset %d)\n", path, b.error.reason, b.error.function, b.error.offset);
+    }
+    free_bytecode(&b);
+    free(image);
+    return false;
+  }
+  program_symbol(path, symbol, symbol_size);
+
+  fprintf(out, "// %s\n\n", path);
+  if (!is_interpreted(0)) emit_body(out, &b, symbol, 0, b.instructions, b.instruction_size, b.constants);
+  emit_pool(out, &b, symbol, b.constants, b.constant_size);
+  for (int i=0; i<b.class_size; i++) {
+    emit_pool(out, &b, symbol, b.classes[i].constants, b.classes[i].constant_size);
+  }
+
+  fprintf(out, "static const uint8_t %s_image[] = {", symbol);
+  for (uint32_t i = 0; i < image_size; i++) {
+    fprintf(out, "%s0x%02x,", i % 12 == 0 ? "\n  " : " ", image[i]);
+  }
+  fprintf(out, "\n};\n\n");
+  fprintf(out, "static const NativeFunction %s_natives[] = {\n", symbol);
+  for (uint16_t i = 0; i < b.function_size; i++) {
+    if (is_interpreted(i)) {
+      fprintf(out, "  NULL,\n");
+    } else {
+      fprintf(out, "  %s_%u,\n", symbol, i);
+    }
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out, "const AotProgram aot_%s = {\"%s\", %s_image, sizeof(%s_image), %s_natives, %u};\n\n",
+          symbol, symbol, symbol, symbol, symbol, b.function_size);
+  free_bytecode(&b);
+  free(image);
+  return true;
+}
+
+// Compiles programs ahead of time into C that links against the VM: every
+// function becomes a native (see aot.c), and each program an AotProgram
+// aot_<name> for tarto_vm_run_aot. aot_programs lists all of them. -x
+// leaves a function to the interpreter, natives and interpreted functions
+// call each other freely.
+int main(int argc, char **argv)
+{
+  const char *path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:x:h")) != -1) {
+    switch (opt) {
+      case 'o': path = optarg; break;
+      case 'x':
+        if (interpreted_size < INTERPRETED_MAX) interpreted[interpreted_size++] = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 2;
+  }
+  FILE *out = stdout;
+  if (path != NULL && (out = fopen(path, "w")) == NULL) {
+    perror(path);
+    return 2;
+  }
+
+  fprintf(out, "// Generated by tarto_aot, do not edit.\n#include \"vm.h\"\n\n");
+  int n = argc - optind;
+  char (*symbols)[64] = calloc(n, sizeof(*symbols));
+  bool ok = true;
+  for (int i = 0; ok && i < n; i++) {
+    ok = emit_program(out, argv[optind + i], symbols[i], sizeof(symbols[i]));
+  }
+  if (ok) {
+    fprintf(out, "const AotProgram *const aot_programs[] = {\n");
+    for (int i = 0; i < n; i++) {
+      fprintf(out, "  &aot_%s,\n", symbols[i]);
+    }
+    fprintf(out, "  NULL,\n};\n");
+  }
+  free(symbols);
+  if (out != stdout) fclose(out);
+  if (!ok && path != NULL) remove(path);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "peripheral.h"
+#include "vm.h"
+
+static int in_fd = 0;
+
+static int next_byte(void)
+{
+  static uint8_t buf[1024];
+  static ssize_t size = 0, pos = 0;
+  if (pos == size) {
+    size = read(in_fd, buf, sizeof(buf));
+    pos = 0;
+    if (size <= 0) return -1;
+  }
+  return buf[pos++];
+}
+
+static uint32_t u2(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+// Prints a reply frame the way the device prints the result of an
+// unframed program. Returns false for errors.
+static bool print_reply(uint8_t type, const uint8_t *p, uint8_t size)
+{
+  switch (type) {
+    case REPLY_RESULT:
+      if (size >= 2) {
+        printf("return val: %u\n", u2(p));
+      } else {
+        printf("return val: -\n");
+      }
+      return true;
+    case REPLY_ERROR:
+      if (size >= 5 && p[0] == ERROR_INVALID_PROGRAM) {
+        printf("error: %.*s (function %u, offset %u)\n", size - 5, (const char *) p + 5, u2(p + 1), u2(p + 3));
+      } else if (size >= 1 && p[0] == ERROR_NOT_CACHED) {
+        printf("not cached\n");
+      } else {
+        printf("error: result %u\n", size >= 1 ? p[0] : 0);
+      }
+      return false;
+    case REPLY_TELEMETRY:
+      if (size >= 10) {
+        printf("telemetry: heap %u bytes, %u collections, max pause %u us, %u dropped\n",
+               (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3], u2(p + 4), u2(p + 6), u2(p + 8));
+      }
+      return true;
+    default:
+      printf("unknown reply %u\n", type);
+      return false;
+  }
+}
+
+// Decodes what tarto_run or the device sends back: reply frames become
+// text lines, anything else (echoed input, text replies) passes through.
+// Fails when any program failed.
+int main(int argc, char **argv)
+{
+  if (argc > 2 || (argc == 2 && argv[1][0] == '-' && argv[1][1] != '\0')) {
+    fprintf(stderr, "usage: %s [device]\n", argv[0]);
+    return 2;
+  }
+  if (argc == 2 && strcmp(argv[1], "-") != 0 && (in_fd = open(argv[1], O_RDONLY | O_NOCTTY)) < 0) {
+    perror(argv[1]);
+    return 2;
+  }
+  int failed = 0;
+  int c;
+  while ((c = next_byte()) >= 0) {
+    if (c != FRAME_SYNC) {
+      putchar(c);
+      continue;
+    }
+    int type = next_byte();
+    int size = next_byte();
+    if (type < 0 || size < 0) break;
+    uint8_t payload[REPLY_PAYLOAD_MAX];
+    int got = 0;
+    while (got < size && (c = next_byte()) >= 0) {
+      payload[got++] = c;
+    }
+    if (got < size) break;
+    if (!print_reply(type, payload, size)) failed++;
+    fflush(stdout);
+  }
+  return failed > 0 ? 1 : 0;
+}
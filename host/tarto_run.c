@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "peripheral.h"
+#include "service.h"
+#include "builtins.h"
+#include "serial_host.h"
+#include "cache_host.h"
+#include "snapshot_store.h"
+
+static VM vm;
+static uint32_t stop_after = 0;
+
+// -q: dies after that many snapshots, as a power loss would
+static void snapshot_written(uint32_t saved)
+{
+  if (saved == stop_after) _exit(3);
+}
+
+// Host counterpart of app_main: serves programs arriving on a pty, pipe or
+// stdin and replies the way the device does, until the other end closes.
+// -c keeps the program cache in a file, the host's flash partition, and -s
+// the snapshot of persistent programs, taken every -i ms at most; -n turns
+// the echo of unframed programs off and -t adds telemetry frames.
+// tarto_recv turns reply frames back into text.
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "c:s:i:q:nth")) != -1) {
+    switch (opt) {
+      case 'c':
+        if (!host_region_open(REGION_CACHE, optarg, HOST_CACHE_SIZE)) return 2;
+        break;
+      case 's':
+        if (!host_region_open(REGION_SNAPSHOT, optarg, HOST_SNAPSHOT_SIZE)) return 2;
+        break;
+      case 'i':
+        snapshot_store_set_interval(strtoul(optarg, NULL, 10));
+        break;
+      case 'q':
+        stop_after = strtoul(optarg, NULL, 10);
+        snapshot_store_set_observer(snapshot_written);
+        break;
+      case 'n':
+        usb_serial_set_echo(false);
+        break;
+      case 't':
+        service_set_telemetry(true);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-c cache_file] [-s snapshot_file [-i ms] [-q n]] [-n] [-t] [device]\n", argv[0]);
+        return 2;
+    }
+  }
+  const char *device = optind < argc ? argv[optind] : "-";
+  if (!host_serial_open(device)) return 2;
+
+  // GPIO builtins act on the mock pins of gpio_host.c
+  vm.builtins = &device_builtins;
+  uint32_t failed = service_loop(&vm);
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "builtins.h"
+#include "program_file.h"
+
+#define PROGRAM_MAX 8
+#define EVENT_MAX 16
+
+// Simulated time: every pass of the scheduler takes slice_ms, idling jumps
+// ahead to the next wake up or event, and events fire once their time has
+// come.
+typedef struct {
+  uint32_t at;
+  uint16_t event;
+  bool fired;
+} SimEvent;
+
+typedef struct {
+  Scheduler *scheduler;
+  uint32_t now;
+  uint32_t slice_ms;
+  SimEvent events[EVENT_MAX];
+  int event_size;
+} SimClock;
+
+static void sim_fire(SimClock *sim)
+{
+  for (int i = 0; i < sim->event_size; i++) {
+    SimEvent *e = &sim->events[i];
+    if (!e->fired && (int32_t) (sim->now - e->at) >= 0) {
+      e->fired = true;
+      scheduler_signal(sim->scheduler, e->event);
+    }
+  }
+}
+
+// the next event that has not fired, NULL if there is none
+static SimEvent *sim_next(SimClock *sim)
+{
+  SimEvent *next = NULL;
+  for (int i = 0; i < sim->event_size; i++) {
+    SimEvent *e = &sim->events[i];
+    if (!e->fired && (next == NULL || e->at < next->at)) next = e;
+  }
+  return next;
+}
+
+static uint32_t sim_now(void *ctx)
+{
+  SimClock *sim = ctx;
+  sim_fire(sim);
+  uint32_t now = sim->now;
+  sim->now += sim->slice_ms;
+  return now;
+}
+
+static void sim_idle(void *ctx, uint32_t until)
+{
+  SimClock *sim = ctx;
+  SimEvent *next = sim_next(sim);
+  if (next != NULL && next->at < until) until = next->at;
+  if ((int32_t) (until - sim->now) > 0) sim->now = until;
+}
+
+static const char *state_name(coroutineState state)
+{
+  switch (state) {
+    case COROUTINE_READY: return "ready";
+    case COROUTINE_SLEEPING: return "sleeping";
+    case COROUTINE_WAITING: return "waiting";
+    default: return "done";
+  }
+}
+
+static VM vm;
+static Scheduler scheduler;
+static Coroutine coroutines[PROGRAM_MAX];
+static SimClock sim;
+
+// Runs corpus programs as coroutines of one VM on a simulated clock and
+// prints how each one ended, after how many slices and at which simulated
+// millisecond. Fails when a program does not return its "# expect:" value.
+int main(int argc, char **argv)
+{
+  uint32_t quantum = 100;
+  uint8_t priority = 0;
+  const char *paths[PROGRAM_MAX];
+  long expects[PROGRAM_MAX];
+  uint8_t priorities[PROGRAM_MAX];
+  int size = 0;
+  sim.slice_ms = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+      quantum = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      sim.slice_ms = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      priority = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-S") == 0) {
+      vm.stack_tier = true;
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && sim.event_size < EVENT_MAX) {
+      char *event;
+      SimEvent *e = &sim.events[sim.event_size++];
+      e->at = strtoul(argv[++i], &event, 10);
+      e->event = *event == ':' ? strtoul(event + 1, NULL, 10) : 0;
+    } else if (argv[i][0] != '-' && size < PROGRAM_MAX) {
+      priorities[size] = priority;
+      paths[size++] = argv[i];
+    } else {
+      fprintf(stderr, "usage: %s [-q quantum] [-t ms per slice] [-e ms:event]... [-S] [[-p priority] prog.tvm]...\n", argv[0]);
+      return 2;
+    }
+  }
+
+  scheduler_init(&scheduler, &vm, coroutines, PROGRAM_MAX, quantum);
+  sim.scheduler = &scheduler;
+  scheduler.clock = (SchedulerClock){sim_now, sim_idle, &sim};
+  vm.builtins = &device_builtins;
+  // binary images, so every coroutine gets the sizes its program declares
+  Bytecode programs[PROGRAM_MAX];
+  uint8_t *images[PROGRAM_MAX];
+  for (int i = 0; i < size; i++) {
+    Resources declared;
+    char *hex = read_tvm_file(paths[i], &expects[i], &declared);
+    if (hex == NULL) return 2;
+    uint32_t image_size;
+    images[i] = tvm_to_binary(hex, &declared, &image_size);
+    free(hex);
+    if (!parse_binary(images[i], image_size, &programs[i]) || !load_bytecode(&programs[i])) {
+      fprintf(stderr, "%s: not a valid program\n", paths[i]);
+      return 2;
+    }
+    if (scheduler_spawn(&scheduler, &programs[i], priorities[i]) == NULL) {
+      fprintf(stderr, "%s: out of memory\n", paths[i]);
+      return 2;
+    }
+  }
+
+  // events nobody waits for yet still fire, at their time
+  while (scheduler_run(&scheduler) > 0) {
+    SimEvent *next = sim_next(&sim);
+    if (next == NULL) break;
+    if ((int32_t) (next->at - sim.now) > 0) sim.now = next->at;
+    sim_fire(&sim);
+  }
+
+  int failed = 0;
+  printf("%-14s %8s %8s %8s %8s\n", "program", "priority", "result", "slices", "done_ms");
+  for (int i = 0; i < size; i++) {
+    Coroutine *c = &coroutines[i];
+    long result = c->result.type == SUCCESS ? (long) AS_NUMBER(c->result.return_value) : -1000 - (long) c->result.type;
+    const char *name = strrchr(paths[i], '/') != NULL ? strrchr(paths[i], '/') + 1 : paths[i];
+    if (c->state != COROUTINE_DONE) {
+      printf("%-14s %8u %8s %8u %8s\n", name, c->priority, state_name(c->state), c->slices, "-");
+      failed++;
+      continue;
+    }
+    printf("%-14s %8u %8ld %8u %8u\n", name, c->priority, result, c->slices, c->done_at);
+    if (expects[i] >= 0 && result != expects[i]) {
+      fprintf(stderr, "%s: expected %ld, got %ld\n", name, expects[i], result);
+      failed++;
+    }
+  }
+  scheduler_release(&scheduler);
+  for (int i = 0; i < size; i++) {
+    free_bytecode(&programs[i]);
+    free(images[i]);
+  }
+  return failed > 0 ? 1 : 0;
+}
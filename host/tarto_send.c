@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "peripheral.h"
+#include "program_file.h"
+#include "serial_host.h"
+#include "vm.h"
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-k | -r | -p] [-z] [-b baud [-f]] [-c chunk_bytes] [-d delay_ms] [-o device] program.tvm...\n", argv0);
+}
+
+static bool write_all(int fd, const uint8_t *buf, uint32_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void sleep_ms(int ms)
+{
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+static bool send_program(int fd, const char *path, uint8_t type, bool compress, uint32_t chunk, int delay_ms)
+{
+  long expect;
+  Resources declared;
+  char *hex = read_tvm_file(path, &expect, &declared);
+  if (hex == NULL) return false;
+  uint32_t size;
+  uint8_t *image = tvm_to_binary(hex, &declared, &size);
+
+  if (type == FRAME_RUN_CACHED) {
+    // the program itself stays here, only its hash is sent
+    uint32_t hash = program_hash(image, size);
+    free(image);
+    image = malloc(RUN_CACHED_PAYLOAD_SIZE);
+    image[0] = hash >> 24;
+    image[1] = hash >> 16;
+    image[2] = hash >> 8;
+    image[3] = hash;
+    size = RUN_CACHED_PAYLOAD_SIZE;
+  } else if (compress) {
+    // small programs can come out larger, those go as they are
+    uint32_t compressed_size;
+    uint8_t *compressed = compress_binary(image, size, &compressed_size);
+    if (compressed == NULL) compressed_size = size;
+    fprintf(stderr, "%s: %u -> %u bytes\n", path, size, compressed_size < size ? compressed_size : size);
+    if (compressed_size < size) {
+      free(image);
+      image = compressed;
+      size = compressed_size;
+    } else {
+      free(compressed);
+    }
+  }
+
+  uint8_t header[FRAME_HEADER_SIZE] = {
+    FRAME_SYNC, type, size >> 24, size >> 16, size >> 8, size,
+  };
+  bool ok = write_all(fd, header, sizeof(header));
+  for (uint32_t sent = 0; ok && sent < size; sent += chunk) {
+    uint32_t n = size - sent < chunk ? size - sent : chunk;
+    ok = write_all(fd, image + sent, n);
+    if (delay_ms > 0) sleep_ms(delay_ms);
+  }
+  free(image);
+  free(hex);
+  return ok;
+}
+
+// Asks the device to switch its serial line, then follows it. The device
+// switches once the whole frame is in, so ours can go right after it is
+// out; the pause gives the device time to catch up before the programs.
+static bool set_serial(int fd, uint32_t baud, bool flow_control)
+{
+  uint8_t frame[FRAME_HEADER_SIZE + SET_SERIAL_PAYLOAD_SIZE] = {
+    FRAME_SYNC, FRAME_SET_SERIAL, 0, 0, 0, SET_SERIAL_PAYLOAD_SIZE,
+    baud >> 24, baud >> 16, baud >> 8, baud, flow_control ? SERIAL_FLOW_CONTROL : 0,
+  };
+  if (!write_all(fd, frame, sizeof(frame))) return false;
+  if (!isatty(fd)) return true;
+  tcdrain(fd);
+  if (!host_tty_configure(fd, baud, flow_control)) {
+    fprintf(stderr, "unsupported baud rate %u\n", baud);
+    return false;
+  }
+  sleep_ms(50);
+  return true;
+}
+
+// Sends corpus programs back to back, each as one binary program frame,
+// split into chunks with a pause between them to mimic a slow serial line.
+// -k asks the device to keep the globals of the previous program, -r to
+// run its cached copy of each program instead of sending it again, -z
+// sends them compressed. -b switches the line to another baud rate first,
+// -f with RTS/CTS flow control.
+int main(int argc, char **argv)
+{
+  uint32_t chunk = 64;
+  int delay_ms = 0;
+  uint8_t type = FRAME_PROGRAM;
+  bool compress = false;
+  uint32_t baud = 0;
+  bool flow_control = false;
+  const char *device = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "krpzb:fc:d:o:h")) != -1) {
+    switch (opt) {
+      case 'k': type = FRAME_PROGRAM_KEEP_GLOBALS; break;
+      case 'r': type = FRAME_RUN_CACHED; break;
+      case 'p': type = FRAME_PROGRAM_PERSISTENT; break;
+      case 'z': compress = true; break;
+      case 'b': baud = strtoul(optarg, NULL, 10); break;
+      case 'f': flow_control = true; break;
+      case 'c': chunk = atoi(optarg); break;
+      case 'd': delay_ms = atoi(optarg); break;
+      case 'o': device = optarg; break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+  if (optind >= argc || chunk == 0 || (flow_control && baud == 0)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  int fd = 1;
+  if (device != NULL && (fd = open(device, O_WRONLY | O_NOCTTY)) < 0) {
+    perror(device);
+    return 2;
+  }
+  bool ok = baud == 0 || set_serial(fd, baud, flow_control);
+  for (int i = optind; ok && i < argc; i++) {
+    ok = send_program(fd, argv[i], type, compress, chunk, delay_ms);
+  }
+  return ok ? 0 : 1;
+}